@@ -1,61 +1,299 @@
-#include "linked_list.h"
 #include "mfa.h"
+#include "mfa_walk.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-/* Usage:
-   ./mfa <archive.mfa> <pass> <file1> [file2 ...]
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options] <out_archive> <pass> <file|dir> [file|dir...]\n"
+            "       %s [options] get <archive> <name> [out|-]\n"
+            "       %s [options] cat <archive> <name> <offset> <length>\n"
+            "       %s [options] verify <archive>\n"
+            "       %s [options] add <archive> <file|dir> [file|dir...]\n"
+            "       %s [options] pack <archive|-> <file|dir> [file|dir...]\n"
+            "       %s [options] extract <archive|-> [dir]\n"
+            "Options: --max-memory=SIZE --codec=auto|raw|rle|lz|huf|lzh --jobs=N --no-index --no-dedup\n"
+            "         --no-delta (no delta filter for bitmaps and fixed-width records)\n"
+            "         --solid[=SIZE] (files up to SIZE, default 64K, share coded blocks)\n"
+            "         --dict[=SIZE] (train a shared dictionary, default 32K, max 60K)\n"
+            "         --pass=PASS (for get/cat/verify/add on encrypted archives)\n"
+            "         --stream (pack: one-pass layout, as used for pipes and -;\n"
+            "                   extract: read it front to back, as from -)\n"
+            "         --io=auto|stdio|uring (file I/O for many small files;\n"
+            "                   auto batches through io_uring where available)\n"
+            "         --stats[=table|json] (per-phase timings on stderr)\n",
+            prog, prog, prog, prog, prog, prog, prog);
+}
+
+/* Usage (inputs may be files or directories, walked recursively):
+   ./mfa [options] <archive.mfa> <pass> <file1> [file2 ...]   pack, list, extract
+   ./mfa [options] get <archive.mfa> <name> [out|-]           extract one entry
+   ./mfa [options] cat <archive.mfa> <name> <offset> <length> byte range to stdout
+   ./mfa [options] verify <archive.mfa>                       check all checksums
+   ./mfa [options] add <archive.mfa> <file1> [file2 ...]      append entries
+   ./mfa [options] pack <archive.mfa|-> <file1> [file2 ...]   pack only ("-": stdout)
+   ./mfa [options] extract <archive.mfa|-> [dir]              extract only ("-": stdin)
 */
-int main(int argc, char **argv) {
-    if (argc < 4) {
-        fprintf(stderr, "Usage: %s <out_archive> <pass> <file1> [file2...]\n", argv[0]);
-        return 1;
+
+/* Write a byte range of one entry to stdout, a block at a time. */
+static int cat_range(const char *archive, const char *name,
+                     const char *off_s, const char *len_s, const mfa_options *opts) {
+    uint64_t off, len;
+    uint8_t *buf;
+    const size_t cap = 1024u * 1024u;
+    int rc = 0;
+
+    if (mfa_parse_size(off_s, &off) != 0 || mfa_parse_size(len_s, &len) != 0) {
+        fprintf(stderr, "Invalid range: %s %s\n", off_s, len_s);
+        return -1;
     }
+    buf = (uint8_t *)malloc(cap);
+    if (!buf) { perror("malloc"); return -1; }
 
-    const char *archive_path = argv[1];
-    const char *pass         = argv[2];
-    size_t file_count        = (size_t)(argc - 3);
+    while (len) {
+        size_t want = len > cap ? cap : (size_t)len;
+        long long got = mfa_read_range_ex(archive, name, off, want, buf, opts);
+        if (got < 0) { rc = -1; break; }
+        if (got == 0) break;
+        if (fwrite(buf, 1, (size_t)got, stdout) != (size_t)got) { perror("fwrite"); rc = -1; break; }
+        off += (uint64_t)got;
+        len -= (uint64_t)got;
+    }
+    free(buf);
+    return rc;
+}
+
+/* Fill files from the command-line inputs paths[0..n): files are
+   stored under their basename, directories walked recursively with
+   their relative paths kept. Sorted by path. */
+static int collect_inputs(mfa_file_table *files, char **paths, size_t n) {
     size_t i;
 
-    /* Build file table */
-    linked_list *files = ll_create();
+    for (i = 0; i < n; ++i) {
+        if (mfa_is_dir(paths[i])) {
+            if (mfa_walk(files, paths[i], 0) != 0) return -1;
+        } else if (mfa_files_add(files, paths[i]) != 0) {
+            perror("malloc");
+            return -1;
+        }
+    }
+    if (mfa_sort_paths(files) != 0) {
+        fprintf(stderr, "Failed to sort input files.\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* Append paths[0..n) to an existing archive, compressed with the
+   chosen codec. */
+static int add_files(const char *archive, char **paths, size_t n,
+                     const mfa_options *opts) {
+    mfa_file_table files;
+    int rc;
+
+    mfa_files_init(&files);
+    rc = collect_inputs(&files, paths, n);
+    if (rc == 0) rc = mfa_append(archive, &files, opts->pass, MFA_COMPRESS, opts);
+    if (rc == 0) printf("Added %lu entries to %s\n", (unsigned long)files.count, archive);
+    mfa_files_free(&files);
+    return rc;
+}
+
+/* Pack paths[0..n) into archive ("-" for stdout), compressed, and
+   encrypted if a --pass was given. */
+static int pack_files(const char *archive, char **paths, size_t n,
+                      const mfa_options *opts) {
+    mfa_file_table files;
+    unsigned flags = MFA_COMPRESS;
+    int rc;
 
-    if (!files) { perror("calloc"); return 1; }
-    for (i = 0; i < file_count; ++i) {
-        mfa_file *f = (mfa_file *)malloc(sizeof(mfa_file));
-        f->path = argv[3 + i];
-        f->buf  = NULL;
-        f->len  = 0;
-        ll_append(files, f);
+    if (opts->pass && *opts->pass) flags |= MFA_ENCRYPT;
+    mfa_files_init(&files);
+    rc = collect_inputs(&files, paths, n);
+    if (rc == 0) rc = mfa_pack_ex(archive, &files, opts->pass, flags, opts);
+    if (rc == 0 && strcmp(archive, "-") != 0)
+        printf("Archive created: %s (%lu entries)\n", archive, (unsigned long)files.count);
+    mfa_files_free(&files);
+    return rc;
+}
+
+/* Report --stats (if on) and map rc to an exit status. */
+static int finish(const mfa_options *opts, int stats_json, int rc) {
+    if (opts->stats) mfa_stats_print(opts->stats, stderr, stats_json);
+    return rc == 0 ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+    mfa_options opts;
+    mfa_stats stats;
+    int stats_json = 0;
+    int argi = 1;
+
+    mfa_options_init(&opts);
+
+    /* Options precede the positional arguments */
+    for (; argi < argc && strncmp(argv[argi], "--", 2) == 0; ++argi) {
+        const char *arg = argv[argi];
+        if (strncmp(arg, "--max-memory=", 13) == 0) {
+            uint64_t v;
+            if (mfa_parse_size(arg + 13, &v) != 0 || v == 0) {
+                fprintf(stderr, "Invalid size: %s\n", arg + 13);
+                return 1;
+            }
+            opts.max_memory = (size_t)v;
+        } else if (strcmp(arg, "--codec=auto") == 0) {
+            opts.codec = MFA_CODEC_AUTO;
+        } else if (strncmp(arg, "--codec=", 8) == 0) {
+            const mfa_codec *codec = mfa_codec_by_name(arg + 8);
+            if (!codec) {
+                fprintf(stderr, "Unknown codec: %s\n", arg + 8);
+                return 1;
+            }
+            opts.codec = codec->id;
+        } else if (strncmp(arg, "--jobs=", 7) == 0) {
+            char *end;
+            unsigned long v = strtoul(arg + 7, &end, 10);
+            if (end == arg + 7 || *end) {
+                fprintf(stderr, "Invalid job count: %s\n", arg + 7);
+                return 1;
+            }
+            opts.jobs = (unsigned)v;
+        } else if (strcmp(arg, "--no-index") == 0) {
+            opts.name_index = 0;
+        } else if (strcmp(arg, "--no-dedup") == 0) {
+            opts.dedup = 0;
+        } else if (strcmp(arg, "--no-delta") == 0) {
+            opts.delta = 0;
+        } else if (strcmp(arg, "--solid") == 0) {
+            opts.solid = 64u * 1024u;
+        } else if (strncmp(arg, "--solid=", 8) == 0) {
+            if (mfa_parse_size(arg + 8, &opts.solid) != 0) {
+                fprintf(stderr, "Invalid size: %s\n", arg + 8);
+                return 1;
+            }
+        } else if (strcmp(arg, "--dict") == 0) {
+            opts.dict = 32u * 1024u;
+        } else if (strncmp(arg, "--dict=", 7) == 0) {
+            if (mfa_parse_size(arg + 7, &opts.dict) != 0) {
+                fprintf(stderr, "Invalid size: %s\n", arg + 7);
+                return 1;
+            }
+        } else if (strcmp(arg, "--stream") == 0) {
+            opts.stream = 1;
+        } else if (strcmp(arg, "--io=auto") == 0) {
+            opts.io = MFA_IO_AUTO;
+        } else if (strcmp(arg, "--io=stdio") == 0) {
+            opts.io = MFA_IO_STDIO;
+        } else if (strcmp(arg, "--io=uring") == 0) {
+            opts.io = MFA_IO_URING;
+        } else if (strncmp(arg, "--pass=", 7) == 0) {
+            opts.pass = arg + 7;
+        } else if (strcmp(arg, "--stats") == 0 || strcmp(arg, "--stats=table") == 0 ||
+                   strcmp(arg, "--stats=json") == 0) {
+            mfa_stats_init(&stats);
+            opts.stats = &stats;
+            stats_json = strcmp(arg, "--stats=json") == 0;
+        } else if (strcmp(arg, "--") == 0) {
+            ++argi;
+            break;
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", arg);
+            usage(argv[0]);
+            return 1;
+        }
     }
 
-    /* Sort paths alphabetically by file name for consistent order */
-    if(mfa_sort_paths(files) != 0) {
-        fprintf(stderr, "Failed to sort input files.\n");
-        ll_free(files);
+    if (argi < argc && strcmp(argv[argi], "get") == 0) {
+        if (argc - argi < 3 || argc - argi > 4) {
+            usage(argv[0]);
+            return 1;
+        }
+        return finish(&opts, stats_json,
+                      mfa_extract_one_ex(argv[argi + 1], argv[argi + 2],
+                                         argc - argi == 4 ? argv[argi + 3] : NULL, &opts));
+    }
+
+    if (argi < argc && strcmp(argv[argi], "verify") == 0) {
+        if (argc - argi != 2) {
+            usage(argv[0]);
+            return 1;
+        }
+        return finish(&opts, stats_json, mfa_verify(argv[argi + 1], &opts));
+    }
+
+    if (argi < argc && strcmp(argv[argi], "cat") == 0) {
+        if (argc - argi != 5) {
+            usage(argv[0]);
+            return 1;
+        }
+        return finish(&opts, stats_json,
+                      cat_range(argv[argi + 1], argv[argi + 2],
+                                argv[argi + 3], argv[argi + 4], &opts));
+    }
+
+    if (argi < argc && strcmp(argv[argi], "add") == 0) {
+        if (argc - argi < 3) {
+            usage(argv[0]);
+            return 1;
+        }
+        return finish(&opts, stats_json,
+                      add_files(argv[argi + 1], argv + argi + 2,
+                                (size_t)(argc - argi - 2), &opts));
+    }
+
+    if (argi < argc && strcmp(argv[argi], "pack") == 0) {
+        if (argc - argi < 3) {
+            usage(argv[0]);
+            return 1;
+        }
+        return finish(&opts, stats_json,
+                      pack_files(argv[argi + 1], argv + argi + 2,
+                                 (size_t)(argc - argi - 2), &opts));
+    }
+
+    if (argi < argc && strcmp(argv[argi], "extract") == 0) {
+        const char *dir;
+        if (argc - argi < 2 || argc - argi > 3) {
+            usage(argv[0]);
+            return 1;
+        }
+        dir = argc - argi == 3 ? argv[argi + 2] : ".";
+        if (opts.stream || strcmp(argv[argi + 1], "-") == 0)
+            return finish(&opts, stats_json, mfa_extract_stream(argv[argi + 1], dir, &opts));
+        return finish(&opts, stats_json, mfa_extract_all_ex(argv[argi + 1], dir, &opts));
+    }
+
+    if (argc - argi < 3) {
+        usage(argv[0]);
         return 1;
     }
 
-    /* Load files into memory */
-    if (mfa_load_all(files) != 0) {
-        fprintf(stderr, "Failed to load input files.\n");
-        ll_free(files);
+    const char *archive_path = argv[argi];
+    const char *pass         = argv[argi + 1];
+    size_t file_count        = (size_t)(argc - argi - 2);
+
+    /* Build file table; directories are walked recursively and the
+       result sorted by path for a consistent order */
+    mfa_file_table files;
+
+    mfa_files_init(&files);
+    if (collect_inputs(&files, argv + argi + 2, file_count) != 0) {
+        mfa_files_free(&files);
         return 1;
     }
 
-    /* Pack archive with both compression+encryption flags (compression is no-op for now) */
-    if (mfa_pack(archive_path, files, pass, MFA_COMPRESS | MFA_ENCRYPT) != 0) {
+    /* Pack archive compressed and encrypted with `pass`.
+       Inputs are streamed from disk, so memory use is bounded by opts.max_memory. */
+    if (mfa_pack_ex(archive_path, &files, pass, MFA_COMPRESS | MFA_ENCRYPT, &opts) != 0) {
         fprintf(stderr, "Failed to create archive.\n");
-        mfa_free_all(files);
-        ll_free(files);
+        mfa_files_free(&files);
         return 1;
     }
 
     printf("Archive created: %s\n", archive_path);
 
-    /* Clean up file buffers */
-    mfa_free_all(files);
-    ll_free(files);
+    mfa_files_free(&files);
 
     /* List archive contents */
     printf("\nListing archive:\n");
@@ -66,11 +304,12 @@ int main(int argc, char **argv) {
 
     /* Extract archive */
     printf("\nExtracting archive:\n");
-    if (mfa_extract_all(archive_path, ".") != 0) {
+    opts.pass = pass;
+    if (mfa_extract_all_ex(archive_path, ".", &opts) != 0) {
         fprintf(stderr, "Extraction failed.\n");
         return 1;
     }
 
     printf("Extraction complete.\n");
-    return 0;
+    return finish(&opts, stats_json, 0);
 }
@@ -1,106 +1,487 @@
+#define _GNU_SOURCE  /* copy_file_range */
+
 #include "mfa.h"
 #include "mfa_util.h"
-#include "linked_list.h"
+#include "mfa_pipeline.h"
+#include "mfa_codec.h"
+#include "mfa_train.h"
+#include "mfa_filter.h"
+#include "mfa_hash.h"
+#include "mfa_crypto.h"
+#include "mfa_uring.h"
 
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 
 /* ============================================================
-   Transforms (currently disabled)
+   Transforms
+   ------------------------------------------------------------
+   A compressed entry is split into blocks of 2^block_log2 input
+   bytes (the last may be shorter), each coded independently and
+   stored back to back from data_offset. The per-entry block table
+   lives in the TOC record's meta area, so any block can be found
+   and decoded without touching the others. The codec (alg_id) is
+   per entry: by default each is picked from a sample of the
+   entry's first block (mfa_codec_pick), raw included. Entries
+   that look like bitmaps or fixed-width records are also delta
+   filtered ahead of the codec (mfa_delta_detect), each block on
+   its own.
+
+   Encrypted entries are always split into blocks, compressed or
+   not. Each block's stored bytes are XORed with ChaCha20 under
+   the archive key and a nonce of the entry's 8-byte nonce
+   followed by the u32 block index, counter starting at 0, so
+   blocks are encrypted and decrypted independently too.
    ============================================================ */
 
-/* Simple RLE compression stub: disabled (no-op) */
-static int tf_compress(uint8_t **pbuf, size_t *plen) {
-    (void)pbuf; (void)plen;
+/* Per-entry meta area: a list of records
+     u16 tag, u16 len, payload[len]
+   Readers skip tags they do not know. */
+#define META_REC_HDR  4u
+
+/* META_BLOCKS payload:
+     u8 block_log2, u8[3] 0,
+     u32 stored size per block (bit 31 set: stored uncompressed) */
+#define META_BLOCKS   1u
+#define BLOCK_RAW     0x80000000u
+#define BLOCK_LOG2_MAX 20u     /* MFA_MAX_CHUNK: no larger block is written */
+#define MAX_BLOCKS    16000u   /* keeps the table within meta_len */
+
+/* META_CRC32C payload: u32 CRC32C of the entry's original bytes */
+#define META_CRC32C   2u
+
+/* META_MAC payload, in place of META_CRC32C for encrypted entries:
+   u8[16] Poly1305 tag of the entry's original bytes (see below) */
+#define META_MAC      5u
+#define MAC_INDEX     0x80000000u  /* block index of the one-time keys */
+#define TOC_MAC_INDEX (MAC_INDEX - 1u)  /* ... and of EXT_TOCMAC's */
+
+/* META_NONCE payload: u8[8] entry nonce (encrypted entries) */
+#define META_NONCE    3u
+#define ENTRY_NONCE   8u
+
+/* META_SOLID payload, for entries flagged ENTRY_SOLID:
+     u32 offset of the entry within the block's original bytes,
+     u32 original length of the block,
+     u32 stored size of the block (bit 31: stored uncompressed)
+   Small entries are concatenated into one shared block, coded (and
+   encrypted, nonce from META_NONCE, block index 0) as a whole and
+   stored at data_offset/stored_size. Members of a block share those
+   and its nonce; reading one decodes just that block. */
+#define META_SOLID    4u
+#define SOLID_META    12u
+#define ENTRY_SOLID   (1u << 2)     /* entry flag, beside MFA_COMPRESS/ENCRYPT */
+#define SOLID_BLOCK   (256u * 1024u) /* original bytes per solid block, at most */
+
+/* Entries of a streamed archive carry ENTRY_FRAMED: each stored
+   block is preceded by its u32 table word, so a reader without the
+   TOC can still find where it ends. stored_size counts the words. */
+#define ENTRY_FRAMED  (1u << 3)
+#define BLOCK_FRAME   4u
+
+/* Entries whose blocks were coded with the archive's trained
+   dictionary (EXT_DICT) carry ENTRY_DICT. */
+#define ENTRY_DICT    (1u << 4)
+
+/* Entries delta-filtered before coding (see mfa_filter.h) carry
+   ENTRY_DELTA and the filter's stride in the top 16 flag bits.
+   All their blocks are filtered, those stored raw included. */
+#define ENTRY_DELTA   (1u << 5)
+#define ENTRY_STRIDE(flags) ((unsigned)((flags) >> 16))
+
+/* Per-chunk work for the pack pipeline. */
+typedef struct {
+    uint16_t        *algs;       /* per stream: codec of its blocks, or
+                                    MFA_ALG_RAW to store them uncompressed */
+    int              pick;       /* algs[] picked from each stream's first chunk */
+    uint16_t        *strides;    /* per stream: delta filter stride, or 0 */
+    int              delta;      /* strides[] detected from each first chunk */
+    const mfa_codec *widest;     /* largest bound of the codecs in algs[] */
+    const mfa_dict  *dict;       /* for codecs that take one, or NULL */
+    int              encrypt;
+    uint8_t          key[MFA_KEY_LEN];
+    const uint8_t   *nonces;     /* ENTRY_NONCE bytes per stored entry */
+} pack_ctx;
+
+/* Compress one chunk, with dict if the codec takes one. On return
+   *payload points at the bytes to store (out, or in itself when
+   coding would not shrink it). */
+static int tf_compress(const mfa_codec *codec, const mfa_dict *dict,
+                       const uint8_t *in, size_t len, uint8_t *out, size_t cap,
+                       const uint8_t **payload, size_t *payload_len, int *raw) {
+    size_t n = 0;
+    int rc = dict && codec->encode_dict ? codec->encode_dict(dict, in, len, out, cap, &n)
+                                        : codec->encode(in, len, out, cap, &n);
+    if (rc == 0 && n < len) {
+        *payload = out; *payload_len = n; *raw = 0;
+    } else {
+        *payload = in; *payload_len = len; *raw = 1;
+    }
     return 0;
 }
 
-/* RLE decompression stub: disabled (no-op) */
-static int tf_decompress_rle(const uint8_t *in, size_t in_len,
-                             uint8_t **out_buf, size_t *out_len,
-                             uint64_t expected_out_len) {
-    (void)in; (void)in_len; (void)out_buf; (void)out_len; (void)expected_out_len;
-    return 0;
+/* Nonce for block k of an entry. */
+static void block_nonce(uint8_t nonce[MFA_NONCE_LEN], const uint8_t *entry_nonce, uint64_t k) {
+    memcpy(nonce, entry_nonce, ENTRY_NONCE);
+    mfa_st32(nonce + ENTRY_NONCE, (uint32_t)k);
 }
 
-/* Encryption: disabled (no-op) */
-static int tf_xor_encrypt(uint8_t **pbuf, size_t *plen, const char *pass) {
-    (void)pbuf; (void)plen; (void)pass;
+/* Pipeline hooks: code one chunk on a worker thread.
+   Filtered chunks go to the front of the scratch buffer, coded
+   ones behind them. */
+static size_t pack_out_bound(size_t n, void *ctx) {
+    const pack_ctx *x = (const pack_ctx *)ctx;
+    return (x->widest ? x->widest->bound(n) : n) + (x->delta ? n : 0);
+}
+
+/* Pipeline hook: settle stream c->file_index's delta stride and
+   pick its codec from a sample of its first chunk, filtered as
+   the stream will be, before any of its chunks is coded. */
+static int pack_first_chunk(const mfa_chunk *c, void *ctx) {
+    pack_ctx *x = (pack_ctx *)ctx;
+    size_t s = c->file_index;
+    unsigned stride = x->delta ? mfa_delta_detect(c->data, c->len) : 0;
+    uint8_t *tmp = NULL;
+
+    if (x->pick && stride) {
+        tmp = (uint8_t *)malloc(c->len);
+        if (!tmp) { perror("malloc"); return -1; }
+        mfa_delta_encode(c->data, tmp, c->len, stride);
+    }
+    if (x->pick) x->algs[s] = mfa_codec_pick(tmp ? tmp : c->data, c->len);
+    if (x->delta) x->strides[s] = (uint16_t)(x->algs[s] != MFA_ALG_RAW ? stride : 0);
+    free(tmp);
     return 0;
 }
 
-/* Decryption: disabled (no-op) */
-/*static int tf_xor_detcrypt(uint8_t **pbuf, size_t *plen, const char *pass) {
-    (void)pbuf; (void)plen; (void)pass;
+static int pack_transform(mfa_chunk *c, void *ctx) {
+    const pack_ctx *x = (const pack_ctx *)ctx;
+    uint16_t alg = x->algs[c->file_index];
+    unsigned stride = x->strides ? x->strides[c->file_index] : 0;
+
+    if (alg != MFA_ALG_RAW && stride) {
+        mfa_delta_encode(c->data, c->out, c->len, stride);
+        tf_compress(mfa_codec_get(alg), x->dict, c->out, c->len, c->out + c->len,
+                    c->out_cap - c->len, &c->payload, &c->payload_len, &c->raw);
+    } else if (alg != MFA_ALG_RAW) {
+        tf_compress(mfa_codec_get(alg), x->dict, c->data, c->len, c->out, c->out_cap,
+                    &c->payload, &c->payload_len, &c->raw);
+    } else {
+        c->payload = c->data; c->payload_len = c->len; c->raw = 1;
+    }
+
+    /* Encrypt into the scratch buffer: data must stay plaintext for
+       the writer's checksum. */
+    if (x->encrypt && c->payload_len) {
+        uint8_t nonce[MFA_NONCE_LEN];
+        block_nonce(nonce, x->nonces + c->file_index * ENTRY_NONCE, c->index);
+        mfa_chacha20_xor(x->key, nonce, 0, c->payload, c->out, c->payload_len);
+        c->payload = c->out;
+    }
     return 0;
-}*/
+}
+
+/* Decompress one block payload into exactly out_len bytes; dict is
+   set for blocks of ENTRY_DICT entries. */
+static int tf_decompress(const mfa_codec *codec, const mfa_dict *dict,
+                         const uint8_t *in, size_t in_len,
+                         uint8_t *out, size_t out_len, int raw) {
+    if (raw) {
+        if (in_len != out_len) return -1;
+        memcpy(out, in, in_len);
+        return 0;
+    }
+    if (dict) return codec->decode_dict(dict, in, in_len, out, out_len);
+    return codec->decode(in, in_len, out, out_len);
+}
+
+/* ============================================================
+   Extension area and name index
+   ------------------------------------------------------------
+   The 12 reserved header bytes hold ext_off (u64) and ext_len
+   (u32) of an optional extension area: a list of records
+     u16 tag, u16 flags (0), u32 len, payload[len]
+   Readers skip tags they do not know.
+
+   EXT_INDEX points at an open-addressing hash table of nslots
+   (a power of two) slots, each
+     u64 name hash (0 = empty), u64 offset of the TOC record
+   keyed by FNV-1a 64 of the stored entry name, probed linearly.
+
+   EXT_CRYPT marks an encrypted archive and holds how to get its
+   key from the passphrase:
+     u16 kdf (1 = PBKDF2-HMAC-SHA256), u16 cipher (1 = ChaCha20),
+     u32 iterations, u8 salt[16], u8 check[8]
+   where check is the first keystream bytes under an all-0xFF
+   nonce, which lets a wrong passphrase be reported up front.
+
+   EXT_DICT holds the dictionary that ENTRY_DICT entries were
+   coded with (see mfa_train.h):
+     u8 nonce[8], dictionary bytes
+   In an encrypted archive the bytes are encrypted under the
+   nonce, block index 0; otherwise the nonce is zero. A streamed
+   archive carries the record in both its extension areas, so a
+   front-to-back reader has it before the first entry.
+
+   EXT_TOCMAC, last in an encrypted archive's extension area,
+   authenticates what the entries' META_MAC tags do not:
+     u8 nonce[8], u8 tag[16]
+   tag being the Poly1305 tag of
+     u32 count, the count TOC records, the extension records
+     before this one
+   under the one-time key at block index TOC_MAC_INDEX of nonce
+   (see Content checksums). The name index is not covered, so a
+   keyed reader finds entries in the checked TOC instead. A
+   front-to-back reader of a streamed archive never sees the
+   TOC: it checks entry contents, not local record fields.
+   ============================================================ */
+
+#define EXT_REC_HDR   8u
+#define EXT_INDEX     1u
+#define EXT_CRYPT     2u
+#define EXT_DICT      3u
+#define EXT_TOCMAC    4u
+#define TOCMAC_LEN    (ENTRY_NONCE + MFA_TAG_LEN)
+#define INDEX_SLOT    16u
+
+#define CRYPT_LEN     32u
+#define KDF_PBKDF2    1u
+#define CIPHER_CHACHA 1u
+#define KDF_ITERATIONS 200000u
+/* Most iterations a reader will run: the count comes from the
+   archive, and deriving the key is the first thing done with it */
+#define KDF_ITERATIONS_MAX (16u * KDF_ITERATIONS)
+#define KDF_SALT      16u
+#define KEY_CHECK     8u
+
+static uint64_t name_hash(const char *s, size_t n) {
+    uint64_t h = 14695981039346656037ULL;
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        h ^= (uint8_t)s[i];
+        h *= 1099511628211ULL;
+    }
+    return h ? h : 1;  /* 0 marks an empty slot */
+}
+
+static uint32_t index_slots_for(size_t n) {
+    uint32_t slots = 8;
+    while (slots < 2 * (uint64_t)n) slots <<= 1;
+    return slots;
+}
+
+/* Name an entry is stored under: its relative path for files found
+   by a directory walk, else the file's basename. */
+static const char *pack_name(const mfa_file *file) {
+    return file->name ? file->name : mfa_basename(file->path);
+}
+
+/* Write the name index for n entries with name hashes hashes[]
+   whose TOC records start at entry_pos[]. */
+static int write_name_index(FILE *f, const uint64_t *hashes, size_t n,
+                            const uint64_t *entry_pos, uint32_t nslots) {
+    uint8_t *table;
+    uint32_t mask = nslots - 1;
+    size_t i;
+    int rc;
+
+    table = (uint8_t *)calloc(nslots, INDEX_SLOT);
+    if (!table) { perror("calloc"); return -1; }
+
+    for (i = 0; i < n; ++i) {
+        uint64_t h = hashes[i];
+        uint32_t k = (uint32_t)h & mask;
+        while (mfa_ld64(table + (size_t)k * INDEX_SLOT) != 0) k = (k + 1) & mask;
+        mfa_st64(table + (size_t)k * INDEX_SLOT, h);
+        mfa_st64(table + (size_t)k * INDEX_SLOT + 8, entry_pos[i]);
+    }
+
+    rc = mfa_write_exact(f, table, (size_t)nslots * INDEX_SLOT);
+    free(table);
+    return rc;
+}
+
+/* The KDF is slow on purpose; remember the last key derived so that
+   repeated opens of one archive (e.g. range reads) pay for it once. */
+static struct {
+    int      valid;
+    uint8_t  pass_hash[32];
+    uint8_t  salt[KDF_SALT];
+    uint32_t iterations;
+    uint8_t  key[MFA_KEY_LEN];
+} kdf_cache;
+static pthread_mutex_t kdf_mu = PTHREAD_MUTEX_INITIALIZER;
+
+static void derive_key(const char *pass, const uint8_t *salt, uint32_t iterations,
+                       uint8_t key[MFA_KEY_LEN]) {
+    uint8_t ph[32];
+
+    mfa_sha256(pass, strlen(pass), ph);
+    pthread_mutex_lock(&kdf_mu);
+    if (!kdf_cache.valid || kdf_cache.iterations != iterations ||
+        memcmp(kdf_cache.pass_hash, ph, 32) != 0 ||
+        memcmp(kdf_cache.salt, salt, KDF_SALT) != 0) {
+        mfa_pbkdf2_sha256(pass, strlen(pass), salt, KDF_SALT, iterations,
+                          kdf_cache.key, MFA_KEY_LEN);
+        memcpy(kdf_cache.pass_hash, ph, 32);
+        memcpy(kdf_cache.salt, salt, KDF_SALT);
+        kdf_cache.iterations = iterations;
+        kdf_cache.valid = 1;
+    }
+    memcpy(key, kdf_cache.key, MFA_KEY_LEN);
+    pthread_mutex_unlock(&kdf_mu);
+}
+
+static void key_check(const uint8_t key[MFA_KEY_LEN], uint8_t check[KEY_CHECK]) {
+    uint8_t nonce[MFA_NONCE_LEN];
+    memset(nonce, 0xFF, sizeof nonce);
+    memset(check, 0, KEY_CHECK);
+    mfa_chacha20_xor(key, nonce, 0, check, check, KEY_CHECK);
+}
 
 /* ============================================================
    Loading & freeing
    ============================================================ */
 
-int mfa_load_all(linked_list *files) {
-    linked_list_node *node;
-    size_t processed;
+/* Files per io_uring submission window when loading or extracting
+   many files (see mfa_uring.h). */
+#define IO_BATCH_FILES  256u
 
-    if (!files) return -1;
+int mfa_load_all(mfa_file_table *files) {
+    return mfa_load_all_ex(files, NULL);
+}
 
-    node = files->head;
-    processed = 0;
+/* Read the file at `path` whole into a new buffer. */
+static int load_path(const char *path, uint8_t **out, size_t *out_len) {
+    FILE *f;
+    off_t sz;
+    uint8_t *buf;
+
+    f = fopen(path, "rb");
+    if (!f) { perror(path); return -1; }
+
+    if (fseeko(f, 0, SEEK_END) != 0) { perror("fseeko"); fclose(f); return -1; }
+    sz = ftello(f);
+    if (sz < 0) { perror("ftello"); fclose(f); return -1; }
+    if ((uint64_t)sz > (size_t)-1) { fprintf(stderr, "%s: too large to load\n", path); fclose(f); return -1; }
+    rewind(f);
+
+    buf = (uint8_t *)malloc(sz ? (size_t)sz : 1);
+    if (!buf) { perror("malloc"); fclose(f); return -1; }
+
+    if (mfa_read_exact(f, buf, (size_t)sz)) { perror("fread"); free(buf); fclose(f); return -1; }
+    if (fclose(f) != 0) { perror("fclose"); free(buf); return -1; }
+
+    *out = buf;
+    *out_len = (size_t)sz;
+    return 0;
+}
+
+/* Ring for batched file I/O as opt->io asks, or NULL for plain
+   calls. Fails only if io_uring was required and is unavailable. */
+static int io_ring_open(const mfa_options *opt, unsigned files, mfa_uring **u) {
+    unsigned io = opt ? opt->io : MFA_IO_AUTO;
+
+    *u = NULL;
+    if (io == MFA_IO_STDIO) return 0;
+    *u = mfa_uring_open(files);
+    if (!*u && io == MFA_IO_URING) {
+        fprintf(stderr, "io_uring is not available\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* Load every file through the ring; all or nothing. Files too large
+   for one ring read are loaded with stdio. */
+static int load_batched(mfa_uring *u, mfa_file_table *files) {
+    mfa_uring_file *uf = (mfa_uring_file *)calloc(files->count ? files->count : 1, sizeof *uf);
+    size_t i;
+    int rc = 0;
 
-    for (; node; node = node->next, ++processed) {
-        mfa_file *file;
-        FILE *f;
-        long sz;
-        uint8_t *buf;
+    if (!uf) { perror("calloc"); return -1; }
+    for (i = 0; i < files->count; ++i) {
+        uf[i].path = files->files[i].path;
+        if (!uf[i].path) { free(uf); return -1; }
+    }
+    if (mfa_uring_read(u, uf, files->count)) { perror("io_uring"); rc = -1; }
 
-        if (!node->data) return -1;
-        file = (mfa_file *)node->data;
-        if (!file || !file->path) return -1;
+    for (i = 0; i < files->count && rc == 0; ++i) {
+        if (uf[i].err == EFBIG) {
+            rc = load_path(uf[i].path, &uf[i].buf, &uf[i].len);
+        } else if (uf[i].err) {
+            fprintf(stderr, "%s: %s\n", uf[i].path, strerror(uf[i].err));
+            rc = -1;
+        }
+    }
+    for (i = 0; i < files->count; ++i) {
+        if (rc == 0) {
+            files->files[i].buf = uf[i].buf;
+            files->files[i].len = uf[i].len;
+        } else {
+            free(uf[i].buf);
+        }
+    }
+    free(uf);
+    return rc;
+}
 
-        f = fopen(file->path, "rb");
-        if (!f) { perror(file->path); goto fail; }
+int mfa_load_all_ex(mfa_file_table *files, const mfa_options *opt) {
+    mfa_stats *stats = opt ? opt->stats : NULL;
+    mfa_phase_mark mark;
+    mfa_uring *ring;
+    uint64_t loaded = 0;
+    size_t processed;
 
-        if (fseek(f, 0, SEEK_END) != 0) { perror("fseek"); fclose(f); goto fail; }
-        sz = ftell(f);
-        if (sz < 0) { perror("ftell"); fclose(f); goto fail; }
-        rewind(f);
+    if (!files) return -1;
+    mfa_phase_begin(stats, &mark);
 
-        buf = (uint8_t *)malloc((size_t)sz);
-        if (!buf) { perror("malloc"); fclose(f); goto fail; }
+    if (io_ring_open(opt, IO_BATCH_FILES, &ring)) return -1;
+    if (ring) {
+        int rc = load_batched(ring, files);
+        mfa_uring_close(ring);
+        if (rc) return -1;
+        for (processed = 0; processed < files->count; ++processed)
+            loaded += files->files[processed].len;
+        mfa_phase_end(stats, MFA_PHASE_LOAD, &mark, loaded, loaded);
+        return 0;
+    }
 
-        if (mfa_read_exact(f, buf, (size_t)sz)) { perror("fread"); free(buf); fclose(f); goto fail; }
-        if (fclose(f) != 0) { perror("fclose"); free(buf); goto fail; }
+    for (processed = 0; processed < files->count; ++processed) {
+        mfa_file *file = &files->files[processed];
 
-        file->buf = buf;
-        file->len = (size_t)sz;
+        if (!file->path) goto fail;
+        if (load_path(file->path, &file->buf, &file->len)) goto fail;
+        loaded += file->len;
     }
+    mfa_phase_end(stats, MFA_PHASE_LOAD, &mark, loaded, loaded);
     return 0;
 
 fail:
-    node = files->head;
-    for (; processed > 0 && node; --processed, node = node->next) {
-        mfa_file *f2 = (mfa_file *)node->data;
-        if (f2) { free(f2->buf); f2->buf = NULL; f2->len = 0; }
+    while (processed > 0) {
+        mfa_file *f2 = &files->files[--processed];
+        free(f2->buf); f2->buf = NULL; f2->len = 0;
     }
     return -1;
 }
 
-void mfa_free_all(linked_list *ll) {
-    linked_list_node *node;
-    if (!ll) return;
+void mfa_free_all(mfa_file_table *files) {
+    size_t i;
+    if (!files) return;
 
-    node = ll->head;
-    while (node) {
-        mfa_file *file = (mfa_file *)node->data;
-        if (file) {
-            free(file->buf);
-            file->buf = NULL;
-            file->len = 0;
-        }
-        node = node->next;
+    for (i = 0; i < files->count; ++i) {
+        mfa_file *file = &files->files[i];
+        free(file->buf);
+        file->buf = NULL;
+        file->len = 0;
     }
 }
 
@@ -108,382 +489,3879 @@ void mfa_free_all(linked_list *ll) {
    Archive format (LE)
    ============================================================ */
 
-int mfa_pack(const char *path, linked_list *ll,
-             const char *pass, unsigned flags)
-{
-    FILE *f;
-    const unsigned ALIGN = 16;
-    size_t n;
-    uint64_t *orig_sizes;
-    uint64_t *dataoff_patch;
-    uint8_t zeros[12];
-    long toc_pos, data_pos, size_pos;
-    long toc_off_l, after_toc;
-    long long data_off_ll;
-    uint64_t cursor;
+void mfa_options_init(mfa_options *opt) {
+    if (!opt) return;
+    memset(opt, 0, sizeof *opt);
+    opt->max_memory = MFA_DEFAULT_MEMORY;
+    opt->codec      = MFA_CODEC_AUTO;
+    opt->jobs       = 0;
+    opt->name_index = 1;
+    opt->dedup      = 1;
+    opt->delta      = 1;
+}
+
+#define HDR_SIZE 56u
+
+/* Version 1 readers copy each entry's stored bytes out as they are
+   and ignore flags, alg_id, meta and the reserved header bytes.
+   Archives that such a reader would misread (a streamed layout, or
+   any entry with flags set or a codec) are written as version 2;
+   those of plain stored entries stay version 1, index or not. */
+#define MFA_VERSION_1 1u
+#define MFA_VERSION   2u
+
+/* gflags */
+#define GF_STREAMED   1u    /* see "Streamed layout" */
+
+/* Bytes of an entry record besides the name and meta. */
+#define TOC_FIXED 36u
+
+typedef struct {
+    uint16_t version, hdr_sz;
+    uint32_t gflags, count;
     uint64_t toc_off, data_off, arch_sz;
+    uint64_t ext_off;
+    uint32_t ext_len;
+} mfa_header;
 
-    linked_list_node *node;
-    size_t i;
+static int hdr_parse(const uint8_t *b, mfa_header *h) {
+    if (memcmp(b, "MFAARCH", 7) != 0 || b[7] != '\0') return -1;
+    h->version  = mfa_ld16(b + 8);
+    h->hdr_sz   = mfa_ld16(b + 10);
+    h->gflags   = mfa_ld32(b + 12);
+    h->count    = mfa_ld32(b + 16);
+    h->toc_off  = mfa_ld64(b + 20);
+    h->data_off = mfa_ld64(b + 28);
+    h->arch_sz  = mfa_ld64(b + 36);
+    h->ext_off  = mfa_ld64(b + 44);
+    h->ext_len  = mfa_ld32(b + 52);
+    if (h->version < MFA_VERSION_1 || h->version > MFA_VERSION || h->hdr_sz != HDR_SIZE) return -1;
+    return 0;
+}
+
+/* Encode h into HDR_SIZE header bytes. */
+static void hdr_encode(uint8_t *b, const mfa_header *h) {
+    memcpy(b, "MFAARCH", 8);
+    mfa_st16(b + 8,  h->version);
+    mfa_st16(b + 10, h->hdr_sz);
+    mfa_st32(b + 12, h->gflags);
+    mfa_st32(b + 16, h->count);
+    mfa_st64(b + 20, h->toc_off);
+    mfa_st64(b + 28, h->data_off);
+    mfa_st64(b + 36, h->arch_sz);
+    mfa_st64(b + 44, h->ext_off);
+    mfa_st32(b + 52, h->ext_len);
+}
+
+/* ============================================================
+   Deduplication
+   ------------------------------------------------------------
+   Only entries whose size matches another entry's are looked at,
+   so archives without duplicates pay one sort and no extra
+   reads. Those are fingerprinted by the MurmurHash3-128 digest
+   of their first HASH_PREFIX bytes, which tells most distinct
+   files of one size apart (records, images) for a page read
+   each. Runs of three or more that still agree are hashed whole;
+   pairs go straight to the byte comparison. Entries with equal
+   size and digest are compared byte for byte, as the hash is
+   not collision resistant, and only those found identical are
+   stored once; the copies' TOC records point at the first one's
+   data_offset, stored size and block table.
+   ============================================================ */
+
+#define HASH_CHUNK  (256u * 1024u)
+#define HASH_PREFIX (4u * 1024u)     /* bytes fingerprinted first */
 
-    (void)pass;  /* encryption disabled */
-    (void)flags; /* do not set bits unless transforms actually occur */
+typedef struct {
+    uint64_t size;
+    uint64_t h[2];
+    size_t   index;
+} dedup_key;
 
-    if (!path || !ll || ll->size == 0) return -1;
+static int dedup_key_cmp(const void *a, const void *b) {
+    const dedup_key *x = (const dedup_key *)a;
+    const dedup_key *y = (const dedup_key *)b;
+    if (x->size != y->size) return x->size < y->size ? -1 : 1;
+    if (x->h[0] != y->h[0]) return x->h[0] < y->h[0] ? -1 : 1;
+    if (x->h[1] != y->h[1]) return x->h[1] < y->h[1] ? -1 : 1;
+    return (x->index > y->index) - (x->index < y->index);
+}
 
-    n = ll->size;
+typedef struct {
+    mfa_file  **files;
+    dedup_key  *keys;
+    size_t     *pick;       /* keys to hash, or NULL for all */
+    uint64_t    limit;      /* leading bytes of each hashed */
+} hash_ctx;
 
-    /* Save original sizes in list order */
-    orig_sizes = (uint64_t *)calloc(n, sizeof *orig_sizes);
-    if (!orig_sizes) { perror("calloc"); return -1; }
+static int hash_entry(size_t i, void *arg) {
+    const hash_ctx *x = (const hash_ctx *)arg;
+    dedup_key *k = &x->keys[x->pick ? x->pick[i] : i];
+    const mfa_file *file = x->files[k->index];
+    mfa_murmur3 st;
+    FILE *fp;
+    uint8_t *buf;
+    uint64_t left = file->size < x->limit ? file->size : x->limit;
 
-    i = 0;
-    node = ll->head;
-    for (; node; node = node->next, ++i) {
-        mfa_file *file = (mfa_file *)node->data;
-        if (!file) { free(orig_sizes); return -1; }
-        orig_sizes[i] = (uint64_t)file->len;
+    mfa_murmur3_init(&st, 0);
+    if (file->buf) {
+        mfa_murmur3_update(&st, file->buf, (size_t)left);
+        mfa_murmur3_final(&st, k->h);
+        return 0;
     }
 
-    /* Apply transforms (currently no-ops) but DO NOT set flag bits */
-    i = 0;
-    node = ll->head;
-    for (; node; node = node->next, ++i) {
-        mfa_file *file = (mfa_file *)node->data;
-        if (!file) { free(orig_sizes); return -1; }
+    fp = fopen(file->path, "rb");
+    if (!fp) { perror(file->path); return -1; }
+    buf = (uint8_t *)malloc(HASH_CHUNK);
+    if (!buf) { perror("malloc"); fclose(fp); return -1; }
 
-        /* Compression disabled: keep as-is; do not set compressed bit */
-        (void)tf_compress; /* silence unused if compiled out */
-        /* Encryption disabled: keep as-is; do not set encrypted bit */
-        (void)tf_xor_encrypt;
+    while (left) {
+        size_t chunk = left > HASH_CHUNK ? HASH_CHUNK : (size_t)left;
+        if (mfa_read_exact(fp, buf, chunk)) {
+            perror(file->path); free(buf); fclose(fp); return -1;
+        }
+        mfa_murmur3_update(&st, buf, chunk);
+        left -= chunk;
     }
+    free(buf);
+    fclose(fp);
+    mfa_murmur3_final(&st, k->h);
+    return 0;
+}
 
-    f = fopen(path, "wb");
-    if (!f) { perror(path); free(orig_sizes); return -1; }
-
-    /* --- Header preamble --- */
-    {
-        const char magic[8] = { 'M','F','A','A','R','C','H','\0' };
-        if (mfa_write_exact(f, magic, 8)) goto io_err;
+/* Up to n bytes of file from position *pos on into buf, from its
+   loaded buf or from fp. */
+static int dedup_read(const mfa_file *file, FILE *fp, uint64_t pos, uint8_t *buf, size_t n) {
+    if (file->buf) {
+        memcpy(buf, file->buf + pos, n);
+        return 0;
     }
-    if (mfa_w16(f, 1)) goto io_err;
-    if (mfa_w16(f, 56)) goto io_err;
-    if (mfa_w32(f, 0)) goto io_err;
-    if (mfa_w32(f, (uint32_t)n)) goto io_err;
+    if (mfa_read_exact(fp, buf, n)) { perror(file->path); return -1; }
+    return 0;
+}
 
-    toc_pos  = ftell(f); if (toc_pos  < 0) goto io_err; if (mfa_w64(f, 0)) goto io_err;
-    data_pos = ftell(f); if (data_pos < 0) goto io_err; if (mfa_w64(f, 0)) goto io_err;
-    size_pos = ftell(f); if (size_pos < 0) goto io_err; if (mfa_w64(f, 0)) goto io_err;
+/* *same = whether a and b, of equal size, hold the same bytes. */
+static int same_bytes(const mfa_file *a, const mfa_file *b, int *same) {
+    FILE *fa = NULL, *fb = NULL;
+    uint8_t *buf = NULL;
+    uint64_t pos = 0;
+    int rc = -1;
 
-    memset(zeros, 0, sizeof zeros);
-    if (mfa_write_exact(f, zeros, 12)) goto io_err;
+    *same = 1;
+    if (!a->buf && !(fa = fopen(a->path, "rb"))) { perror(a->path); goto out; }
+    if (!b->buf && !(fb = fopen(b->path, "rb"))) { perror(b->path); goto out; }
+    buf = (uint8_t *)malloc(2 * HASH_CHUNK);
+    if (!buf) { perror("malloc"); goto out; }
 
-    toc_off_l = ftell(f); if (toc_off_l < 0) goto io_err;
+    while (pos < a->size && *same) {
+        size_t chunk = a->size - pos > HASH_CHUNK ? HASH_CHUNK : (size_t)(a->size - pos);
+        if (dedup_read(a, fa, pos, buf, chunk) ||
+            dedup_read(b, fb, pos, buf + HASH_CHUNK, chunk)) goto out;
+        *same = memcmp(buf, buf + HASH_CHUNK, chunk) == 0;
+        pos += chunk;
+    }
+    rc = 0;
 
-    /* Positions for backpatching data offsets */
-    dataoff_patch = (uint64_t *)malloc(n * sizeof *dataoff_patch);
-    if (!dataoff_patch) { perror("malloc"); goto io_err; }
+out:
+    free(buf);
+    if (fa) fclose(fa);
+    if (fb) fclose(fb);
+    return rc;
+}
 
-    /* ---- TOC entries ---- */
-    i = 0;
-    node = ll->head;
-    for (; node; node = node->next, ++i) {
-        mfa_file *file = (mfa_file *)node->data;
-        const char *name;
-        size_t name_len;
-        long p;
-        uint32_t per_flags = 0; /* no transforms actually applied */
-        uint16_t alg_id = 0;    /* 0: raw */
+typedef struct {
+    mfa_file  **files;
+    dedup_key  *keys;
+    size_t     *head;       /* key -> first key of its (size, digest) run */
+    size_t     *dup_of;
+} confirm_ctx;
 
-        name = (file && file->path) ? mfa_basename(file->path) : "";
-        name_len = strlen(name);
+/* mfa_parallel_for body: alias key k's entry to its run's first
+   if their bytes really are the same. */
+static int confirm_entry(size_t k, void *arg) {
+    const confirm_ctx *x = (const confirm_ctx *)arg;
+    size_t h = x->head[k];
+    int same;
 
-        if (mfa_w32(f, (uint32_t)name_len)) goto toc_err;
-        if (name_len && mfa_write_exact(f, name, name_len)) goto toc_err;
+    if (h == k) return 0;
+    if (same_bytes(x->files[x->keys[h].index], x->files[x->keys[k].index], &same)) return -1;
+    if (same) x->dup_of[x->keys[k].index] = x->keys[h].index;
+    return 0;
+}
 
-        if (mfa_w64(f, orig_sizes[i])) goto toc_err;                 /* orig_size */
-        if (mfa_w64(f, (uint64_t)file->len)) goto toc_err;           /* stored_size */
+/* Set dup_of[i] to the first entry with the same contents as entry
+   i (i itself when it has no earlier twin). */
+static int dedup_scan(mfa_file **files, size_t n, unsigned jobs, size_t *dup_of) {
+    dedup_key *keys;
+    hash_ctx x;
+    confirm_ctx cx;
+    size_t *head;
+    size_t i, k, m = 0, kept = 0, np = 0;
+    int rc = -1;
 
-        p = ftell(f); if (p < 0) goto toc_err;
-        dataoff_patch[i] = (uint64_t)p;
-        if (mfa_w64(f, 0)) goto toc_err;                             /* data_offset placeholder */
+    for (i = 0; i < n; ++i) dup_of[i] = i;
 
-        if (mfa_w32(f, per_flags)) goto toc_err;                     /* per-file flags (none) */
-        if (mfa_w16(f, alg_id)) goto toc_err;                        /* alg_id = 0 */
-        if (mfa_w16(f, 0)) goto toc_err;                             /* meta_len = 0 */
+    keys = (dedup_key *)calloc(n ? n : 1, sizeof *keys);
+    if (!keys) { perror("calloc"); return -1; }
+    for (i = 0; i < n; ++i) {
+        if (!files[i]->size) continue;
+        keys[m].size  = files[i]->size;
+        keys[m].index = i;
+        ++m;
     }
 
-    /* ---- Data section ---- */
-    after_toc = ftell(f); if (after_toc < 0) goto toc_err;
-    data_off_ll = mfa_pad_to(f, (unsigned long long)after_toc, ALIGN);
-    if (data_off_ll < 0) goto toc_err;
-    cursor = (uint64_t)data_off_ll;
+    /* Group by size and keep only sizes that occur more than once. */
+    qsort(keys, m, sizeof *keys, dedup_key_cmp);
+    for (i = 0; i < m; ) {
+        size_t e = i + 1;
+        while (e < m && keys[e].size == keys[i].size) ++e;
+        if (e - i > 1) {
+            memmove(keys + kept, keys + i, (e - i) * sizeof *keys);
+            kept += e - i;
+        }
+        i = e;
+    }
+    m = kept;
 
-    i = 0;
-    node = ll->head;
-    for (; node; node = node->next, ++i) {
-        mfa_file *file = (mfa_file *)node->data;
-        long long nc;
+    head = (size_t *)malloc((m ? m : 1) * sizeof *head);
+    if (!head) { perror("malloc"); free(keys); return -1; }
 
-        if (fseek(f, (long)dataoff_patch[i], SEEK_SET) != 0) goto toc_err;
-        if (mfa_w64(f, cursor)) goto toc_err;
+    x.files = files;
+    x.keys  = keys;
+    x.pick  = NULL;
+    x.limit = HASH_PREFIX;
+    if (mfa_parallel_for(m, jobs ? jobs : mfa_cpu_count(), hash_entry, &x) != 0) goto out;
 
-        if (fseek(f, (long)cursor, SEEK_SET) != 0) goto toc_err;
-        if (file->len && mfa_write_exact(f, file->buf, file->len)) goto toc_err;
+    /* Longer runs whose fingerprints agree are hashed whole (head
+       serves as the list of them) */
+    qsort(keys, m, sizeof *keys, dedup_key_cmp);
+    for (i = 0; i < m; ) {
+        size_t e = i + 1;
+        while (e < m && keys[e].size == keys[i].size &&
+               keys[e].h[0] == keys[i].h[0] && keys[e].h[1] == keys[i].h[1]) ++e;
+        if (e - i > 2 && keys[i].size > HASH_PREFIX)
+            for (k = i; k < e; ++k) head[np++] = k;
+        i = e;
+    }
+    x.pick  = head;
+    x.limit = (uint64_t)-1;
+    if (mfa_parallel_for(np, jobs ? jobs : mfa_cpu_count(), hash_entry, &x) != 0) goto out;
 
-        cursor += (uint64_t)file->len;
-        nc = mfa_pad_to(f, cursor, ALIGN);
-        if (nc < 0) goto toc_err;
-        cursor = (uint64_t)nc;
+    /* Equal (size, digest) runs are ordered by index: the first one
+       is stored, the rest refer to it once their bytes are seen to
+       match. */
+    qsort(keys, m, sizeof *keys, dedup_key_cmp);
+    for (i = 0; i < m; ) {
+        size_t e = i + 1;
+        while (e < m && keys[e].size == keys[i].size &&
+               keys[e].h[0] == keys[i].h[0] && keys[e].h[1] == keys[i].h[1]) ++e;
+        for (k = i; k < e; ++k) head[k] = i;
+        i = e;
     }
 
-    /* Finalize header */
-    toc_off = (uint64_t)toc_off_l;
-    data_off = (uint64_t)data_off_ll;
-    arch_sz = (uint64_t)ftell(f);
+    cx.files  = files;
+    cx.keys   = keys;
+    cx.head   = head;
+    cx.dup_of = dup_of;
+    if (mfa_parallel_for(m, jobs ? jobs : mfa_cpu_count(), confirm_entry, &cx) != 0) goto out;
 
-    if (fseek(f, toc_pos,  SEEK_SET) != 0) goto toc_err;
-    if (mfa_w64(f, toc_off)) goto toc_err;
+    /* A colliding entry may still match a later original of its run */
+    for (k = 0; k < m; ++k) {
+        size_t e = keys[k].index;
+        if (head[k] == k || dup_of[e] != e) continue;
+        for (i = head[k] + 1; i < k; ++i) {
+            size_t o = keys[i].index;
+            int same;
+            if (dup_of[o] != o) continue;
+            if (same_bytes(files[o], files[e], &same)) goto out;
+            if (same) { dup_of[e] = o; break; }
+        }
+    }
+    rc = 0;
 
-    if (fseek(f, data_pos, SEEK_SET) != 0) goto toc_err;
-    if (mfa_w64(f, data_off)) goto toc_err;
+out:
+    free(head);
+    free(keys);
+    return rc;
+}
 
-    if (fseek(f, size_pos, SEEK_SET) != 0) goto toc_err;
-    if (mfa_w64(f, arch_sz)) goto toc_err;
+/* Blocks a coded entry of `size` bytes is split into (0 if the
+   entry is stored as-is). */
+static size_t entry_blocks(uint64_t size, int coded, unsigned block_log2) {
+    if (!coded || !size) return 0;
+    return (size_t)((size + ((uint64_t)1 << block_log2) - 1) >> block_log2);
+}
 
-    free(dataoff_patch);
-    free(orig_sizes);
-    if (fclose(f) != 0) { perror("fclose"); return -1; }
-    return 0;
+/* meta_len of an entry with an nb-block table. */
+static size_t blocks_meta_len(size_t nb) {
+    return nb ? META_REC_HDR + 4 + 4 * nb : 0;
+}
 
-toc_err:
-    free(dataoff_patch);
-io_err:
-    perror("I/O");
-    if (f) fclose(f);
-    free(orig_sizes);
-    return -1;
+/* meta_len of a packed entry: block table, checksum and, for
+   encrypted entries, the nonce. */
+static size_t entry_meta_len(size_t nb, int encrypt) {
+    return blocks_meta_len(nb) + META_REC_HDR +
+           (encrypt && nb ? MFA_TAG_LEN + META_REC_HDR + ENTRY_NONCE : 4);
+}
+
+/* meta_len of a solid block member: block reference, checksum and
+   the block's nonce if encrypted. */
+static size_t solid_meta_len(int encrypt) {
+    return META_REC_HDR + SOLID_META + META_REC_HDR +
+           (encrypt ? MFA_TAG_LEN + META_REC_HDR + ENTRY_NONCE : 4);
 }
 
 /* ============================================================
-   TOC reader
+   Content checksums
+   ------------------------------------------------------------
+   A clear entry's checksum is the CRC32C of its original bytes.
+   An encrypted entry's cannot be: stored in the clear it would
+   fingerprint the plaintext, and since a CRC is affine and the
+   cipher a plain XOR, bits flipped in the ciphertext could be
+   matched by patching it. Its original bytes get a Poly1305 tag
+   instead, under a one-time key: the first 32 keystream bytes
+   under the archive key and its stream's nonce, at block index
+   MAC_INDEX plus its offset in the stream (a solid member's
+   META_SOLID offset, else 0), where no data block reaches.
    ============================================================ */
 
 typedef struct {
-    char     *name;
-    uint64_t  orig_size;
-    uint64_t  stored_size;
-    uint64_t  data_offset;
-    uint32_t  flags;
-    uint16_t  alg_id;
-} mfa_toc_entry;
+    int          keyed;     /* Poly1305 tag rather than CRC32C */
+    uint32_t     crc;
+    mfa_poly1305 mac;
+} content_sum;
+
+/* Bytes of a stored checksum. */
+static size_t sum_len(int keyed) {
+    return keyed ? MFA_TAG_LEN : 4;
+}
+
+/* Start a checksum: a CRC32C when key is NULL, else the tag of the
+   content at offset off of the stream under entry_nonce. */
+static void sum_init(content_sum *s, const uint8_t *key, const uint8_t *entry_nonce,
+                     uint32_t off) {
+    uint8_t nonce[MFA_NONCE_LEN], otk[32];
 
-static void *xmalloc_zero(size_t n) {
-    void *p = malloc(n);
-    if (p) memset(p, 0, n);
-    return p;
+    s->keyed = key != NULL;
+    s->crc   = 0;
+    if (!key) return;
+    block_nonce(nonce, entry_nonce, (uint64_t)MAC_INDEX + off);
+    memset(otk, 0, sizeof otk);
+    mfa_chacha20_xor(key, nonce, 0, otk, otk, sizeof otk);
+    mfa_poly1305_init(&s->mac, otk);
+    memset(otk, 0, sizeof otk);
 }
 
-static void toc_free(mfa_toc_entry *e, size_t n) {
+static void sum_update(content_sum *s, const void *p, size_t n) {
+    if (s->keyed) mfa_poly1305_update(&s->mac, p, n);
+    else          s->crc = mfa_crc32c(s->crc, p, n);
+}
+
+/* Store the checksum's sum_len(s->keyed) bytes at out. */
+static void sum_final(content_sum *s, uint8_t *out) {
+    if (s->keyed) mfa_poly1305_final(&s->mac, out);
+    else          mfa_st32(out, s->crc);
+}
+
+/* Compare n stored checksum bytes without an early exit. */
+static int sum_equal(const uint8_t *a, const uint8_t *b, size_t n) {
+    uint8_t d = 0;
     size_t i;
-    if (!e) return;
-    for (i = 0; i < n; ++i) free(e[i].name);
-    free(e);
+    for (i = 0; i < n; ++i) d |= (uint8_t)(a[i] ^ b[i]);
+    return d == 0;
 }
 
-static int toc_read(FILE *fp, mfa_toc_entry **out, size_t *out_n, uint64_t *out_data_off) {
-    char magic[8];
-    uint16_t version=0, hdr_sz=0;
-    uint32_t gflags=0, count=0;
-    uint64_t toc_off=0, data_off=0, arch_sz=0;
-    uint8_t  zeros[12];
-    mfa_toc_entry *ents;
-    uint32_t i;
+/* Start an EXT_TOCMAC tag over count TOC records under nonce. */
+static void toc_mac_init(mfa_poly1305 *m, const uint8_t *key, const uint8_t *toc_nonce,
+                         uint32_t count) {
+    uint8_t nonce[MFA_NONCE_LEN], otk[32], cb[4];
 
-    if (mfa_read_exact(fp, magic, 8)) return -1;
-    if (memcmp(magic, "MFAARCH", 7) != 0 || magic[7] != '\0') return -1;
+    block_nonce(nonce, toc_nonce, TOC_MAC_INDEX);
+    memset(otk, 0, sizeof otk);
+    mfa_chacha20_xor(key, nonce, 0, otk, otk, sizeof otk);
+    mfa_poly1305_init(m, otk);
+    memset(otk, 0, sizeof otk);
+    mfa_st32(cb, count);
+    mfa_poly1305_update(m, cb, sizeof cb);
+}
 
-    if (mfa_r16(fp, &version) || mfa_r16(fp, &hdr_sz) ||
-        mfa_r32(fp, &gflags)  || mfa_r32(fp, &count)  ||
-        mfa_r64(fp, &toc_off) || mfa_r64(fp, &data_off) || mfa_r64(fp, &arch_sz) ||
-        mfa_read_exact(fp, zeros, 12))
-        return -1;
+/* ============================================================
+   Streamed layout
+   ------------------------------------------------------------
+   An archive written to a pipe cannot be patched afterwards, so
+   it is laid out in a single forward pass:
+     header        GF_STREAMED set, nothing else known yet but
+                   ext_off/ext_len, which cover an EXT_CRYPT
+                   record right behind it when encrypted
+     per stream    local record, data, checksums
+     u8[4] "MFAT"  end of the local records
+     TOC, name index, extension area, as in any archive
+     footer        the real header (GF_STREAMED set), filling
+                   the file's last HDR_SIZE bytes
+   Readers with random access go by the footer. The local records
+   make the archive readable front to back as well:
+     u8[4] "MFAL", u32 entry flags, u16 alg_id, u8 block_log2,
+     u8 0, u64 original length, u8[8] nonce (0 if clear),
+     u32 nnames, then per name
+       u32 name_len, name, u64 orig_size, u32 offset
+   offset being where the name's bytes start in the stream's
+   original bytes (several names for duplicates, several offsets
+   for a solid block). The data follows exactly as data_offset
+   and stored_size describe it, then a checksum per name: its
+   u32 CRC32C, or its 16-byte Poly1305 tag if encrypted.
+   ============================================================ */
 
-    if (version != 1 || hdr_sz != 56) return -1;
+#define LOCAL_MAGIC   "MFAL"
+#define LOCAL_END     "MFAT"
+#define LOCAL_FIXED   32u
 
-    if (fseek(fp, (long)toc_off, SEEK_SET) != 0) return -1;
-    ents = (mfa_toc_entry *)calloc(count, sizeof *ents);
-    if (!ents) return -1;
+/* ============================================================
+   Packing entries
+   ------------------------------------------------------------
+   Shared by mfa_pack_ex and mfa_append: size and deduplicate
+   the inputs, stream their data through the pipeline at the
+   current file position, and encode the tail of each entry's
+   TOC record (stored_size onwards) once its data is written.
 
-    for (i = 0; i < count; ++i) {
-        uint32_t name_len = 0;
-        char *name;
-        uint64_t orig=0, stored=0, off=0;
-        uint32_t flags=0; uint16_t alg=0, meta_len=0;
+   What the pipeline streams are "streams": a distinct content on
+   its own, or, in solid mode, a group of small distinct contents
+   concatenated into one block. Offsets, sizes, block tables and
+   nonces are per stream; checksums per content.
+   ============================================================ */
 
-        if (mfa_r32(fp, &name_len)) { toc_free(ents, i); return -1; }
+#define NO_STREAM ((size_t)-1)
 
-        name = (char *)malloc(name_len + 1);
-        if (!name && name_len) { toc_free(ents, i); return -1; }
-        if (name_len && mfa_read_exact(fp, name, name_len)) { free(name); toc_free(ents, i); return -1; }
-        if (name) name[name_len] = '\0';
-        if (name) mfa_sanitize(name);
+typedef struct {
+    mfa_file  **files;          /* entries in TOC order */
+    size_t      n;
+    mfa_file  **uniq;           /* entries whose bytes are stored */
+    size_t     *slot;           /* entry -> index into uniq */
+    size_t      nu;
+    mfa_file  **streams;        /* pipeline inputs, in data order */
+    size_t      ns;
+    size_t     *stream_of;      /* uniq -> stream */
+    size_t     *stream_u;       /* stream -> uniq, NO_STREAM for groups */
+    uint32_t   *solid_off;      /* uniq -> offset in its group */
+    mfa_file   *groups;         /* solid group pseudo-entries */
+    mfa_file  **parts;          /* group members, group by group */
+    size_t     *part_u;         /* uniq index of each parts[] entry */
+    pack_ctx    px;
+    uint8_t    *nonces;         /* per stream */
+    int         blocked;        /* stored as block tables */
+    mfa_pipe   *pipe;
+    unsigned    block_log2;
+    size_t     *block_first;    /* index of each stream's first block */
+    uint32_t   *block_sizes;    /* stored size per block, BLOCK_RAW */
+    uint8_t    *sums;           /* checksum of each stored content,
+                                   MFA_TAG_LEN bytes apart */
+    uint64_t   *data_offsets;   /* per stream */
+    uint64_t   *stored_sizes;   /* per stream */
+    int         streamed;       /* local records, framed blocks */
+    size_t     *by_stream;      /* entries grouped by stream (streamed) */
+    size_t     *stream_first;   /* stream s: by_stream[first[s] .. first[s+1]) */
+    mfa_stats  *stats;          /* opt->stats, or NULL */
+    mfa_dict   *dict;           /* trained by this job, or NULL */
+    uint8_t    *dict_rec;       /* its EXT_DICT record, to be written */
+    size_t      dict_rec_len;
+} pack_job;
 
-        if (mfa_r64(fp, &orig)   || mfa_r64(fp, &stored) ||
-            mfa_r64(fp, &off)    || mfa_r32(fp, &flags)  ||
-            mfa_r16(fp, &alg)    || mfa_r16(fp, &meta_len)) {
-            free(name); toc_free(ents, i); return -1;
-        }
+static void job_free(pack_job *j) {
+    if (j->pipe) mfa_pipe_finish(j->pipe);
+    memset(j->px.key, 0, sizeof j->px.key);
+    free(j->px.algs);
+    free(j->px.strides);
+    mfa_dict_free(j->dict);
+    free(j->dict_rec);
+    free(j->nonces);
+    free(j->sums);
+    free(j->block_sizes);
+    free(j->block_first);
+    free(j->stored_sizes);
+    free(j->data_offsets);
+    free(j->stream_first);
+    free(j->by_stream);
+    free(j->part_u);
+    free(j->parts);
+    free(j->groups);
+    free(j->solid_off);
+    free(j->stream_u);
+    free(j->stream_of);
+    free(j->streams);
+    free(j->slot);
+    free(j->uniq);
+    free(j->files);
+    memset(j, 0, sizeof *j);
+}
 
-        if (meta_len && fseek(fp, (long)meta_len, SEEK_CUR) != 0) { free(name); toc_free(ents, i); return -1; }
+/* Whether uniq content u goes into a solid group. */
+static int job_is_solid(const pack_job *j, size_t u) {
+    return j->stream_u[j->stream_of[u]] == NO_STREAM;
+}
 
-        if (name) {
-            ents[i].name = name;
-        } else {
-            ents[i].name = (char *)xmalloc_zero(1); /* fallback for empty name without strdup */
-            if (!ents[i].name) { toc_free(ents, i); return -1; }
+/* Lay the distinct contents out as streams. With solid_max set,
+   contents of 1..solid_max bytes are gathered, in order of first
+   appearance, into groups of at most SOLID_BLOCK bytes; each group
+   is placed where its first member would have been. */
+static int job_plan_streams(pack_job *j, uint64_t solid_max) {
+    size_t u, open = NO_STREAM, ng = 0, np = 0;
+    mfa_file *g = NULL;
+
+    if (solid_max > SOLID_BLOCK) solid_max = SOLID_BLOCK;
+    j->streams   = (mfa_file **)calloc(j->nu ? j->nu : 1, sizeof *j->streams);
+    j->stream_of = (size_t *)calloc(j->nu ? j->nu : 1, sizeof *j->stream_of);
+    j->stream_u  = (size_t *)calloc(j->nu ? j->nu : 1, sizeof *j->stream_u);
+    j->solid_off = (uint32_t *)calloc(j->nu ? j->nu : 1, sizeof *j->solid_off);
+    j->groups    = (mfa_file *)calloc(j->nu ? j->nu : 1, sizeof *j->groups);
+    j->parts     = (mfa_file **)calloc(j->nu ? j->nu : 1, sizeof *j->parts);
+    j->part_u    = (size_t *)calloc(j->nu ? j->nu : 1, sizeof *j->part_u);
+    if (!j->streams || !j->stream_of || !j->stream_u || !j->solid_off ||
+        !j->groups || !j->parts || !j->part_u) { perror("calloc"); return -1; }
+
+    for (u = 0; u < j->nu; ++u) {
+        uint64_t size = j->uniq[u]->size;
+
+        if (!j->blocked || !size || size > solid_max) {
+            j->stream_u[j->ns] = u;
+            j->stream_of[u] = j->ns;
+            j->streams[j->ns++] = j->uniq[u];
+            continue;
+        }
+        if (open == NO_STREAM || g->size + size > SOLID_BLOCK) {
+            g = &j->groups[ng++];
+            g->parts = j->parts + np;
+            open = j->ns;
+            j->stream_u[j->ns] = NO_STREAM;
+            j->streams[j->ns++] = g;
         }
-        ents[i].orig_size   = orig;
-        ents[i].stored_size = stored;
-        ents[i].data_offset = off;
-        ents[i].flags       = flags;
-        ents[i].alg_id      = alg;
+        j->solid_off[u] = (uint32_t)g->size;
+        j->stream_of[u] = open;
+        j->part_u[np] = u;
+        j->parts[np++] = j->uniq[u];
+        g->nparts++;
+        g->size += size;
     }
-
-    *out = ents;
-    *out_n = (size_t)count;
-    if (out_data_off) *out_data_off = data_off;
     return 0;
 }
 
-/* ============================================================
-   List
-   ============================================================ */
+/* mfa_parallel_for body: record the size of file i of the table, so
+   that stat latency overlaps across large inputs. */
+static int size_file(size_t i, void *arg) {
+    mfa_file *file = &((mfa_file_table *)arg)->files[i];
 
-int mfa_list(const char *archive_path) {
-    FILE *fp;
-    mfa_toc_entry *ents = NULL;
-    size_t n = 0;
-    uint64_t data_off = 0;
-    size_t i;
+    if (!file->path) return -1;
+    if (file->buf) {
+        file->size = (uint64_t)file->len;
+    } else if (mfa_file_size(file->path, &file->size) != 0) {
+        perror(file->path);
+        return -1;
+    }
+    return 0;
+}
 
-    fp = fopen(archive_path, "rb");
-    if (!fp) { perror(archive_path); return -1; }
+/* Dictionary training samples: up to DICT_SAMPLES distinct contents
+   of at most DICT_FILE_MAX bytes, spread evenly over the input, and
+   at most DICT_SAMPLE_MAX leading bytes of each. */
+#define DICT_FILE_MAX    (64u * 1024u)
+#define DICT_SAMPLES     1024u
+#define DICT_SAMPLE_MAX  (8u * 1024u)
+#define DICT_MIN_SAMPLES 8u
 
-    if (toc_read(fp, &ents, &n, &data_off)) { fclose(fp); return -1; }
+/* Up to n leading bytes of file into buf; the count read, or -1. */
+static long sample_read(const mfa_file *file, uint8_t *buf, size_t n) {
+    FILE *f;
+    size_t got;
 
-    printf("Archive: %s\n", archive_path);
-    printf("%-6s  %-10s  %-10s  %s\n", "Index", "OrigSize", "Stored", "Name");
-    for (i = 0; i < n; ++i) {
-        printf("%-6zu  %-10llu  %-10llu  %s\n",
-               i,
-               (unsigned long long)ents[i].orig_size,
-               (unsigned long long)ents[i].stored_size,
-               ents[i].name);
+    if (file->buf) {
+        if (n > file->len) n = file->len;
+        memcpy(buf, file->buf, n);
+        return (long)n;
     }
-
-    toc_free(ents, n);
-    fclose(fp);
-    return 0;
+    f = fopen(file->path, "rb");
+    if (!f) { perror(file->path); return -1; }
+    got = fread(buf, 1, n, f);
+    if (ferror(f)) { perror(file->path); fclose(f); return -1; }
+    fclose(f);
+    return (long)got;
 }
 
-/* ============================================================
-   Extract
-   ============================================================ */
+/* Train a dictionary of up to `size` bytes from the job's small
+   contents and encode its EXT_DICT record, encrypted when key is
+   set. With too few small contents, or too little shared between
+   them, the job goes without. */
+static int job_train_dict(pack_job *j, uint64_t size, const uint8_t *key) {
+    const uint8_t **samples = NULL;
+    size_t *lens = NULL;
+    uint8_t *bytes = NULL, *dict = NULL, *rec;
+    size_t u, m = 0, k, ns = 0, i = 0, dlen;
+    int rc = -1;
 
-static int stream_copy_to(const char *out_path, FILE *fp, uint64_t len) {
-    FILE *out;
-    uint8_t *buf;
-    uint64_t remaining;
+    if (size > MFA_DICT_MAX) size = MFA_DICT_MAX;
+    for (u = 0; u < j->nu; ++u)
+        if (j->uniq[u]->size && j->uniq[u]->size <= DICT_FILE_MAX) ++m;
+    if (m < DICT_MIN_SAMPLES) return 0;
+    k = m < DICT_SAMPLES ? m : DICT_SAMPLES;
+
+    samples = (const uint8_t **)malloc(k * sizeof *samples);
+    lens    = (size_t *)malloc(k * sizeof *lens);
+    bytes   = (uint8_t *)malloc(k * DICT_SAMPLE_MAX);
+    dict    = (uint8_t *)malloc((size_t)size ? (size_t)size : 1);
+    if (!samples || !lens || !bytes || !dict) { perror("malloc"); goto out; }
 
-    out = fopen(out_path, "wb");
-    if (!out) { perror(out_path); return -1; }
+    for (u = 0; u < j->nu && ns < k; ++u) {
+        long got;
+        if (!j->uniq[u]->size || j->uniq[u]->size > DICT_FILE_MAX) continue;
+        if (i++ != (size_t)((uint64_t)ns * m / k)) continue;
+        samples[ns] = bytes + ns * DICT_SAMPLE_MAX;
+        got = sample_read(j->uniq[u], bytes + ns * DICT_SAMPLE_MAX, DICT_SAMPLE_MAX);
+        if (got < 0) goto out;
+        lens[ns++] = (size_t)got;
+    }
 
-    buf = (uint8_t *)malloc(64 * 1024);
-    if (!buf) { perror("malloc"); fclose(out); return -1; }
+    dlen = mfa_dict_train(samples, lens, ns, dict, (size_t)size);
+    if (dlen) {
+        j->dict_rec_len = EXT_REC_HDR + ENTRY_NONCE + dlen;
+        j->dict_rec = rec = (uint8_t *)malloc(j->dict_rec_len);
+        j->dict = mfa_dict_new(dict, dlen);
+        if (!rec || !j->dict) { perror("malloc"); goto out; }
 
-    remaining = len;
-    while (remaining) {
-        size_t chunk = (remaining > 64 * 1024ULL) ? (64 * 1024U) : (size_t)remaining;
-        if (mfa_read_exact(fp, buf, chunk)) { perror("fread"); free(buf); fclose(out); return -1; }
-        if (mfa_write_exact(out, buf, chunk)) { perror("fwrite"); free(buf); fclose(out); return -1; }
-        remaining -= chunk;
+        mfa_st16(rec, EXT_DICT);
+        mfa_st16(rec + 2, 0);
+        mfa_st32(rec + 4, (uint32_t)(ENTRY_NONCE + dlen));
+        memset(rec + EXT_REC_HDR, 0, ENTRY_NONCE);
+        memcpy(rec + EXT_REC_HDR + ENTRY_NONCE, dict, dlen);
+        if (key) {
+            uint8_t nonce[MFA_NONCE_LEN];
+            if (mfa_random_bytes(rec + EXT_REC_HDR, ENTRY_NONCE)) {
+                fprintf(stderr, "Cannot read random bytes.\n");
+                goto out;
+            }
+            block_nonce(nonce, rec + EXT_REC_HDR, 0);
+            mfa_chacha20_xor(key, nonce, 0, rec + EXT_REC_HDR + ENTRY_NONCE,
+                             rec + EXT_REC_HDR + ENTRY_NONCE, dlen);
+        }
     }
+    rc = 0;
 
-    free(buf);
-    if (fclose(out) != 0) { perror("fclose"); return -1; }
-    return 0;
+out:
+    if (dict) memset(dict, 0, (size_t)size);
+    free(dict);
+    free(bytes);
+    free(lens);
+    free(samples);
+    return rc;
 }
 
-int mfa_extract_all(const char *archive_path, const char *out_dir) {
-    FILE *fp;
-    mfa_toc_entry *ents = NULL;
-    size_t n = 0;
-    uint64_t data_off = 0;
-    size_t i;
+/* Size and deduplicate the files of t and start streaming them.
+   key is the archive key, or NULL to store entries in the clear;
+   dict the archive's dictionary, or NULL to train one if opt asks.
+   On failure everything is released. */
+static int job_start(pack_job *j, mfa_file_table *t, unsigned flags,
+                     const uint8_t *key, const mfa_dict *dict,
+                     const mfa_options *opt) {
+    const mfa_codec *codec = NULL;
+    mfa_pipe_config pcfg;
+    size_t i, n = t->count;
+    int pick = 0;
+
+    memset(j, 0, sizeof *j);
+    j->stats = opt->stats;
+
+    if ((flags & MFA_COMPRESS) && opt->codec == MFA_CODEC_AUTO) {
+        pick = 1;
+    } else if (flags & MFA_COMPRESS) {
+        codec = mfa_codec_get(opt->codec);
+        if (!codec) { fprintf(stderr, "Unknown codec id %u\n", (unsigned)opt->codec); return -1; }
+        if (codec->id == MFA_ALG_RAW) codec = NULL;
+    }
 
-    fp = fopen(archive_path, "rb");
-    if (!fp) { perror(archive_path); return -1; }
+    /* Record each entry's size up front: the TOC precedes the data,
+       so sizes must be known before streaming. */
+    j->n = n;
+    j->files = (mfa_file **)calloc(n, sizeof *j->files);
+    if (!j->files) { perror("calloc"); goto fail; }
 
-    if (toc_read(fp, &ents, &n, &data_off)) { fclose(fp); return -1; }
+    if (mfa_parallel_for(n, opt->jobs ? opt->jobs : mfa_cpu_count(), size_file, t)) goto fail;
+    for (i = 0; i < n; ++i) j->files[i] = &t->files[i];
 
+    /* Store each distinct content once */
+    j->uniq = (mfa_file **)calloc(n, sizeof *j->uniq);
+    j->slot = (size_t *)calloc(n, sizeof *j->slot);
+    if (!j->uniq || !j->slot) { perror("calloc"); goto fail; }
+    if (opt->dedup) {
+        if (dedup_scan(j->files, n, opt->jobs, j->slot) != 0) goto fail;
+    } else {
+        for (i = 0; i < n; ++i) j->slot[i] = i;
+    }
     for (i = 0; i < n; ++i) {
-        char *out_path;
-        int is_compressed;
+        if (j->slot[i] == i) { j->uniq[j->nu] = j->files[i]; j->slot[i] = j->nu++; }
+        else j->slot[i] = j->slot[j->slot[i]];   /* originals come first */
+    }
+    j->blocked = codec || pick || key;
+    if (job_plan_streams(j, opt->solid)) goto fail;
 
-        if (fseek(fp, (long)ents[i].data_offset, SEEK_SET) != 0) {
-            perror("fseek"); toc_free(ents, n); fclose(fp); return -1;
+    /* One codec per stream: the requested one, or picked as each
+       stream's data comes in */
+    j->px.algs = (uint16_t *)malloc((j->ns ? j->ns : 1) * sizeof *j->px.algs);
+    if (!j->px.algs) { perror("malloc"); goto fail; }
+    for (i = 0; i < j->ns; ++i) j->px.algs[i] = codec ? codec->id : MFA_ALG_RAW;
+    j->px.pick = pick;
+    if ((pick || codec) && opt->delta) {
+        j->px.strides = (uint16_t *)calloc(j->ns ? j->ns : 1, sizeof *j->px.strides);
+        if (!j->px.strides) { perror("calloc"); goto fail; }
+        j->px.delta = 1;
+    }
+    j->px.widest = codec;
+    if (pick) {
+        static const uint16_t picks[] = { MFA_ALG_RLE, MFA_ALG_LZ, MFA_ALG_HUF, MFA_ALG_LZH };
+        for (i = 0; i < sizeof picks / sizeof picks[0]; ++i) {
+            const mfa_codec *c = mfa_codec_get(picks[i]);
+            if (!j->px.widest || c->bound(MFA_MAX_CHUNK) > j->px.widest->bound(MFA_MAX_CHUNK))
+                j->px.widest = c;
         }
+    }
 
-        out_path = mfa_join_path(out_dir, ents[i].name);
-        if (!out_path) { perror("malloc"); toc_free(ents, n); fclose(fp); return -1; }
+    /* One key per archive, one random nonce per stream */
+    j->px.encrypt = key != NULL;
+    if (key) {
+        j->nonces = (uint8_t *)malloc(j->ns ? j->ns * ENTRY_NONCE : 1);
+        if (!j->nonces) { perror("malloc"); goto fail; }
+        if (mfa_random_bytes(j->nonces, j->ns * ENTRY_NONCE)) {
+            fprintf(stderr, "Cannot read random bytes.\n");
+            goto fail;
+        }
+        memcpy(j->px.key, key, MFA_KEY_LEN);
+        j->px.nonces = j->nonces;
+    }
 
-        is_compressed = (ents[i].flags & (1u << 0)) != 0;
+    /* One dictionary per archive: the one it has, or one trained now */
+    if (pick || (codec && codec->encode_dict)) {
+        if (!dict && opt->dict) {
+            if (job_train_dict(j, opt->dict, key)) goto fail;
+            dict = j->dict;
+        }
+        j->px.dict = dict;
+    }
 
-        if (!is_compressed) {
-            if (stream_copy_to(out_path, fp, ents[i].stored_size)) {
-                fprintf(stderr, "Failed writing %s\n", out_path);
-                free(out_path); toc_free(ents, n); fclose(fp); return -1;
-            }
-        } else {
-            /* Compression is disabled in pack; this branch shouldn't occur.
-               Left here for future compatibility. */
-            size_t s = (size_t)ents[i].stored_size;
-            uint8_t *stored = (uint8_t *)malloc(s ? s : 1);
-            uint8_t *plain = NULL;
-            size_t plain_len = 0;
-
-            if (!stored) { perror("malloc"); free(out_path); toc_free(ents, n); fclose(fp); return -1; }
-            if (s && mfa_read_exact(fp, stored, s)) {
-                perror("fread"); free(stored); free(out_path); toc_free(ents, n); fclose(fp); return -1;
+    /* Blocks are the pipeline's chunks, so the block size is only
+       known once it is running; large entries raise the floor so
+       that no block table outgrows meta_len, up to the largest
+       block readers accept. */
+    memset(&pcfg, 0, sizeof pcfg);
+    pcfg.max_memory = opt->max_memory;
+    pcfg.workers    = opt->jobs;
+    if (j->blocked) {
+        uint64_t largest = 0, group = 0;
+        for (i = 0; i < n; ++i)
+            if (j->files[i]->size > largest) largest = j->files[i]->size;
+        /* A solid group must fit one chunk, one member or many */
+        for (i = 0; i < j->ns; ++i)
+            if (j->stream_u[i] == NO_STREAM && j->streams[i]->size > group)
+                group = j->streams[i]->size;
+        pcfg.min_chunk = MFA_MIN_CHUNK;
+        while (pcfg.min_chunk < group) pcfg.min_chunk *= 2;
+        while ((largest + pcfg.min_chunk - 1) / pcfg.min_chunk > MAX_BLOCKS) {
+            if (pcfg.min_chunk >= ((size_t)1 << BLOCK_LOG2_MAX)) {
+                fprintf(stderr, "Entry too large to compress or encrypt.\n");
+                goto fail;
             }
+            pcfg.min_chunk *= 2;
+        }
+        pcfg.transform   = pack_transform;
+        pcfg.out_bound   = pack_out_bound;
+        pcfg.first_chunk = pack_first_chunk;
+        pcfg.ctx         = &j->px;
+    }
 
-            if (tf_decompress_rle(stored, s, &plain, &plain_len, ents[i].orig_size) != 0) {
-                fprintf(stderr, "Decompression failed for %s\n", ents[i].name);
-                free(stored); free(out_path); toc_free(ents, n); fclose(fp); return -1;
-            }
-            free(stored);
-
-            {
-                FILE *out = fopen(out_path, "wb");
-                if (!out) { perror(out_path); free(plain); free(out_path); toc_free(ents, n); fclose(fp); return -1; }
-                if (plain_len && mfa_write_exact(out, plain, plain_len)) {
-                    perror("fwrite"); fclose(out); free(plain); free(out_path); toc_free(ents, n); fclose(fp); return -1;
-                }
-                if (fclose(out) != 0) { perror("fclose"); free(plain); free(out_path); toc_free(ents, n); fclose(fp); return -1; }
-            }
+    j->data_offsets = (uint64_t *)calloc(j->ns ? j->ns : 1, sizeof *j->data_offsets);
+    j->stored_sizes = (uint64_t *)calloc(j->ns ? j->ns : 1, sizeof *j->stored_sizes);
+    j->block_first  = (size_t *)calloc(j->ns + 1, sizeof *j->block_first);
+    j->sums         = (uint8_t *)calloc(j->nu ? j->nu : 1, MFA_TAG_LEN);
+    if (!j->data_offsets || !j->stored_sizes || !j->block_first || !j->sums) { perror("calloc"); goto fail; }
 
-            if (plain_len != (size_t)ents[i].orig_size) {
-                fprintf(stderr, "Size mismatch after decompression for %s\n", ents[i].name);
-                free(plain); free(out_path); toc_free(ents, n); fclose(fp); return -1;
-            }
-            free(plain);
-        }
+    j->pipe = mfa_pipe_start(j->streams, j->ns, &pcfg);
+    if (!j->pipe) goto fail;
+    while (((size_t)1 << j->block_log2) < mfa_pipe_chunk_size(j->pipe)) ++j->block_log2;
 
-        free(out_path);
-    }
+    for (i = 0; i < j->ns; ++i)
+        j->block_first[i + 1] = j->block_first[i] + entry_blocks(j->streams[i]->size, j->blocked, j->block_log2);
+    j->block_sizes = (uint32_t *)calloc(j->block_first[j->ns] ? j->block_first[j->ns] : 1, sizeof *j->block_sizes);
+    if (!j->block_sizes) { perror("calloc"); goto fail; }
+    return 0;
 
-    toc_free(ents, n);
-    fclose(fp);
+fail:
+    job_free(j);
+    return -1;
+}
+
+/* Blocks of entry i's stream. */
+static size_t job_blocks(const pack_job *j, size_t i) {
+    size_t s = j->stream_of[j->slot[i]];
+    return j->block_first[s + 1] - j->block_first[s];
+}
+
+/* meta_len of entry i, known as soon as the job has started. */
+static size_t job_meta_len(const pack_job *j, size_t i) {
+    if (job_is_solid(j, j->slot[i])) return solid_meta_len(j->px.encrypt);
+    return entry_meta_len(job_blocks(j, i), j->px.encrypt);
+}
+
+/* Entry flags of the entries stored as stream s. */
+static uint32_t job_stream_flags(const pack_job *j, size_t s) {
+    size_t nb = j->block_first[s + 1] - j->block_first[s];
+    uint32_t flags = 0;
+
+    /* Blocks picked to stay raw keep MFA_COMPRESS (alg raw), unless
+       MFA_ENCRYPT already marks the entry as blocks */
+    if (nb && (j->px.algs[s] != MFA_ALG_RAW || !j->px.encrypt))
+        flags |= MFA_COMPRESS;
+    if (nb && j->px.encrypt)         flags |= MFA_ENCRYPT;
+    if (j->stream_u[s] == NO_STREAM) flags |= ENTRY_SOLID;
+    if (nb && j->streamed)           flags |= ENTRY_FRAMED;
+    if ((flags & MFA_COMPRESS) && j->px.dict && mfa_codec_get(j->px.algs[s])->encode_dict)
+        flags |= ENTRY_DICT;
+    if (nb && j->px.strides && j->px.strides[s])
+        flags |= ENTRY_DELTA | (uint32_t)j->px.strides[s] << 16;
+    return flags;
+}
+
+/* Header version the job's entries need: MFA_VERSION once any of
+   them is more than stored bytes (see MFA_VERSION_1). */
+static uint16_t job_version(const pack_job *j) {
+    size_t s;
+    for (s = 0; s < j->ns; ++s)
+        if (job_stream_flags(j, s)) return MFA_VERSION;
+    return MFA_VERSION_1;
+}
+
+/* Group the entries by the stream holding their bytes, in TOC
+   order within each stream, for the local records. */
+static int job_plan_local(pack_job *j) {
+    size_t i, s;
+
+    j->by_stream    = (size_t *)malloc((j->n ? j->n : 1) * sizeof *j->by_stream);
+    j->stream_first = (size_t *)calloc(j->ns + 2, sizeof *j->stream_first);
+    if (!j->by_stream || !j->stream_first) { perror("malloc"); return -1; }
+
+    for (i = 0; i < j->n; ++i) j->stream_first[j->stream_of[j->slot[i]] + 2]++;
+    for (s = 0; s < j->ns; ++s) j->stream_first[s + 2] += j->stream_first[s + 1];
+    for (i = 0; i < j->n; ++i) j->by_stream[j->stream_first[j->stream_of[j->slot[i]] + 1]++] = i;
     return 0;
 }
+
+/* Local record of stream s up to its data, at *pos. */
+static int job_local_open(const pack_job *j, size_t s, FILE *f, uint64_t *pos) {
+    uint8_t b[LOCAL_FIXED];
+    uint32_t flags = job_stream_flags(j, s);
+    size_t k;
+
+    memcpy(b, LOCAL_MAGIC, 4);
+    mfa_st32(b + 4, flags);
+    mfa_st16(b + 8, (flags & MFA_COMPRESS) ? j->px.algs[s] : MFA_ALG_RAW);
+    b[10] = (uint8_t)j->block_log2;
+    b[11] = 0;
+    mfa_st64(b + 12, j->streams[s]->size);
+    if (flags & MFA_ENCRYPT) memcpy(b + 20, j->nonces + s * ENTRY_NONCE, ENTRY_NONCE);
+    else memset(b + 20, 0, ENTRY_NONCE);
+    mfa_st32(b + 28, (uint32_t)(j->stream_first[s + 1] - j->stream_first[s]));
+    if (mfa_write_exact(f, b, LOCAL_FIXED)) return -1;
+    *pos += LOCAL_FIXED;
+
+    for (k = j->stream_first[s]; k < j->stream_first[s + 1]; ++k) {
+        size_t i = j->by_stream[k];
+        const char *name = pack_name(j->files[i]);
+        uint32_t len = (uint32_t)strlen(name);
+        size_t u = j->slot[i];
+
+        mfa_st32(b, len);
+        mfa_st64(b + 4, j->files[i]->size);
+        mfa_st32(b + 12, job_is_solid(j, u) ? j->solid_off[u] : 0);
+        if (mfa_write_exact(f, b, 4) || mfa_write_exact(f, name, len) ||
+            mfa_write_exact(f, b + 4, 12)) return -1;
+        *pos += 16u + len;
+    }
+    return 0;
+}
+
+/* Checksums closing stream s's local record, at *pos. */
+static int job_local_close(const pack_job *j, size_t s, FILE *f, uint64_t *pos) {
+    size_t k, n = sum_len((job_stream_flags(j, s) & MFA_ENCRYPT) != 0);
+    for (k = j->stream_first[s]; k < j->stream_first[s + 1]; ++k) {
+        if (mfa_write_exact(f, j->sums + j->slot[j->by_stream[k]] * MFA_TAG_LEN, n)) return -1;
+        *pos += n;
+    }
+    return 0;
+}
+
+/* Start the checksum of the content at offset off of stream s. */
+static void job_sum_init(const pack_job *j, size_t s, uint32_t off, content_sum *sum) {
+    int keyed = (job_stream_flags(j, s) & MFA_ENCRYPT) != 0;
+    if (keyed) sum_init(sum, j->px.key, j->nonces + s * ENTRY_NONCE, off);
+    else       sum_init(sum, NULL, NULL, 0);
+}
+
+/* Write every stream's data from the current position of f, whose
+   offset is *cursor, padding each to align. On return *cursor is
+   the offset after the last one. */
+static int job_stream(pack_job *j, FILE *f, uint64_t *cursor, unsigned align) {
+    const mfa_chunk *c;
+    size_t entries_done = 0;
+    uint64_t pos = *cursor, in = 0;
+    mfa_pipe *pipe = j->pipe;
+    mfa_phase_mark mark;
+    content_sum sum;            /* of the stream being written */
+
+    mfa_phase_begin(j->stats, &mark);
+
+    /* Chunks are coded on worker threads; this thread is the single
+       ordered writer that lays them out and records offsets/sizes. */
+    while ((c = mfa_pipe_next(pipe)) != NULL) {
+        size_t idx = c->file_index;
+
+        if (c->offset == 0) {
+            if (j->streamed && job_local_open(j, idx, f, &pos)) goto io_err;
+            j->data_offsets[idx] = pos;
+            if (j->stream_u[idx] != NO_STREAM) job_sum_init(j, idx, 0, &sum);
+        }
+        if (j->stream_u[idx] != NO_STREAM) {
+            sum_update(&sum, c->data, c->len);
+            if (c->last) sum_final(&sum, j->sums + j->stream_u[idx] * MFA_TAG_LEN);
+        } else {
+            /* A group is one chunk: checksum each member's slice */
+            const mfa_file *g = j->streams[idx];
+            size_t k, first = (size_t)(g->parts - j->parts);
+            for (k = 0; k < g->nparts; ++k) {
+                size_t u = j->part_u[first + k];
+                job_sum_init(j, idx, j->solid_off[u], &sum);
+                sum_update(&sum, c->data + j->solid_off[u], (size_t)j->uniq[u]->size);
+                sum_final(&sum, j->sums + u * MFA_TAG_LEN);
+            }
+        }
+        in += (uint64_t)c->len;
+
+        if (j->blocked && c->len) {
+            size_t b = j->block_first[idx] + (size_t)c->index;
+            j->block_sizes[b] = (uint32_t)c->payload_len | (c->raw ? BLOCK_RAW : 0);
+            if (j->streamed) {
+                uint8_t w[BLOCK_FRAME];
+                mfa_st32(w, j->block_sizes[b]);
+                if (mfa_write_exact(f, w, BLOCK_FRAME)) goto io_err;
+                pos += BLOCK_FRAME;
+            }
+            if (mfa_write_exact(f, c->payload, c->payload_len)) goto io_err;
+            pos += (uint64_t)c->payload_len;
+            mfa_stats_codec(j->stats, j->px.algs[idx], c->len, c->payload_len);
+        } else {
+            if (c->len && mfa_write_exact(f, c->data, c->len)) goto io_err;
+            pos += (uint64_t)c->len;
+        }
+
+        if (c->last) {
+            long long nc;
+            j->stored_sizes[idx] = pos - j->data_offsets[idx];
+            if (j->streamed && job_local_close(j, idx, f, &pos)) goto io_err;
+            nc = mfa_pad_to(f, pos, align);
+            if (nc < 0) goto io_err;
+            pos = (uint64_t)nc;
+            ++entries_done;
+        }
+        mfa_pipe_release(pipe);
+    }
+    j->pipe = NULL;
+    if (mfa_pipe_finish(pipe) != 0 || entries_done != j->ns) {
+        fprintf(stderr, "Failed reading input files.\n");
+        return -1;
+    }
+    mfa_phase_end(j->stats, MFA_PHASE_TRANSFORM, &mark, in, pos - *cursor);
+    *cursor = pos;
+    return 0;
+
+io_err:
+    perror("I/O");
+    return -1;
+}
+
+/* Length of entry i's TOC record. */
+static size_t job_record_len(const pack_job *j, size_t i) {
+    return TOC_FIXED + strlen(pack_name(j->files[i])) + job_meta_len(j, i);
+}
+
+/* Encode entry i's complete TOC record into out: name, sizes, data
+   offset, flags, codec and the meta area (block table, checksum,
+   nonce). Duplicates get their original's values. Only valid once
+   the data has been streamed; returns job_record_len() bytes. */
+static size_t job_record(const pack_job *j, size_t i, uint8_t *out) {
+    const char *name = pack_name(j->files[i]);
+    size_t name_len = strlen(name);
+    size_t u = j->slot[i];
+    size_t s = j->stream_of[u];
+    int solid = job_is_solid(j, u);
+    size_t nb = job_blocks(j, i);
+    size_t meta_len = job_meta_len(j, i);
+    uint8_t *f = out + 4 + name_len;
+    uint8_t *m = f + 32;
+    uint8_t *q = m + (solid ? META_REC_HDR + SOLID_META : blocks_meta_len(nb));
+    uint32_t eflags = job_stream_flags(j, s);
+    size_t k;
+
+    mfa_st32(out, (uint32_t)name_len);
+    memcpy(out + 4, name, name_len);
+    mfa_st64(f,      j->files[i]->size);
+    mfa_st64(f + 8,  j->stored_sizes[s]);
+    mfa_st64(f + 16, j->data_offsets[s]);
+    mfa_st32(f + 24, eflags);
+    mfa_st16(f + 28, (eflags & MFA_COMPRESS) ? j->px.algs[s] : MFA_ALG_RAW);
+    mfa_st16(f + 30, (uint16_t)meta_len);
+    if (solid) {
+        mfa_st16(m, META_SOLID);
+        mfa_st16(m + 2, SOLID_META);
+        mfa_st32(m + 4, j->solid_off[u]);
+        mfa_st32(m + 8, (uint32_t)j->streams[s]->size);
+        mfa_st32(m + 12, j->block_sizes[j->block_first[s]]);
+    } else if (nb) {
+        mfa_st16(m, META_BLOCKS);
+        mfa_st16(m + 2, (uint16_t)(blocks_meta_len(nb) - META_REC_HDR));
+        m[4] = (uint8_t)j->block_log2;
+        m[5] = m[6] = m[7] = 0;
+        for (k = 0; k < nb; ++k)
+            mfa_st32(m + 8 + 4 * k, j->block_sizes[j->block_first[s] + k]);
+    }
+    k = sum_len((eflags & MFA_ENCRYPT) != 0);
+    mfa_st16(q, (eflags & MFA_ENCRYPT) ? META_MAC : META_CRC32C);
+    mfa_st16(q + 2, (uint16_t)k);
+    memcpy(q + 4, j->sums + u * MFA_TAG_LEN, k);
+    q += META_REC_HDR + k;
+    if (eflags & MFA_ENCRYPT) {
+        mfa_st16(q, META_NONCE);
+        mfa_st16(q + 2, ENTRY_NONCE);
+        memcpy(q + 4, j->nonces + s * ENTRY_NONCE, ENTRY_NONCE);
+    }
+    return TOC_FIXED + name_len + meta_len;
+}
+
+/* Encode all of the job's records into out, which starts at file
+   offset base; entry_pos[i] receives each record's offset. Returns
+   the bytes encoded. */
+static size_t job_encode_toc(const pack_job *j, uint8_t *out, uint64_t base,
+                             uint64_t *entry_pos) {
+    size_t i, len = 0;
+    for (i = 0; i < j->n; ++i) {
+        entry_pos[i] = base + len;
+        len += job_record(j, i, out + len);
+    }
+    return len;
+}
+
+/* Name hashes for the index, one per entry. */
+static uint64_t *job_name_hashes(const pack_job *j) {
+    uint64_t *h = (uint64_t *)malloc((j->n ? j->n : 1) * sizeof *h);
+    size_t i;
+    if (!h) { perror("malloc"); return NULL; }
+    for (i = 0; i < j->n; ++i) {
+        const char *name = pack_name(j->files[i]);
+        h[i] = name_hash(name, strlen(name));
+    }
+    return h;
+}
+
+/* Extension records, encoded in memory; each returns its length. */
+#define EXT_INDEX_REC (EXT_REC_HDR + 16u)
+#define EXT_CRYPT_REC (EXT_REC_HDR + CRYPT_LEN)
+#define EXT_TOCMAC_REC (EXT_REC_HDR + TOCMAC_LEN)
+
+static size_t ext_index_rec(uint8_t *p, uint64_t index_off, uint32_t nslots) {
+    mfa_st16(p, EXT_INDEX);
+    mfa_st16(p + 2, 0);
+    mfa_st32(p + 4, 16);
+    mfa_st64(p + 8, index_off);
+    mfa_st32(p + 16, nslots);
+    mfa_st32(p + 20, 0);
+    return EXT_INDEX_REC;
+}
+
+static size_t ext_crypt_rec(uint8_t *p, uint32_t iterations, const uint8_t *salt,
+                            const uint8_t *check) {
+    mfa_st16(p, EXT_CRYPT);
+    mfa_st16(p + 2, 0);
+    mfa_st32(p + 4, CRYPT_LEN);
+    mfa_st16(p + 8, KDF_PBKDF2);
+    mfa_st16(p + 10, CIPHER_CHACHA);
+    mfa_st32(p + 12, iterations);
+    memcpy(p + 16, salt, KDF_SALT);
+    memcpy(p + 16 + KDF_SALT, check, KEY_CHECK);
+    return EXT_CRYPT_REC;
+}
+
+/* EXT_TOCMAC over the count records toc[0..toc_len) and the
+   extension records before it, ext then more; 0 without a nonce. */
+static size_t ext_tocmac_rec(uint8_t *p, const uint8_t *key, uint32_t count,
+                             const uint8_t *toc, uint64_t toc_len,
+                             const uint8_t *ext, size_t ext_len,
+                             const uint8_t *more, size_t more_len) {
+    mfa_poly1305 m;
+
+    mfa_st16(p, EXT_TOCMAC);
+    mfa_st16(p + 2, 0);
+    mfa_st32(p + 4, TOCMAC_LEN);
+    if (mfa_random_bytes(p + EXT_REC_HDR, ENTRY_NONCE)) {
+        fprintf(stderr, "Cannot read random bytes.\n");
+        return 0;
+    }
+    toc_mac_init(&m, key, p + EXT_REC_HDR, count);
+    mfa_poly1305_update(&m, toc, (size_t)toc_len);
+    mfa_poly1305_update(&m, ext, ext_len);
+    if (more_len) mfa_poly1305_update(&m, more, more_len);
+    mfa_poly1305_final(&m, p + EXT_REC_HDR + ENTRY_NONCE);
+    return EXT_TOCMAC_REC;
+}
+
+/* Streamed layout: everything in one forward pass, no seeks, so f
+   may be a pipe. */
+static int pack_streamed(pack_job *j, FILE *f, const uint8_t *key, const uint8_t *salt,
+                         const mfa_options *opt) {
+    mfa_header h;
+    uint8_t  hb[HDR_SIZE];
+    uint8_t  ext[EXT_INDEX_REC + EXT_CRYPT_REC];
+    uint8_t  check[KEY_CHECK];
+    uint8_t  mac[EXT_TOCMAC_REC];
+    uint64_t *entry_pos = NULL, *hashes = NULL;
+    uint8_t  *toc = NULL;
+    uint64_t  toc_len = 0, pos;
+    uint32_t  crypt_len = 0;
+    size_t    mac_len = 0;
+    mfa_phase_mark mark;
+    size_t i;
+    int rc = -1;
+
+    if (job_plan_local(j)) return -1;
+
+    /* ---- Placeholder header, and the key's parameters up front ---- */
+    mfa_phase_begin(opt->stats, &mark);
+    memset(&h, 0, sizeof h);
+    h.version = MFA_VERSION;
+    h.hdr_sz  = HDR_SIZE;
+    h.gflags  = GF_STREAMED;
+    if (j->px.encrypt) {
+        key_check(key, check);
+        crypt_len = (uint32_t)ext_crypt_rec(ext, KDF_ITERATIONS, salt, check);
+        h.ext_off = HDR_SIZE;
+        h.ext_len = crypt_len;
+    }
+    if (j->dict_rec_len) {
+        h.ext_off = HDR_SIZE;
+        h.ext_len = crypt_len + (uint32_t)j->dict_rec_len;
+    }
+    h.data_off = HDR_SIZE + h.ext_len;
+    hdr_encode(hb, &h);
+    if (mfa_write_exact(f, hb, HDR_SIZE) || mfa_write_exact(f, ext, crypt_len) ||
+        (j->dict_rec_len && mfa_write_exact(f, j->dict_rec, j->dict_rec_len))) goto io_err;
+    mfa_phase_end(opt->stats, MFA_PHASE_TOC_WRITE, &mark, 0, h.data_off);
+
+    /* ---- Local records ---- */
+    pos = h.data_off;
+    if (job_stream(j, f, &pos, 1)) goto out;
+    if (mfa_write_exact(f, LOCAL_END, 4)) goto io_err;
+    pos += 4;
+
+    /* ---- TOC, name index, extension area, footer ---- */
+    mfa_phase_begin(opt->stats, &mark);
+    h.toc_off = pos;
+    h.count   = (uint32_t)j->n;
+    for (i = 0; i < j->n; ++i) toc_len += job_record_len(j, i);
+    entry_pos = (uint64_t *)malloc((j->n ? j->n : 1) * sizeof *entry_pos);
+    toc = (uint8_t *)malloc((size_t)(toc_len ? toc_len : 1));
+    if (!entry_pos || !toc) { perror("malloc"); goto out; }
+    job_encode_toc(j, toc, h.toc_off, entry_pos);
+    if (mfa_write_exact(f, toc, (size_t)toc_len)) goto io_err;
+    pos += toc_len;
+
+    h.ext_len = 0;
+    if (opt->name_index) {
+        uint32_t nslots = index_slots_for(j->n);
+        hashes = job_name_hashes(j);
+        if (!hashes) goto out;
+        if (write_name_index(f, hashes, j->n, entry_pos, nslots)) goto io_err;
+        h.ext_len += (uint32_t)ext_index_rec(ext, pos, nslots);
+        pos += (uint64_t)nslots * INDEX_SLOT;
+    }
+    if (j->px.encrypt)
+        h.ext_len += (uint32_t)ext_crypt_rec(ext + h.ext_len, KDF_ITERATIONS, salt, check);
+    if (j->px.encrypt &&
+        !(mac_len = ext_tocmac_rec(mac, key, h.count, toc, toc_len, ext, h.ext_len,
+                                   j->dict_rec, j->dict_rec_len))) goto out;
+    h.ext_off = h.ext_len || j->dict_rec_len ? pos : 0;
+    if (mfa_write_exact(f, ext, h.ext_len) ||
+        (j->dict_rec_len && mfa_write_exact(f, j->dict_rec, j->dict_rec_len)) ||
+        mfa_write_exact(f, mac, mac_len)) goto io_err;
+    h.ext_len += (uint32_t)(j->dict_rec_len + mac_len);
+    pos += h.ext_len;
+
+    h.arch_sz = pos + HDR_SIZE;
+    hdr_encode(hb, &h);
+    if (mfa_write_exact(f, hb, HDR_SIZE) || fflush(f) != 0) goto io_err;
+    mfa_phase_end(opt->stats, MFA_PHASE_TOC_WRITE, &mark, 0, h.arch_sz - h.toc_off);
+    rc = 0;
+    goto out;
+
+io_err:
+    perror("I/O");
+out:
+    memset(check, 0, sizeof check);
+    free(hashes);
+    free(toc);
+    free(entry_pos);
+    return rc;
+}
+
+int mfa_pack(const char *path, mfa_file_table *files,
+             const char *pass, unsigned flags)
+{
+    return mfa_pack_ex(path, files, pass, flags, NULL);
+}
+
+/* Layout: header, TOC, name index, extension area, then the data
+   from a 16-byte boundary. Record sizes are known up front, so the
+   TOC's space is skipped, the data streamed, and the finished TOC
+   and header each written with a single write at the end. Output
+   that cannot seek ("-" for stdout, pipes) or opt->stream gets the
+   streamed layout instead. */
+int mfa_pack_ex(const char *path, mfa_file_table *files,
+                const char *pass, unsigned flags,
+                const mfa_options *opt)
+{
+    FILE *f = NULL;
+    const unsigned ALIGN = 16;
+    size_t n;
+    pack_job  job;
+    mfa_header h;
+    uint64_t *entry_pos = NULL;
+    uint64_t *hashes = NULL;
+    uint8_t  *toc = NULL;
+    uint8_t   salt[KDF_SALT];
+    uint8_t   key[MFA_KEY_LEN];
+    uint8_t   ext[EXT_INDEX_REC + EXT_CRYPT_REC];
+    uint8_t   mac[EXT_TOCMAC_REC];
+    uint8_t   hb[HDR_SIZE];
+    uint64_t  toc_len = 0, pos, cursor;
+    uint32_t  nslots = 0, own_len;
+    uint64_t  meta_len;
+    long long c;
+    mfa_options defaults;
+    mfa_phase_mark mark;
+    int streamed;
+    size_t i;
+
+    memset(&job, 0, sizeof job);
+    memset(key, 0, sizeof key);
+    if (!path || !files || files->count == 0) return -1;
+    if (!opt) { mfa_options_init(&defaults); opt = &defaults; }
+
+    if ((flags & MFA_ENCRYPT) && (!pass || !*pass)) {
+        fprintf(stderr, "Encryption needs a passphrase.\n");
+        return -1;
+    }
+    if (flags & MFA_ENCRYPT) {
+        if (mfa_random_bytes(salt, KDF_SALT)) {
+            fprintf(stderr, "Cannot read random bytes.\n");
+            return -1;
+        }
+        derive_key(pass, salt, KDF_ITERATIONS, key);
+    }
+
+    n = files->count;
+
+    f = strcmp(path, "-") == 0 ? stdout : fopen(path, "wb");
+    if (!f) { perror(path); goto fail; }
+    streamed = opt->stream || f == stdout || lseek(fileno(f), 0, SEEK_CUR) < 0;
+
+    if (job_start(&job, files, flags, (flags & MFA_ENCRYPT) ? key : NULL, NULL, opt)) goto fail;
+    if (streamed) {
+        job.streamed = 1;
+        if (pack_streamed(&job, f, key, salt, opt)) goto fail;
+        goto done;
+    }
+
+    memset(&h, 0, sizeof h);
+    h.version = job_version(&job);
+    h.hdr_sz  = HDR_SIZE;
+    h.count   = (uint32_t)n;
+    h.toc_off = HDR_SIZE;
+    for (i = 0; i < n; ++i) toc_len += job_record_len(&job, i);
+
+    entry_pos = (uint64_t *)malloc(n * sizeof *entry_pos);
+    toc = (uint8_t *)malloc((size_t)toc_len);
+    if (!entry_pos || !toc) { perror("malloc"); goto fail; }
+
+    /* Record offsets only depend on lengths, so the index can be
+       written before the records are filled in. */
+    pos = h.toc_off;
+    for (i = 0; i < n; ++i) {
+        entry_pos[i] = pos;
+        pos += job_record_len(&job, i);
+    }
+    if (fseeko(f, (off_t)pos, SEEK_SET) != 0) goto io_err;
+
+    /* ---- Name index + extension area ---- */
+    mfa_phase_begin(opt->stats, &mark);
+    if (opt->name_index) {
+        uint64_t index_off = pos;
+        nslots = index_slots_for(n);
+        hashes = job_name_hashes(&job);
+        if (!hashes) goto fail;
+        if (write_name_index(f, hashes, n, entry_pos, nslots)) goto io_err;
+        pos += (uint64_t)nslots * INDEX_SLOT;
+        h.ext_len += (uint32_t)ext_index_rec(ext + h.ext_len, index_off, nslots);
+    }
+    if (job.px.encrypt) {
+        uint8_t check[KEY_CHECK];
+        key_check(key, check);
+        h.ext_len += (uint32_t)ext_crypt_rec(ext + h.ext_len, KDF_ITERATIONS, salt, check);
+    }
+    own_len = h.ext_len;
+    if (h.ext_len || job.dict_rec_len) {
+        h.ext_off = pos;
+        if (mfa_write_exact(f, ext, h.ext_len) ||
+            (job.dict_rec_len && mfa_write_exact(f, job.dict_rec, job.dict_rec_len))) goto io_err;
+        h.ext_len += (uint32_t)job.dict_rec_len;
+        if (job.px.encrypt) {
+            /* EXT_TOCMAC's space; it is filled in with the TOC */
+            memset(mac, 0, sizeof mac);
+            if (mfa_write_exact(f, mac, sizeof mac)) goto io_err;
+            h.ext_len += EXT_TOCMAC_REC;
+        }
+        pos += h.ext_len;
+    }
+    meta_len = pos - h.toc_off - toc_len;
+    mfa_phase_end(opt->stats, MFA_PHASE_TOC_WRITE, &mark, 0, meta_len);
+
+    /* ---- Data section: streamed in chunks, never whole files ---- */
+    c = mfa_pad_to(f, pos, ALIGN);
+    if (c < 0) goto io_err;
+    h.data_off = cursor = (uint64_t)c;
+
+    if (job_stream(&job, f, &cursor, ALIGN)) goto fail;
+    h.arch_sz = cursor;
+
+    /* ---- TOC and header, now that every field is known ---- */
+    mfa_phase_begin(opt->stats, &mark);
+    job_encode_toc(&job, toc, h.toc_off, entry_pos);
+    hdr_encode(hb, &h);
+    if (fseeko(f, (off_t)h.toc_off, SEEK_SET) != 0) goto io_err;
+    if (mfa_write_exact(f, toc, (size_t)toc_len)) goto io_err;
+    if (job.px.encrypt) {
+        if (!ext_tocmac_rec(mac, key, h.count, toc, toc_len, ext, own_len,
+                            job.dict_rec, job.dict_rec_len)) goto fail;
+        if (fseeko(f, (off_t)(h.ext_off + h.ext_len - EXT_TOCMAC_REC), SEEK_SET) != 0 ||
+            mfa_write_exact(f, mac, sizeof mac)) goto io_err;
+    }
+    if (fseeko(f, 0, SEEK_SET) != 0) goto io_err;
+    if (mfa_write_exact(f, hb, HDR_SIZE)) goto io_err;
+    if (fflush(f) != 0) goto io_err;
+    mfa_phase_end(opt->stats, MFA_PHASE_TOC_WRITE, &mark, 0, toc_len + HDR_SIZE);
+
+done:
+    job_free(&job);
+    memset(key, 0, sizeof key);
+    free(hashes);
+    free(toc);
+    free(entry_pos);
+    if (f == stdout) return fflush(f) == 0 ? 0 : -1;
+    if (fclose(f) != 0) { perror("fclose"); return -1; }
+    return 0;
+
+io_err:
+    perror("I/O");
+fail:
+    if (f && f != stdout) fclose(f);
+    job_free(&job);
+    memset(key, 0, sizeof key);
+    free(hashes);
+    free(toc);
+    free(entry_pos);
+    return -1;
+}
+
+/* ============================================================
+   TOC reader
+   ============================================================ */
+
+typedef struct {
+    uint64_t  orig_size;
+    uint64_t  stored_size;
+    uint64_t  data_offset;
+    uint32_t  flags;
+    uint16_t  alg_id;
+    uint16_t  meta_len;
+    uint32_t  name_len;    /* stored name length */
+    size_t    name_off;    /* sanitized, NUL-terminated name in the pool */
+    size_t    meta_off;    /* meta area in the pool */
+} mfa_toc_entry;
+
+/* A decoded TOC: one entry array plus one pool holding every name
+   and meta area, so opening an archive costs two allocations
+   whatever its entry count. Entries refer into the pool by offset,
+   which lets it grow while the TOC is being read. */
+typedef struct {
+    mfa_toc_entry *ents;
+    size_t         n;
+    char          *pool;
+    size_t         pool_len;
+    size_t         pool_cap;
+} mfa_toc;
+
+static void toc_free(mfa_toc *t) {
+    free(t->ents);
+    free(t->pool);
+    memset(t, 0, sizeof *t);
+}
+
+/* Room for count entries and, as a first guess, pool_hint bytes. */
+static int toc_init(mfa_toc *t, size_t count, size_t pool_hint) {
+    memset(t, 0, sizeof *t);
+    t->ents = (mfa_toc_entry *)calloc(count ? count : 1, sizeof *t->ents);
+    t->pool = (char *)malloc(pool_hint ? pool_hint : 1);
+    if (!t->ents || !t->pool) { toc_free(t); return -1; }
+    t->pool_cap = pool_hint ? pool_hint : 1;
+    return 0;
+}
+
+/* Reserve n pool bytes; *off receives their offset. */
+static int pool_alloc(mfa_toc *t, size_t n, size_t *off) {
+    if (n > t->pool_cap - t->pool_len) {
+        size_t cap = t->pool_cap;
+        char *np;
+        while (n > cap - t->pool_len) {
+            if (cap > ((size_t)-1) / 2) return -1;
+            cap *= 2;
+        }
+        np = (char *)realloc(t->pool, cap);
+        if (!np) return -1;
+        t->pool = np;
+        t->pool_cap = cap;
+    }
+    *off = t->pool_len;
+    t->pool_len += n;
+    return 0;
+}
+
+/* Reserve the pool bytes of entry e (name_len, meta_len set):
+   the name plus its terminator, then the meta area. */
+static int pool_entry(mfa_toc *t, mfa_toc_entry *e) {
+    if (pool_alloc(t, (size_t)e->name_len + 1 + e->meta_len, &e->name_off)) return -1;
+    e->meta_off = e->name_off + e->name_len + 1;
+    t->pool[e->meta_off - 1] = '\0';
+    return 0;
+}
+
+static const char *toc_name(const mfa_toc *t, const mfa_toc_entry *e) {
+    return t->pool + e->name_off;
+}
+
+static const uint8_t *toc_meta(const mfa_toc *t, const mfa_toc_entry *e) {
+    return (const uint8_t *)t->pool + e->meta_off;
+}
+
+/* Decode one TOC record from p (avail bytes) into e, except for the
+   pool offsets; *raw_name points at the stored name bytes. Returns
+   the record length; the meta area is its last e->meta_len bytes.
+   Returns 0 if the record is truncated. */
+static size_t entry_parse(const uint8_t *p, uint64_t avail, mfa_toc_entry *e,
+                          const uint8_t **raw_name, uint32_t *name_len) {
+    uint32_t nl;
+    uint16_t meta_len;
+    const uint8_t *f;
+
+    if (avail < 4) return 0;
+    nl = mfa_ld32(p);
+    if (avail - 4 < (uint64_t)nl + TOC_FIXED - 4) return 0;
+    f = p + 4 + nl;
+
+    e->orig_size   = mfa_ld64(f);
+    e->stored_size = mfa_ld64(f + 8);
+    e->data_offset = mfa_ld64(f + 16);
+    e->flags       = mfa_ld32(f + 24);
+    e->alg_id      = mfa_ld16(f + 28);
+    meta_len       = mfa_ld16(f + 30);
+    if (avail - 4 - nl - 32 < meta_len) return 0;
+    e->meta_len    = meta_len;
+    e->name_len    = nl;
+
+    *raw_name = p + 4;
+    *name_len = nl;
+    return (size_t)TOC_FIXED + nl + meta_len;
+}
+
+/* Decode the record at p into the next entry of t, copying its
+   name (sanitized) and meta area into the pool. Returns the record
+   length, or 0 if it is truncated, its name is not a safe relative
+   path, or memory runs out. */
+static size_t toc_add(mfa_toc *t, const uint8_t *p, uint64_t avail) {
+    mfa_toc_entry *e = &t->ents[t->n];
+    const uint8_t *raw;
+    uint32_t name_len;
+    size_t used = entry_parse(p, avail, e, &raw, &name_len);
+
+    if (!used || pool_entry(t, e)) return 0;
+    memcpy(t->pool + e->name_off, raw, name_len);
+    if (mfa_sanitize(t->pool + e->name_off)) {
+        fprintf(stderr, "Unsafe entry name: %s\n", t->pool + e->name_off);
+        return 0;
+    }
+    memcpy(t->pool + e->meta_off, p + used - e->meta_len, e->meta_len);
+    ++t->n;
+    return used;
+}
+
+/* Length of the count records at p, or 0 if they do not all fit
+   in avail bytes. */
+static uint64_t toc_span(const uint8_t *p, uint64_t avail, uint32_t count) {
+    uint64_t pos = 0;
+    uint32_t i;
+    for (i = 0; i < count; ++i) {
+        mfa_toc_entry e;
+        const uint8_t *raw;
+        uint32_t nl;
+        size_t used = entry_parse(p + pos, avail - pos, &e, &raw, &nl);
+        if (!used) return 0;
+        pos += used;
+    }
+    return pos;
+}
+
+/* Decode the count records at p (avail bytes) into t. Nothing is
+   trusted: every field is bounds-checked before it is touched. */
+static int toc_parse(const uint8_t *p, uint64_t avail, uint32_t count, mfa_toc *t) {
+    uint32_t i;
+
+    if (count > avail / TOC_FIXED) return -1;
+    if (toc_init(t, count, (size_t)count * 32)) return -1;
+
+    for (i = 0; i < count; ++i) {
+        size_t used = toc_add(t, p, avail);
+        if (!used) { toc_free(t); return -1; }
+        p += used;
+        avail -= used;
+    }
+    return 0;
+}
+
+/* Encoded TOC length, and the stored and original bytes of every
+   entry in t (for --stats). Data shared by duplicates or a solid
+   block is stored once: such entries point back at or before the
+   end of data already seen. */
+static void toc_totals(const mfa_toc *t, uint64_t *toc_len,
+                       uint64_t *stored, uint64_t *orig) {
+    uint64_t seen = 0;
+    size_t i;
+    *toc_len = *stored = *orig = 0;
+    for (i = 0; i < t->n; ++i) {
+        const mfa_toc_entry *e = &t->ents[i];
+        *toc_len += TOC_FIXED + e->name_len + e->meta_len;
+        *orig    += e->orig_size;
+        if (e->data_offset >= seen) {
+            *stored += e->stored_size;
+            seen = e->data_offset + e->stored_size;
+        }
+    }
+}
+
+/* ============================================================
+   Archive handle
+   ------------------------------------------------------------
+   Readers open the archive once and map it read-only. The TOC
+   is parsed straight from the mapping and entry bytes are
+   served from it without staging copies; if mmap is not
+   possible (e.g. special files) everything falls back to
+   pread(): the TOC in one bulk read, entry data on demand.
+   ============================================================ */
+
+typedef struct {
+    FILE          *fp;
+    int            fd;
+    const uint8_t *map;          /* whole-file mapping, or NULL */
+    uint64_t       size;         /* file size; 0 if unknown (not a file) */
+    mfa_header     hdr;
+    uint64_t       index_off;    /* name index, if index_slots != 0 */
+    uint32_t       index_slots;
+    mfa_toc        toc;          /* parsed TOC, or the one entry looked up */
+
+    /* EXT_CRYPT; the key is set once a passphrase checks out */
+    int            encrypted;
+    uint32_t       kdf_iterations;
+    uint8_t        salt[KDF_SALT];
+    uint8_t        check[KEY_CHECK];
+    int            keyed;
+    uint8_t        key[MFA_KEY_LEN];
+
+    /* EXT_TOCMAC, and where it starts in the extension area */
+    int            has_tocmac;
+    uint32_t       tocmac_off;
+    uint8_t        tocmac[TOCMAC_LEN];
+
+    /* EXT_DICT as read, and the dictionary once it can be used */
+    uint8_t       *dict_rec;
+    uint32_t       dict_rec_len;
+    mfa_dict      *dict;
+} mfa_archive;
+
+static void archive_close(mfa_archive *a) {
+    toc_free(&a->toc);
+    free(a->dict_rec);
+    mfa_dict_free(a->dict);
+    if (a->map) munmap((void *)a->map, (size_t)a->size);
+    if (a->fp) fclose(a->fp);
+    memset(a, 0, sizeof *a);
+}
+
+/* Copy archive bytes [off, off+n) into buf. */
+static int archive_read(const mfa_archive *a, void *buf, size_t n, uint64_t off) {
+    if (a->map) {
+        if (off > a->size || n > a->size - off) return -1;
+        memcpy(buf, a->map + off, n);
+        return 0;
+    }
+    return mfa_pread_exact(a->fd, buf, n, off);
+}
+
+#define EXT_AREA_MAX  (1u << 24)
+
+/* Walk the extension records we understand in ext[0..ext_len). */
+static int ext_parse(mfa_archive *a, const uint8_t *ext, uint32_t ext_len) {
+    uint32_t pos = 0;
+
+    while (ext_len - pos >= EXT_REC_HDR) {
+        uint16_t tag = mfa_ld16(ext + pos);
+        uint32_t len = mfa_ld32(ext + pos + 4);
+        const uint8_t *body = ext + pos + EXT_REC_HDR;
+
+        if (ext_len - pos - EXT_REC_HDR < len) break;
+        if (tag == EXT_INDEX && len >= 12) {
+            uint32_t slots = mfa_ld32(body + 8);
+            if (slots && (slots & (slots - 1)) == 0) {
+                a->index_off   = mfa_ld64(body);
+                a->index_slots = slots;
+            }
+        } else if (tag == EXT_CRYPT) {
+            /* An encryption scheme we cannot follow is fatal, not
+               something to skip. */
+            if (len < CRYPT_LEN || mfa_ld16(body) != KDF_PBKDF2 ||
+                mfa_ld16(body + 2) != CIPHER_CHACHA || mfa_ld32(body + 4) == 0)
+                return -1;
+            if (mfa_ld32(body + 4) > KDF_ITERATIONS_MAX) {
+                fprintf(stderr, "Key derivation asks for %lu iterations, more than %lu.\n",
+                        (unsigned long)mfa_ld32(body + 4), (unsigned long)KDF_ITERATIONS_MAX);
+                return -1;
+            }
+            a->encrypted      = 1;
+            a->kdf_iterations = mfa_ld32(body + 4);
+            memcpy(a->salt, body + 8, KDF_SALT);
+            memcpy(a->check, body + 8 + KDF_SALT, KEY_CHECK);
+        } else if (tag == EXT_DICT) {
+            if (len < ENTRY_NONCE || len - ENTRY_NONCE > MFA_DICT_MAX) return -1;
+            free(a->dict_rec);
+            a->dict_rec = (uint8_t *)malloc(len);
+            if (!a->dict_rec) return -1;
+            memcpy(a->dict_rec, body, len);
+            a->dict_rec_len = len;
+        } else if (tag == EXT_TOCMAC) {
+            /* Only what precedes it is covered, so it comes last */
+            if (len != TOCMAC_LEN || ext_len - pos - EXT_REC_HDR != len) return -1;
+            memcpy(a->tocmac, body, TOCMAC_LEN);
+            a->tocmac_off = pos;
+            a->has_tocmac = 1;
+        }
+        pos += EXT_REC_HDR + len;
+    }
+    return 0;
+}
+
+/* Read and walk the header's extension area. */
+static int ext_load(mfa_archive *a) {
+    uint8_t *ext;
+    int rc;
+
+    if (!a->hdr.ext_off || !a->hdr.ext_len) return 0;
+    if (a->hdr.ext_len > EXT_AREA_MAX) return -1;
+
+    ext = (uint8_t *)malloc(a->hdr.ext_len);
+    if (!ext) return -1;
+    rc = archive_read(a, ext, a->hdr.ext_len, a->hdr.ext_off) ? -1
+       : ext_parse(a, ext, a->hdr.ext_len);
+    free(ext);
+    return rc;
+}
+
+static const char *entry_name(const mfa_archive *a, const mfa_toc_entry *e) {
+    return toc_name(&a->toc, e);
+}
+
+/* Coded and encrypted entries are stored as a block table. */
+static int entry_has_blocks(const mfa_toc_entry *e) {
+    return (e->flags & (MFA_COMPRESS | MFA_ENCRYPT)) != 0;
+}
+
+/* Reject entries whose data would lie outside the archive, or whose
+   sizes disagree with how they are stored. */
+static int entry_check(const mfa_archive *a, const mfa_toc_entry *e) {
+    int ok = 1;
+
+    if (!entry_has_blocks(e) && e->stored_size != e->orig_size) ok = 0;
+    if (a->size && (e->stored_size > a->size || e->data_offset > a->size - e->stored_size))
+        ok = 0;
+    if (!ok) fprintf(stderr, "%s: bad offset or size\n", entry_name(a, e));
+    return ok ? 0 : -1;
+}
+
+/* Copy up to n archive bytes at off into buf, stopping early at
+   the end of the file. Returns the bytes copied, or -1. */
+static long long archive_read_some(const mfa_archive *a, void *buf, size_t n, uint64_t off) {
+    size_t done = 0;
+
+    if (a->map) {
+        if (off > a->size) return 0;
+        if (n > a->size - off) n = (size_t)(a->size - off);
+        memcpy(buf, a->map + off, n);
+        return (long long)n;
+    }
+    while (done < n) {
+        ssize_t r = pread(a->fd, (uint8_t *)buf + done, n - done, (off_t)(off + done));
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0) return -1;
+        if (r == 0) break;
+        done += (size_t)r;
+    }
+    return (long long)done;
+}
+
+/* Read the raw TOC records into an owned buffer. Their total length
+   is only known by walking them, so a window from toc_off is read
+   in bulk and doubled until every record fits. */
+static int toc_fetch(const mfa_archive *a, uint8_t **out, uint64_t *out_len) {
+    uint8_t *buf = NULL;
+    size_t want = (size_t)1 << 16;
+
+    for (;;) {
+        uint8_t *nb = (uint8_t *)realloc(buf, want);
+        long long got;
+        uint64_t span;
+
+        if (!nb) break;
+        buf = nb;
+        got = archive_read_some(a, buf, want, a->hdr.toc_off);
+        if (got < 0) break;
+        span = toc_span(buf, (uint64_t)got, a->hdr.count);
+        if (span || a->hdr.count == 0) {
+            *out = buf;
+            *out_len = span;
+            return 0;
+        }
+        if ((size_t)got < want || want > ((size_t)-1) / 2) break;   /* truncated */
+        want *= 2;
+    }
+    free(buf);
+    return -1;
+}
+
+/* Decode the whole TOC into a->toc: in place from the mapping, else
+   from one bulk read. */
+static int archive_load_toc(mfa_archive *a) {
+    uint8_t *buf;
+    uint64_t len;
+    int rc;
+
+    if (a->toc.ents) return 0;      /* already read by archive_auth */
+    if (a->map) {
+        if (a->hdr.toc_off > a->size) return -1;
+        return toc_parse(a->map + a->hdr.toc_off, a->size - a->hdr.toc_off,
+                         a->hdr.count, &a->toc);
+    }
+    if (toc_fetch(a, &buf, &len)) return -1;
+    rc = toc_parse(buf, len, a->hdr.count, &a->toc);
+    free(buf);
+    return rc;
+}
+
+/* A streamed archive's header is its footer, the file's last
+   HDR_SIZE bytes; the one at offset 0 was written before anything
+   was known. */
+static int archive_footer(mfa_archive *a) {
+    uint8_t hb[HDR_SIZE];
+
+    if (!(a->hdr.gflags & GF_STREAMED)) return 0;
+    if (a->size < 2 * HDR_SIZE ||
+        archive_read(a, hb, sizeof hb, a->size - HDR_SIZE) || hdr_parse(hb, &a->hdr))
+        return -1;
+    return (a->hdr.gflags & GF_STREAMED) && a->hdr.arch_sz == a->size ? 0 : -1;
+}
+
+/* Open and map an archive; parse the TOC too if want_toc. */
+static int archive_open(const char *path, mfa_archive *a, int want_toc) {
+    struct stat st;
+    uint8_t hb[HDR_SIZE];
+    int rc = 0;
+
+    memset(a, 0, sizeof *a);
+    a->fp = fopen(path, "rb");
+    if (!a->fp) { perror(path); return -1; }
+    a->fd = fileno(a->fp);
+
+    if (fstat(a->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        a->size = (uint64_t)st.st_size;
+        if (a->size == (uint64_t)(size_t)a->size) {
+            void *m = mmap(NULL, (size_t)a->size, PROT_READ, MAP_SHARED, a->fd, 0);
+            if (m != MAP_FAILED) a->map = (const uint8_t *)m;
+        }
+    }
+
+    if (archive_read(a, hb, sizeof hb, 0) || hdr_parse(hb, &a->hdr) ||
+        archive_footer(a) || ext_load(a))
+        rc = -1;
+    else if (want_toc)
+        rc = archive_load_toc(a);
+
+    if (rc == 0) {
+        size_t i;
+        for (i = 0; i < a->toc.n && rc == 0; ++i) rc = entry_check(a, &a->toc.ents[i]);
+    }
+
+    if (rc) {
+        fprintf(stderr, "%s: not a valid archive\n", path);
+        archive_close(a);
+        return -1;
+    }
+    return 0;
+}
+
+/* Set up the dictionary from EXT_DICT, decrypting it if need be;
+   an encrypted archive's stays unusable until it is keyed. */
+static int archive_dict(mfa_archive *a, const char *path) {
+    uint8_t *bytes;
+    size_t n;
+
+    if (!a->dict_rec || a->dict || (a->encrypted && !a->keyed)) return 0;
+    bytes = a->dict_rec + ENTRY_NONCE;
+    n = a->dict_rec_len - ENTRY_NONCE;
+    if (a->encrypted) {
+        uint8_t nonce[MFA_NONCE_LEN];
+        block_nonce(nonce, a->dict_rec, 0);
+        mfa_chacha20_xor(a->key, nonce, 0, bytes, bytes, n);
+    }
+    a->dict = mfa_dict_new(bytes, n);
+    memset(bytes, 0, n);
+    if (!a->dict) { fprintf(stderr, "%s: cannot load dictionary\n", path); return -1; }
+    return 0;
+}
+
+/* Check a keyed archive's TOC and extension area against its
+   EXT_TOCMAC, and keep the TOC so checked in a->toc: an unchecked
+   one read later, or the name index, could say something else. */
+static int archive_auth(mfa_archive *a, const char *path) {
+    const uint8_t *toc = NULL;
+    uint8_t *buf = NULL, *ext;
+    uint8_t tag[MFA_TAG_LEN];
+    uint64_t toc_len = 0;
+    mfa_poly1305 m;
+    int ok = 0;
+
+    if (!a->has_tocmac) {
+        fprintf(stderr, "%s: TOC is not authenticated\n", path);
+        return -1;
+    }
+    if (a->map && a->hdr.toc_off <= a->size) {
+        toc = a->map + a->hdr.toc_off;
+        toc_len = toc_span(toc, a->size - a->hdr.toc_off, a->hdr.count);
+        ok = toc_len || !a->hdr.count;
+    } else if (!a->map && toc_fetch(a, &buf, &toc_len) == 0) {
+        toc = buf;
+        ok = 1;
+    }
+    ext = (uint8_t *)malloc(a->tocmac_off ? a->tocmac_off : 1);
+    ok = ok && ext && archive_read(a, ext, a->tocmac_off, a->hdr.ext_off) == 0;
+    if (ok) {
+        toc_mac_init(&m, a->key, a->tocmac, a->hdr.count);
+        mfa_poly1305_update(&m, toc, (size_t)toc_len);
+        mfa_poly1305_update(&m, ext, a->tocmac_off);
+        mfa_poly1305_final(&m, tag);
+        if (!sum_equal(tag, a->tocmac + ENTRY_NONCE, MFA_TAG_LEN)) {
+            fprintf(stderr, "%s: TOC authentication failed\n", path);
+            free(ext);
+            free(buf);
+            return -1;
+        }
+        if (!a->toc.ents) ok = toc_parse(toc, toc_len, a->hdr.count, &a->toc) == 0;
+    }
+    if (!ok) fprintf(stderr, "%s: not a valid archive\n", path);
+    free(ext);
+    free(buf);
+    return ok ? 0 : -1;
+}
+
+/* Derive the key of an encrypted archive from pass. Without a pass
+   the archive stays locked: its TOC can be listed, its encrypted
+   entries not read. A wrong pass is an error, and so is a TOC
+   that fails archive_auth; a front-to-back reader (no file) has
+   none to check. */
+static int archive_unlock(mfa_archive *a, const char *path, const char *pass) {
+    uint8_t check[KEY_CHECK];
+
+    if (a->encrypted && pass && *pass) {
+        derive_key(pass, a->salt, a->kdf_iterations, a->key);
+        key_check(a->key, check);
+        if (memcmp(check, a->check, KEY_CHECK) != 0) {
+            fprintf(stderr, "%s: wrong passphrase\n", path);
+            memset(a->key, 0, sizeof a->key);
+            return -1;
+        }
+        a->keyed = 1;
+        if (a->fp && archive_auth(a, path)) return -1;
+    }
+    return archive_dict(a, path);
+}
+
+/* Pointer to archive bytes [off, off+n) inside the mapping, or NULL
+   when unmapped or out of range. */
+static const uint8_t *archive_bytes(const mfa_archive *a, uint64_t off, uint64_t n) {
+    if (!a->map || off > a->size || n > a->size - off) return NULL;
+    return a->map + off;
+}
+
+/* ============================================================
+   List
+   ============================================================ */
+
+static int extent_cmp(const void *a, const void *b) {
+    const uint64_t *x = (const uint64_t *)a, *y = (const uint64_t *)b;
+    if (x[0] != y[0]) return x[0] < y[0] ? -1 : 1;
+    return (x[1] > y[1]) - (x[1] < y[1]);
+}
+
+/* Entries sharing a data_offset were deduplicated at pack time:
+   report how many bytes the TOC references per byte stored. Solid
+   block members share theirs by design and are summed apart. */
+static void list_dedup_summary(const mfa_toc_entry *ents, size_t n) {
+    uint64_t *ext;          /* (data_offset, stored_size) pairs */
+    uint64_t *blk;          /* the same, for solid block members */
+    uint64_t referenced = 0, stored = 0, solid_bytes = 0;
+    size_t i, m = 0, nm = 0, dups = 0, blocks = 0;
+
+    ext = (uint64_t *)malloc((n ? n : 1) * 4 * sizeof *ext);
+    if (!ext) return;
+    blk = ext + 2 * n;
+    for (i = 0; i < n; ++i) {
+        if (ents[i].flags & ENTRY_SOLID) {
+            blk[2 * nm]     = ents[i].data_offset;
+            blk[2 * nm + 1] = ents[i].stored_size;
+            ++nm;
+            continue;
+        }
+        if (!ents[i].stored_size) continue;
+        ext[2 * m]     = ents[i].data_offset;
+        ext[2 * m + 1] = ents[i].stored_size;
+        referenced += ents[i].stored_size;
+        ++m;
+    }
+    qsort(ext, m, 2 * sizeof *ext, extent_cmp);
+    for (i = 0; i < m; ++i) {
+        if (i && ext[2 * i] == ext[2 * i - 2] && ext[2 * i + 1] == ext[2 * i - 1]) ++dups;
+        else stored += ext[2 * i + 1];
+    }
+    qsort(blk, nm, 2 * sizeof *blk, extent_cmp);
+    for (i = 0; i < nm; ++i) {
+        if (i && blk[2 * i] == blk[2 * i - 2]) continue;
+        ++blocks;
+        solid_bytes += blk[2 * i + 1];
+    }
+    free(ext);
+
+    printf("Dedup: %zu duplicate entries, %llu bytes referenced / %llu stored (%.2fx)\n",
+           dups, (unsigned long long)referenced, (unsigned long long)stored,
+           stored ? (double)referenced / (double)stored : 1.0);
+    if (nm)
+        printf("Solid: %zu entries in %zu blocks, %llu bytes stored\n",
+               nm, blocks, (unsigned long long)solid_bytes);
+}
+
+int mfa_list(const char *archive_path) {
+    mfa_archive ar;
+    const mfa_toc_entry *ents;
+    size_t n;
+    size_t i;
+
+    if (archive_open(archive_path, &ar, 1)) return -1;
+    ents = ar.toc.ents;
+    n = ar.toc.n;
+
+    printf("Archive: %s\n", archive_path);
+    if (ar.encrypted)
+        printf("Encrypted: ChaCha20, key from PBKDF2-HMAC-SHA256 (%lu iterations)\n",
+               (unsigned long)ar.kdf_iterations);
+    if (ar.dict_rec)
+        printf("Dictionary: %lu bytes (entries marked +d)\n",
+               (unsigned long)(ar.dict_rec_len - ENTRY_NONCE));
+    for (i = 0; i < n && !(ents[i].flags & ENTRY_DELTA); ++i) {}
+    if (i < n) printf("Delta filtered: entries marked :STRIDE\n");
+    printf("%-6s  %-10s  %-10s  %-9s  %s\n", "Index", "OrigSize", "Stored", "Alg", "Name");
+    for (i = 0; i < n; ++i) {
+        const mfa_codec *codec = mfa_codec_get(ents[i].alg_id);
+        char alg[24];
+        int k = sprintf(alg, "%.8s%s", codec ? codec->name : "?",
+                        (ents[i].flags & ENTRY_DICT) ? "+d" : "");
+        if (ents[i].flags & ENTRY_DELTA) sprintf(alg + k, ":%u", ENTRY_STRIDE(ents[i].flags));
+        printf("%-6zu  %-10llu  %-10llu  %-9s  %s\n",
+               i,
+               (unsigned long long)ents[i].orig_size,
+               (unsigned long long)ents[i].stored_size,
+               alg,
+               toc_name(&ar.toc, &ents[i]));
+    }
+    list_dedup_summary(ents, n);
+
+    archive_close(&ar);
+    return 0;
+}
+
+/* ============================================================
+   Extract
+   ------------------------------------------------------------
+   Threads share the one archive handle and never its file
+   position: stored bytes come from the mapping (or pread), and
+   raw entries are handed to the kernel with copy_file_range()
+   so their bytes never cross into user space at all.
+   ============================================================ */
+
+#define COPY_CHUNK (1024u * 1024u)
+
+/* Create/truncate out_path for writing; "-" means standard output. */
+static int open_out(const char *out_path) {
+    int fd;
+    if (strcmp(out_path, "-") == 0) {
+        fd = dup(STDOUT_FILENO);
+        if (fd < 0) perror("dup");
+        return fd;
+    }
+    fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) perror(out_path);
+    return fd;
+}
+
+/* Copy archive bytes [off, off+len) to out_fd (none if out_fd < 0),
+   folding them into sum when it is non-NULL. */
+static int copy_range_to(const mfa_archive *a, int out_fd, uint64_t off, uint64_t len,
+                         content_sum *sum) {
+    const uint8_t *src;
+    uint8_t *buf;
+
+#if defined(__linux__)
+    /* In-kernel copy; falls through when the filesystems disagree.
+       Bytes that must be checksummed have to be seen, though. */
+    while (len && !sum) {
+        loff_t in_off = (loff_t)off;
+        size_t want = len > (1u << 30) ? (1u << 30) : (size_t)len;
+        ssize_t r = copy_file_range(a->fd, &in_off, out_fd, NULL, want, 0);
+        if (r > 0) { off += (uint64_t)r; len -= (uint64_t)r; continue; }
+        if (r < 0 && errno == EINTR) continue;
+        if (r == 0) return -1;  /* archive shorter than the TOC claims */
+        break;
+    }
+    if (!len) return 0;
+#endif
+
+    /* Straight from the page cache mapping: one kernel copy. The
+       checksum runs a chunk ahead of the write, while it is hot. */
+    src = archive_bytes(a, off, len);
+    if (src) {
+        while (len) {
+            size_t chunk = (len > COPY_CHUNK) ? COPY_CHUNK : (size_t)len;
+            if (sum) sum_update(sum, src, chunk);
+            if (out_fd >= 0 && mfa_write_fd_exact(out_fd, src, chunk)) return -1;
+            src += chunk;
+            len -= chunk;
+        }
+        return 0;
+    }
+
+    /* Unmapped archive: bounce through a buffer. */
+    buf = (uint8_t *)malloc(COPY_CHUNK);
+    if (!buf) { perror("malloc"); return -1; }
+    while (len) {
+        size_t chunk = (len > COPY_CHUNK) ? COPY_CHUNK : (size_t)len;
+        if (mfa_pread_exact(a->fd, buf, chunk, off)) { free(buf); return -1; }
+        if (sum) sum_update(sum, buf, chunk);
+        if (out_fd >= 0 && mfa_write_fd_exact(out_fd, buf, chunk)) { free(buf); return -1; }
+        len -= chunk;
+        off += chunk;
+    }
+    free(buf);
+    return 0;
+}
+
+/* Fetch n archive bytes at off: a pointer into the mapping, or a read
+   into *buf (grown as needed) when the archive is not mapped. */
+static const uint8_t *fetch(const mfa_archive *a, uint64_t off, size_t n,
+                            uint8_t **buf, size_t *cap) {
+    const uint8_t *p = archive_bytes(a, off, n);
+    if (p || a->map) return p;  /* mapped but out of range: NULL */
+
+    if (n > *cap) {
+        uint8_t *nb = (uint8_t *)realloc(*buf, n ? n : 1);
+        if (!nb) return NULL;
+        *buf = nb; *cap = n;
+    }
+    if (n && mfa_pread_exact(a->fd, *buf, n, off)) return NULL;
+    return *buf;
+}
+
+/* ============================================================
+   Block tables
+   ------------------------------------------------------------
+   A block_reader walks one coded entry. Block k starts at the
+   sum of the stored sizes before it, so sequential readers keep
+   a running offset and random readers sum the table prefix. A
+   solid block member reads as a one-block entry whose bytes are
+   a slice of that block.
+   ============================================================ */
+
+/* Find meta record `tag` of e; NULL if absent or malformed. */
+static const uint8_t *meta_find(const mfa_archive *a, const mfa_toc_entry *e,
+                                uint16_t tag, uint16_t *len) {
+    const uint8_t *meta = toc_meta(&a->toc, e);
+    uint32_t pos = 0;
+    while (e->meta_len - pos >= META_REC_HDR) {
+        uint16_t t = mfa_ld16(meta + pos);
+        uint16_t l = mfa_ld16(meta + pos + 2);
+        if ((uint32_t)e->meta_len - pos - META_REC_HDR < l) break;
+        if (t == tag) { *len = l; return meta + pos + META_REC_HDR; }
+        pos += META_REC_HDR + l;
+    }
+    return NULL;
+}
+
+typedef struct {
+    const mfa_archive   *a;
+    const mfa_toc_entry *e;
+    const mfa_codec     *codec;
+    unsigned             log2;
+    size_t               nblocks;
+    const uint8_t       *sizes;     /* nblocks u32 words from META_BLOCKS */
+    uint64_t             span;      /* plain bytes the blocks decode to */
+    uint32_t             base;      /* entry's first byte within them */
+    unsigned             frame;     /* bytes ahead of each block (ENTRY_FRAMED) */
+    uint8_t             *in;        /* staging for unmapped archives */
+    size_t               in_cap;
+    uint8_t             *plain;     /* one decoded block */
+    const uint8_t       *nonce;     /* entry nonce if encrypted, else NULL */
+    uint8_t             *dec;       /* one decrypted compressed block */
+    size_t               dec_cap;
+    const mfa_dict      *dict;      /* the archive's, if ENTRY_DICT */
+    unsigned             stride;    /* delta filter stride, if ENTRY_DELTA */
+} block_reader;
+
+/* Bytes block k takes up in the entry's stored data. */
+static uint32_t block_stored(const block_reader *r, size_t k) {
+    return (mfa_ld32(r->sizes + 4 * k) & ~BLOCK_RAW) + r->frame;
+}
+
+static int block_reader_init(block_reader *r, const mfa_archive *a, const mfa_toc_entry *e) {
+    const uint8_t *p;
+    uint16_t len = 0;
+
+    memset(r, 0, sizeof *r);
+    r->a = a;
+    r->e = e;
+    r->frame = (e->flags & ENTRY_FRAMED) ? BLOCK_FRAME : 0;
+    r->codec = mfa_codec_get(e->alg_id);
+    if (!r->codec) {
+        fprintf(stderr, "%s: unknown codec %u\n", entry_name(a, e), (unsigned)e->alg_id);
+        return -1;
+    }
+
+    if (e->flags & ENTRY_SOLID) {
+        p = meta_find(a, e, META_SOLID, &len);
+        if (!p || len < SOLID_META) goto bad;
+        r->base    = mfa_ld32(p);
+        r->span    = mfa_ld32(p + 4);
+        r->sizes   = p + 8;
+        r->nblocks = 1;
+        if (!r->span || r->base > r->span || e->orig_size > r->span - r->base ||
+            block_stored(r, 0) != e->stored_size) goto bad;
+        while (((uint64_t)1 << r->log2) < r->span) ++r->log2;
+        if (r->log2 > BLOCK_LOG2_MAX) goto bad;
+    } else {
+        p = meta_find(a, e, META_BLOCKS, &len);
+        if (!p || len < 4 || (len - 4) % 4 || p[0] > BLOCK_LOG2_MAX) goto bad;
+        r->log2    = p[0];
+        r->nblocks = (size_t)(len - 4) / 4;
+        r->sizes   = p + 4;
+        r->span    = e->orig_size;
+        if (r->nblocks != entry_blocks(e->orig_size, 1, r->log2)) goto bad;
+    }
+
+    if (e->flags & MFA_ENCRYPT) {
+        if (!a->keyed) {
+            fprintf(stderr, "%s: encrypted, passphrase required\n", entry_name(a, e));
+            return -1;
+        }
+        r->nonce = meta_find(a, e, META_NONCE, &len);
+        if (!r->nonce || len != ENTRY_NONCE) goto bad;
+    }
+    if (e->flags & ENTRY_DICT) {
+        r->dict = a->dict;
+        if (!r->dict || !r->codec->decode_dict) {
+            fprintf(stderr, "%s: dictionary missing\n", entry_name(a, e));
+            return -1;
+        }
+    }
+    if (e->flags & ENTRY_DELTA) {
+        r->stride = ENTRY_STRIDE(e->flags);
+        if (!r->stride) goto bad;
+    }
+    return 0;
+
+bad:
+    fprintf(stderr, "%s: bad block table\n", entry_name(a, e));
+    return -1;
+}
+
+static void block_reader_free(block_reader *r) {
+    free(r->in);
+    free(r->plain);
+    free(r->dec);
+}
+
+/* Plain length of block k. */
+static size_t block_plain_len(const block_reader *r, size_t k) {
+    uint64_t start = (uint64_t)k << r->log2;
+    return (size_t)(r->span - start < ((uint64_t)1 << r->log2)
+                    ? r->span - start : ((uint64_t)1 << r->log2));
+}
+
+/* Decode block k from its stored payload, described by table word
+   `word`, to rlen plain bytes. *out points at them: at payload
+   itself for clear, unfiltered stored blocks, else into r->plain. */
+static int block_decode(block_reader *r, size_t k, uint32_t word, const uint8_t *payload,
+                        size_t rlen, const uint8_t **out) {
+    size_t plen = (size_t)(word & ~BLOCK_RAW);
+    int    raw  = (word & BLOCK_RAW) != 0;
+
+    if (raw && plen != rlen) return -1;
+    if (!r->plain && (!raw || r->nonce || r->stride)) {
+        r->plain = (uint8_t *)malloc((size_t)1 << r->log2);
+        if (!r->plain) { perror("malloc"); return -1; }
+    }
+
+    /* Decrypt stored blocks straight into the output buffer, coded
+       ones into a staging buffer ahead of the decoder. */
+    if (r->nonce) {
+        uint8_t nonce[MFA_NONCE_LEN];
+        uint8_t *dst = r->plain;
+
+        if (!raw) {
+            if (plen > r->dec_cap) {
+                uint8_t *nb = (uint8_t *)realloc(r->dec, plen ? plen : 1);
+                if (!nb) { perror("realloc"); return -1; }
+                r->dec = nb; r->dec_cap = plen;
+            }
+            dst = r->dec;
+        }
+        block_nonce(nonce, r->nonce, k);
+        mfa_chacha20_xor(r->a->key, nonce, 0, payload, dst, plen);
+        payload = dst;
+    }
+
+    if (raw && !r->stride) {
+        *out = payload;
+        return 0;
+    }
+    if (raw) {
+        if (payload != r->plain) memcpy(r->plain, payload, rlen);
+    } else if (tf_decompress(r->codec, r->dict, payload, plen, r->plain, rlen, 0) != 0) {
+        return -1;
+    }
+    if (r->stride) mfa_delta_decode(r->plain, rlen, r->stride);
+    *out = r->plain;
+    return 0;
+}
+
+/* Decode block k, whose bytes start `rel` bytes into the entry's
+   stored data. *out points at its plain bytes: straight into the
+   mapping for unfiltered stored blocks, else into r->plain. */
+static int block_get(block_reader *r, size_t k, uint64_t rel,
+                     const uint8_t **out, size_t *raw_len) {
+    const mfa_toc_entry *e = r->e;
+    uint32_t word = mfa_ld32(r->sizes + 4 * k);
+    size_t   plen = (size_t)(word & ~BLOCK_RAW);
+    const uint8_t *payload;
+
+    if (rel > e->stored_size || e->stored_size - rel < r->frame + (uint64_t)plen) return -1;
+    payload = fetch(r->a, e->data_offset + rel + r->frame, plen, &r->in, &r->in_cap);
+    if (!payload) return -1;
+
+    *raw_len = block_plain_len(r, k);
+    return block_decode(r, k, word, payload, *raw_len, out);
+}
+
+/* Decode a block-coded entry to out_fd (none if out_fd < 0). */
+static int entry_decode_to(int out_fd, const mfa_archive *a, const mfa_toc_entry *e,
+                           content_sum *sum) {
+    block_reader r;
+    uint64_t rel = 0;
+    size_t k;
+
+    if (block_reader_init(&r, a, e)) return -1;
+
+    for (k = 0; k < r.nblocks; ++k) {
+        const uint8_t *plain;
+        size_t raw_len;
+
+        if (block_get(&r, k, rel, &plain, &raw_len) != 0) {
+            fprintf(stderr, "Decompression failed for %s\n", entry_name(a, e));
+            block_reader_free(&r);
+            return -1;
+        }
+        /* Only a solid member's own slice of its block */
+        plain += r.base;
+        raw_len = (size_t)(e->orig_size < raw_len - r.base ? e->orig_size : raw_len - r.base);
+        if (sum) sum_update(sum, plain, raw_len);
+        if (out_fd >= 0 && mfa_write_fd_exact(out_fd, plain, raw_len)) {
+            perror("write");
+            block_reader_free(&r);
+            return -1;
+        }
+        rel += block_stored(&r, k);
+    }
+
+    block_reader_free(&r);
+    return 0;
+}
+
+/* Set sum up to recompute e's stored checksum, *want pointing at
+   it. Returns 1 if e has one, 0 if not, -1 if e must have one and
+   it cannot be checked: content of an encrypted archive has to be
+   encrypted and carry its tag, or a clear CRC could stand in. */
+static int entry_sum(const mfa_archive *a, const mfa_toc_entry *e, content_sum *sum,
+                     const uint8_t **want) {
+    const uint8_t *nonce, *m;
+    uint16_t len = 0;
+    uint32_t off = 0;
+
+    if (!(e->flags & MFA_ENCRYPT)) {
+        if (a->encrypted && e->orig_size) {
+            fprintf(stderr, "%s: not encrypted in an encrypted archive\n", entry_name(a, e));
+            return -1;
+        }
+        *want = meta_find(a, e, META_CRC32C, &len);
+        if (!*want || len != 4) return 0;
+        sum_init(sum, NULL, NULL, 0);
+        return 1;
+    }
+    if (!a->keyed) {
+        fprintf(stderr, "%s: encrypted, passphrase required\n", entry_name(a, e));
+        return -1;
+    }
+    nonce = meta_find(a, e, META_NONCE, &len);
+    if (!nonce || len != ENTRY_NONCE) goto bad;
+    if (e->flags & ENTRY_SOLID) {
+        m = meta_find(a, e, META_SOLID, &len);
+        if (!m || len < SOLID_META) goto bad;
+        off = mfa_ld32(m);
+    }
+    *want = meta_find(a, e, META_MAC, &len);
+    if (!*want || len != MFA_TAG_LEN) goto bad;
+    sum_init(sum, a->key, nonce, off);
+    return 1;
+
+bad:
+    fprintf(stderr, "%s: missing or bad authentication tag\n", entry_name(a, e));
+    return -1;
+}
+
+/* Finish sum and compare it with the stored checksum want. */
+static int sum_check(const mfa_archive *a, const mfa_toc_entry *e, content_sum *sum,
+                     const uint8_t *want) {
+    uint8_t got[MFA_TAG_LEN];
+
+    sum_final(sum, got);
+    if (sum_equal(got, want, sum_len(sum->keyed))) return 0;
+    if (sum->keyed)
+        fprintf(stderr, "%s: authentication failed\n", entry_name(a, e));
+    else
+        fprintf(stderr, "%s: checksum mismatch (stored %08lx, computed %08lx)\n",
+                entry_name(a, e), (unsigned long)mfa_ld32(want), (unsigned long)mfa_ld32(got));
+    return -1;
+}
+
+/* Decode bytes [offset, offset+len) of coded entry e into buf: only
+   the blocks overlapping the range. */
+static long long read_coded_range(const mfa_archive *a, const mfa_toc_entry *e,
+                                  uint64_t offset, size_t len, uint8_t *buf) {
+    block_reader r;
+    uint64_t rel = 0;
+    size_t k, done = 0;
+
+    if (block_reader_init(&r, a, e)) return -1;
+
+    offset += r.base;
+    k = (size_t)(offset >> r.log2);
+    {
+        size_t j;
+        for (j = 0; j < k; ++j) rel += block_stored(&r, j);
+    }
+
+    for (; done < len; ++k) {
+        const uint8_t *plain;
+        size_t raw_len, skip, take;
+
+        if (block_get(&r, k, rel, &plain, &raw_len) != 0) {
+            fprintf(stderr, "Decompression failed for %s\n", entry_name(a, e));
+            block_reader_free(&r);
+            return -1;
+        }
+        skip = (size_t)((offset + done) - ((uint64_t)k << r.log2));
+        take = raw_len - skip;
+        if (take > len - done) take = len - done;
+        memcpy(buf + done, plain + skip, take);
+        done += take;
+        rel += block_stored(&r, k);
+    }
+
+    block_reader_free(&r);
+    return (long long)done;
+}
+
+/* Send entry e's contents to out_fd (or nowhere if out_fd < 0),
+   checking its checksum on the way when it has one: corruption is
+   caught in the same pass that writes the bytes out. */
+static int entry_stream(const mfa_archive *a, const mfa_toc_entry *e, int out_fd) {
+    content_sum sum;
+    const uint8_t *want = NULL;
+    int checked = entry_sum(a, e, &sum, &want);
+    int rc;
+
+    if (checked < 0) return -1;
+    if (entry_has_blocks(e)) {
+        rc = entry_decode_to(out_fd, a, e, checked ? &sum : NULL);
+    } else {
+        rc = copy_range_to(a, out_fd, e->data_offset, e->stored_size, checked ? &sum : NULL);
+        if (rc) perror("copy");
+    }
+    if (rc == 0 && checked) rc = sum_check(a, e, &sum, want);
+    return rc;
+}
+
+/* ============================================================
+   Solid blocks
+   ------------------------------------------------------------
+   Whole-archive passes take the members of a solid block as one
+   unit: the block is decoded once and each member cut from it,
+   rather than decoding it again for every member.
+   ============================================================ */
+
+typedef struct {
+    size_t *order;      /* entry indices, block members adjacent */
+    size_t *first;      /* unit u is order[first[u] .. first[u+1]) */
+    size_t  n;          /* units */
+} unit_plan;
+
+static int unit_key_cmp(const void *a, const void *b) {
+    const uint64_t *x = (const uint64_t *)a, *y = (const uint64_t *)b;
+    if (x[0] != y[0]) return x[0] < y[0] ? -1 : 1;
+    return (x[1] > y[1]) - (x[1] < y[1]);
+}
+
+static void unit_plan_free(unit_plan *p) {
+    free(p->order);
+    free(p->first);
+    memset(p, 0, sizeof *p);
+}
+
+/* Group t's solid members by block; every other entry is a unit of
+   its own, in TOC order. */
+static int unit_plan_build(const mfa_toc *t, unit_plan *p) {
+    uint64_t *keys;             /* (sort key, entry index) pairs */
+    size_t i;
+
+    memset(p, 0, sizeof *p);
+    keys     = (uint64_t *)malloc((t->n ? t->n : 1) * 2 * sizeof *keys);
+    p->order = (size_t *)malloc((t->n ? t->n : 1) * sizeof *p->order);
+    p->first = (size_t *)malloc((t->n + 1) * sizeof *p->first);
+    if (!keys || !p->order || !p->first) {
+        perror("malloc");
+        free(keys);
+        unit_plan_free(p);
+        return -1;
+    }
+    for (i = 0; i < t->n; ++i) {
+        const mfa_toc_entry *e = &t->ents[i];
+        keys[2 * i]     = (e->flags & ENTRY_SOLID) ? e->data_offset : 0;
+        keys[2 * i + 1] = i;
+    }
+    qsort(keys, t->n, 2 * sizeof *keys, unit_key_cmp);
+
+    for (i = 0; i < t->n; ++i) {
+        const mfa_toc_entry *e = &t->ents[keys[2 * i + 1]];
+        p->order[i] = (size_t)keys[2 * i + 1];
+        if (i == 0 || !(e->flags & ENTRY_SOLID) || keys[2 * i] != keys[2 * i - 2] ||
+            !(t->ents[keys[2 * i - 1]].flags & ENTRY_SOLID))
+            p->first[p->n++] = i;
+    }
+    p->first[p->n] = t->n;
+    free(keys);
+    return 0;
+}
+
+/* Called for each intact member i of a solid block with its bytes. */
+typedef int (*member_fn)(const mfa_archive *a, size_t i, const uint8_t *p, void *ctx);
+
+/* Decode the block shared by entries idx[0..n) once, check each
+   member's slice against its checksum and hand it to fn. Returns -1
+   if any member failed. */
+static int solid_unit(const mfa_archive *a, const size_t *idx, size_t n,
+                      member_fn fn, void *ctx) {
+    const mfa_toc_entry *e0 = &a->toc.ents[idx[0]];
+    block_reader r;
+    const uint8_t *plain;
+    size_t raw_len, k;
+    int rc = 0;
+
+    if (block_reader_init(&r, a, e0)) return -1;
+    if (block_get(&r, 0, 0, &plain, &raw_len) != 0) {
+        fprintf(stderr, "Decompression failed for %s\n", entry_name(a, e0));
+        block_reader_free(&r);
+        return -1;
+    }
+
+    for (k = 0; k < n; ++k) {
+        const mfa_toc_entry *e = &a->toc.ents[idx[k]];
+        const uint8_t *m, *want = NULL;
+        uint16_t len = 0;
+        uint32_t off;
+        content_sum sum;
+        int checked;
+
+        m = meta_find(a, e, META_SOLID, &len);
+        if (!m || len < SOLID_META || e->stored_size != e0->stored_size ||
+            (off = mfa_ld32(m)) > raw_len || e->orig_size > raw_len - off) {
+            fprintf(stderr, "%s: bad solid block reference\n", entry_name(a, e));
+            rc = -1;
+            continue;
+        }
+        checked = entry_sum(a, e, &sum, &want);
+        if (checked > 0) sum_update(&sum, plain + off, (size_t)e->orig_size);
+        if (checked < 0 || (checked && sum_check(a, e, &sum, want))) {
+            rc = -1;
+            continue;
+        }
+        if (fn(a, idx[k], plain + off, ctx)) rc = -1;
+    }
+
+    block_reader_free(&r);
+    return rc;
+}
+
+typedef struct {
+    const mfa_archive *ar;
+    const char        *out_dir;
+    unit_plan          plan;
+    size_t            *range;   /* batched: range r is units range[r] .. range[r+1] */
+    size_t             nranges;
+} extract_ctx;
+
+/* Write entry e of archive a to out_path, creating the directories
+   leading up to it. */
+static int extract_to(const mfa_archive *a, const mfa_toc_entry *e, const char *out_path) {
+    int out;
+    int rc;
+
+    if (strcmp(out_path, "-") != 0 && mfa_make_parents(out_path) != 0) {
+        perror(out_path);
+        return -1;
+    }
+    out = open_out(out_path);
+    if (out < 0) return -1;
+    rc = entry_stream(a, e, out);
+    if (close(out) != 0 && rc == 0) { perror("close"); rc = -1; }
+
+    if (rc) fprintf(stderr, "Failed writing %s\n", out_path);
+    return rc;
+}
+
+static int extract_entry(const extract_ctx *x, size_t i) {
+    const mfa_toc_entry *e = &x->ar->toc.ents[i];
+    char *out_path;
+    int rc;
+
+    out_path = mfa_join_path(x->out_dir, entry_name(x->ar, e));
+    if (!out_path) { perror("malloc"); return -1; }
+
+    rc = extract_to(x->ar, e, out_path);
+    free(out_path);
+    return rc;
+}
+
+/* member_fn: write solid member i, already checked, to its file. */
+static int extract_member(const mfa_archive *a, size_t i, const uint8_t *p, void *arg) {
+    const extract_ctx *x = (const extract_ctx *)arg;
+    const mfa_toc_entry *e = &a->toc.ents[i];
+    char *out_path = mfa_join_path(x->out_dir, entry_name(a, e));
+    int out, rc = -1;
+
+    if (!out_path) { perror("malloc"); return -1; }
+    if (mfa_make_parents(out_path) != 0) {
+        perror(out_path);
+    } else if ((out = open_out(out_path)) >= 0) {
+        rc = mfa_write_fd_exact(out, p, (size_t)e->orig_size);
+        if (rc) perror("write");
+        if (close(out) != 0 && rc == 0) { perror("close"); rc = -1; }
+    }
+    if (rc) fprintf(stderr, "Failed writing %s\n", out_path);
+    free(out_path);
+    return rc;
+}
+
+static int extract_unit(size_t u, void *arg) {
+    const extract_ctx *x = (const extract_ctx *)arg;
+    const size_t *idx = x->plan.order + x->plan.first[u];
+    size_t n = x->plan.first[u + 1] - x->plan.first[u];
+
+    if (x->ar->toc.ents[idx[0]].flags & ENTRY_SOLID)
+        return solid_unit(x->ar, idx, n, extract_member, (void *)x);
+    return extract_entry(x, idx[0]);
+}
+
+/* ============================================================
+   Batched extraction
+   ------------------------------------------------------------
+   Many small files cost more in open/write/close latency than in
+   decoding. With io_uring available, solid members and small
+   entries are decoded into an arena and their files created and
+   written a window at a time (mfa_uring_write); entries over
+   IO_SMALL_ENTRY keep the streaming path. Units are grouped into
+   ranges of about one batch, and ranges run in parallel, each
+   with its own ring.
+   ============================================================ */
+
+#define IO_BATCH_BYTES  (8u << 20)    /* arena bytes before a flush */
+#define IO_SMALL_ENTRY  (256u << 10)  /* largest non-solid entry batched */
+
+typedef struct {
+    const extract_ctx *x;
+    mfa_uring      *ring;
+    mfa_uring_file  files[IO_BATCH_FILES];
+    size_t          offs[IO_BATCH_FILES];   /* file i's bytes in the arena */
+    size_t          n;
+    uint8_t        *arena;
+    size_t          used, cap;
+    char           *dir;    /* parent last created: runs of one directory mkdir once */
+    int             rc;     /* -1 once any flushed file failed */
+} out_batch;
+
+/* Room for len more bytes at the end of the arena, allocated on
+   first use even for len 0 so that an empty entry gets a pointer
+   too. NULL only when memory runs out. */
+static uint8_t *batch_reserve(out_batch *b, size_t len) {
+    if (!b->arena || len > b->cap - b->used) {
+        size_t cap = b->cap ? b->cap : IO_BATCH_BYTES;
+        uint8_t *p;
+
+        while (cap - b->used < len) cap *= 2;
+        p = (uint8_t *)realloc(b->arena, cap);
+        if (!p) { perror("realloc"); return NULL; }
+        b->arena = p;
+        b->cap = cap;
+    }
+    return b->arena + b->used;
+}
+
+/* Create the directories leading to path, unless the previous file
+   had the same parent. */
+static int batch_parents(out_batch *b, const char *path) {
+    const char *slash = strrchr(path, '/');
+    size_t n = slash ? (size_t)(slash - path) : 0;
+    char *dir;
+
+    if (n == 0) return 0;
+    if (b->dir && strlen(b->dir) == n && memcmp(b->dir, path, n) == 0) return 0;
+    if (mfa_make_parents(path) != 0) { perror(path); return -1; }
+
+    dir = (char *)malloc(n + 1);
+    if (dir) {                  /* only a cache: fine to lose */
+        memcpy(dir, path, n);
+        dir[n] = '\0';
+    }
+    free(b->dir);
+    b->dir = dir;
+    return 0;
+}
+
+/* Create and write every queued file, then empty the batch. */
+static void batch_flush(out_batch *b) {
+    size_t i, n = 0;
+
+    for (i = 0; i < b->n; ++i) {
+        mfa_uring_file f = b->files[i];
+
+        if (batch_parents(b, f.path)) {
+            fprintf(stderr, "Failed writing %s\n", f.path);
+            free((char *)f.path);
+            b->rc = -1;
+            continue;
+        }
+        f.buf = b->arena + b->offs[i];
+        b->files[n++] = f;
+    }
+    if (n && mfa_uring_write(b->ring, b->files, n)) {
+        perror("io_uring");
+        b->rc = -1;
+    }
+    for (i = 0; i < n; ++i) {
+        if (b->files[i].err) {
+            fprintf(stderr, "%s: %s\n", b->files[i].path, strerror(b->files[i].err));
+            fprintf(stderr, "Failed writing %s\n", b->files[i].path);
+            b->rc = -1;
+        }
+        free((char *)b->files[i].path);
+    }
+    b->n = 0;
+    b->used = 0;
+}
+
+/* Queue entry e and return where its bytes go; batch_commit or
+   batch_drop it once they are filled in. */
+static uint8_t *batch_add(out_batch *b, const mfa_toc_entry *e) {
+    mfa_uring_file *f;
+    uint8_t *dst;
+    char *path;
+
+    if (b->n == IO_BATCH_FILES || b->used >= IO_BATCH_BYTES) batch_flush(b);
+
+    path = mfa_join_path(b->x->out_dir, entry_name(b->x->ar, e));
+    if (!path) { perror("malloc"); return NULL; }
+    dst = batch_reserve(b, (size_t)e->orig_size);
+    if (!dst) { free(path); return NULL; }
+
+    f = &b->files[b->n];
+    memset(f, 0, sizeof *f);
+    f->path = path;
+    f->len = (size_t)e->orig_size;
+    b->offs[b->n] = b->used;
+    return dst;
+}
+
+static void batch_commit(out_batch *b) {
+    b->used += b->files[b->n].len;
+    ++b->n;
+}
+
+static void batch_drop(out_batch *b) {
+    fprintf(stderr, "Failed writing %s\n", b->files[b->n].path);
+    free((char *)b->files[b->n].path);
+}
+
+/* member_fn: queue solid member i, already checked. */
+static int batch_member(const mfa_archive *a, size_t i, const uint8_t *p, void *arg) {
+    out_batch *b = (out_batch *)arg;
+    const mfa_toc_entry *e = &a->toc.ents[i];
+    uint8_t *dst = batch_add(b, e);
+
+    if (!dst) return -1;
+    memcpy(dst, p, (size_t)e->orig_size);
+    batch_commit(b);
+    return 0;
+}
+
+/* Decode small entry i into the batch, checking its checksum. */
+static int batch_entry(out_batch *b, size_t i) {
+    const mfa_archive *a = b->x->ar;
+    const mfa_toc_entry *e = &a->toc.ents[i];
+    size_t len = (size_t)e->orig_size;
+    uint8_t *dst = batch_add(b, e);
+    const uint8_t *want = NULL;
+    content_sum sum;
+    int checked, rc = 0;
+
+    if (!dst) return -1;
+    if (entry_has_blocks(e)) {
+        if (read_coded_range(a, e, 0, len, dst) < 0) rc = -1;
+    } else if (archive_read(a, dst, len, e->data_offset)) {
+        perror("read");
+        rc = -1;
+    }
+    if (rc == 0 && (checked = entry_sum(a, e, &sum, &want)) != 0) {
+        if (checked > 0) sum_update(&sum, dst, len);
+        if (checked < 0 || sum_check(a, e, &sum, want)) rc = -1;
+    }
+    if (rc) { batch_drop(b); return -1; }
+    batch_commit(b);
+    return 0;
+}
+
+/* Split the plan into ranges of about one batch of files each. */
+static int batch_ranges(extract_ctx *x) {
+    size_t u, files = 0;
+    uint64_t bytes = 0;
+
+    x->range = (size_t *)malloc((x->plan.n + 1) * sizeof *x->range);
+    if (!x->range) { perror("malloc"); return -1; }
+    x->nranges = 0;
+    for (u = 0; u < x->plan.n; ++u) {
+        size_t k;
+
+        if (u == 0 || files >= IO_BATCH_FILES || bytes >= IO_BATCH_BYTES) {
+            x->range[x->nranges++] = u;
+            files = 0;
+            bytes = 0;
+        }
+        for (k = x->plan.first[u]; k < x->plan.first[u + 1]; ++k) {
+            ++files;
+            bytes += x->ar->toc.ents[x->plan.order[k]].orig_size;
+        }
+    }
+    x->range[x->nranges] = x->plan.n;
+    return 0;
+}
+
+static int extract_range(size_t r, void *arg) {
+    const extract_ctx *x = (const extract_ctx *)arg;
+    out_batch *b = (out_batch *)calloc(1, sizeof *b);
+    size_t u;
+    int rc = 0;
+
+    if (b) {
+        b->x = x;
+        b->ring = mfa_uring_open(IO_BATCH_FILES);
+    }
+    for (u = x->range[r]; u < x->range[r + 1]; ++u) {
+        const size_t *idx = x->plan.order + x->plan.first[u];
+        size_t n = x->plan.first[u + 1] - x->plan.first[u];
+        const mfa_toc_entry *e = &x->ar->toc.ents[idx[0]];
+
+        if (!b || !b->ring) {           /* no ring here: plain calls */
+            if (extract_unit(u, arg)) rc = -1;
+        } else if (e->flags & ENTRY_SOLID) {
+            if (solid_unit(x->ar, idx, n, batch_member, b)) rc = -1;
+        } else if (e->orig_size <= IO_SMALL_ENTRY) {
+            if (batch_entry(b, idx[0])) rc = -1;
+        } else if (extract_entry(x, idx[0])) {
+            rc = -1;
+        }
+    }
+    if (b) {
+        if (b->ring) {
+            batch_flush(b);
+            mfa_uring_close(b->ring);
+        }
+        if (b->rc) rc = -1;
+        free(b->arena);
+        free(b->dir);
+        free(b);
+    }
+    return rc;
+}
+
+int mfa_extract_all(const char *archive_path, const char *out_dir) {
+    return mfa_extract_all_ex(archive_path, out_dir, NULL);
+}
+
+int mfa_extract_all_ex(const char *archive_path, const char *out_dir,
+                       const mfa_options *opt) {
+    mfa_archive ar;
+    mfa_options defaults;
+    extract_ctx x;
+    mfa_phase_mark mark;
+    mfa_uring *ring;
+    uint64_t toc_len, stored, orig;
+    unsigned jobs;
+    int batched, rc;
+
+    if (!opt) { mfa_options_init(&defaults); opt = &defaults; }
+    jobs = opt->jobs ? opt->jobs : mfa_cpu_count();
+
+    if (io_ring_open(opt, IO_BATCH_FILES, &ring)) return -1;
+    batched = ring != NULL;
+    mfa_uring_close(ring);      /* only a probe: each range opens its own */
+
+    mfa_phase_begin(opt->stats, &mark);
+    if (archive_open(archive_path, &ar, 1)) return -1;
+    toc_totals(&ar.toc, &toc_len, &stored, &orig);
+    mfa_phase_end(opt->stats, MFA_PHASE_TOC_READ, &mark, toc_len, toc_len);
+    if (archive_unlock(&ar, archive_path, opt->pass)) { archive_close(&ar); return -1; }
+
+    memset(&x, 0, sizeof x);
+    x.ar      = &ar;
+    x.out_dir = out_dir;
+    if (unit_plan_build(&ar.toc, &x.plan)) { archive_close(&ar); return -1; }
+    if (batched && batch_ranges(&x)) { unit_plan_free(&x.plan); archive_close(&ar); return -1; }
+    mfa_phase_begin(opt->stats, &mark);
+    if (batched)
+        rc = mfa_parallel_for(x.nranges, jobs, extract_range, &x);
+    else
+        rc = mfa_parallel_for(x.plan.n, jobs, extract_unit, &x);
+    mfa_phase_end(opt->stats, MFA_PHASE_COPY, &mark, stored, orig);
+    free(x.range);
+    unit_plan_free(&x.plan);
+
+    archive_close(&ar);
+    return rc;
+}
+
+/* ============================================================
+   Verify
+   ------------------------------------------------------------
+   Decodes every entry in parallel and compares checksums, but
+   writes nothing. Failures do not stop the sweep: each entry
+   records its own result and all of them are reported.
+   ============================================================ */
+
+typedef struct {
+    const mfa_archive *ar;
+    int               *bad;
+    unit_plan          plan;
+} verify_ctx;
+
+/* member_fn: solid member i decoded and matched its checksum. */
+static int verify_member(const mfa_archive *a, size_t i, const uint8_t *p, void *arg) {
+    const verify_ctx *x = (const verify_ctx *)arg;
+    (void)a; (void)p;
+    x->bad[i] = 0;
+    return 0;
+}
+
+static int verify_unit(size_t u, void *arg) {
+    const verify_ctx *x = (const verify_ctx *)arg;
+    const size_t *idx = x->plan.order + x->plan.first[u];
+    size_t k, n = x->plan.first[u + 1] - x->plan.first[u];
+
+    if (x->ar->toc.ents[idx[0]].flags & ENTRY_SOLID) {
+        for (k = 0; k < n; ++k) x->bad[idx[k]] = 1;
+        solid_unit(x->ar, idx, n, verify_member, (void *)x);
+    } else {
+        x->bad[idx[0]] = entry_stream(x->ar, &x->ar->toc.ents[idx[0]], -1) != 0;
+    }
+    return 0;
+}
+
+int mfa_verify(const char *archive_path, const mfa_options *opt) {
+    mfa_archive ar;
+    mfa_options defaults;
+    verify_ctx x;
+    mfa_phase_mark mark;
+    uint64_t toc_len, stored, orig;
+    size_t i, failed = 0, unchecked = 0;
+    int rc;
+
+    if (!opt) { mfa_options_init(&defaults); opt = &defaults; }
+    mfa_phase_begin(opt->stats, &mark);
+    if (archive_open(archive_path, &ar, 1)) return -1;
+    toc_totals(&ar.toc, &toc_len, &stored, &orig);
+    mfa_phase_end(opt->stats, MFA_PHASE_TOC_READ, &mark, toc_len, toc_len);
+    if (archive_unlock(&ar, archive_path, opt->pass)) { archive_close(&ar); return -1; }
+
+    x.ar  = &ar;
+    x.bad = (int *)calloc(ar.toc.n ? ar.toc.n : 1, sizeof *x.bad);
+    if (!x.bad) { perror("calloc"); archive_close(&ar); return -1; }
+    if (unit_plan_build(&ar.toc, &x.plan)) { free(x.bad); archive_close(&ar); return -1; }
+
+    /* Decoded but not written: bytes out stay 0 */
+    mfa_phase_begin(opt->stats, &mark);
+    rc = mfa_parallel_for(x.plan.n, opt->jobs ? opt->jobs : mfa_cpu_count(), verify_unit, &x);
+    mfa_phase_end(opt->stats, MFA_PHASE_COPY, &mark, stored, 0);
+    unit_plan_free(&x.plan);
+
+    for (i = 0; i < ar.toc.n; ++i) {
+        const uint8_t *want;
+        content_sum sum;
+        if (x.bad[i]) ++failed;
+        else if (entry_sum(&ar, &ar.toc.ents[i], &sum, &want) == 0) ++unchecked;
+    }
+    printf("%s: %zu entries, %zu failed, %zu without checksum\n",
+           archive_path, ar.toc.n, failed, unchecked);
+
+    free(x.bad);
+    archive_close(&ar);
+    return (rc || failed) ? -1 : 0;
+}
+
+/* ============================================================
+   Sequential extraction
+   ------------------------------------------------------------
+   A streamed archive can be read front to back, from a pipe or
+   a socket. Each local record says what its stream holds before
+   the bytes arrive, so entries are written out as their data
+   comes in, one block in memory at a time. A solid block is
+   small and checked before its members are written. Further
+   names of a duplicated stream are copied from the first once
+   it is complete. The TOC and footer at the end are read past.
+   ============================================================ */
+
+#define SEQ_NAME_MAX  (1u << 16)
+#define SEQ_COPY      (64u * 1024u)
+
+typedef struct {
+    FILE       *in;
+    const char *path;        /* for messages */
+    uint64_t    pos;         /* bytes consumed */
+    uint64_t    written;     /* bytes extracted */
+    uint8_t    *buf;         /* staging for payloads and copies */
+    size_t      cap;
+} seq_in;
+
+/* One name of a local record. */
+typedef struct {
+    char     *path;          /* under out_dir */
+    uint64_t  size;
+    uint32_t  off;           /* within the stream's original bytes */
+    uint8_t   sum[MFA_TAG_LEN]; /* stored checksum */
+} seq_name;
+
+static int seq_read(seq_in *s, void *buf, size_t n) {
+    if (n && mfa_read_exact(s->in, buf, n)) {
+        fprintf(stderr, "%s: truncated at byte %llu\n", s->path, (unsigned long long)s->pos);
+        return -1;
+    }
+    s->pos += n;
+    return 0;
+}
+
+/* s->buf with room for n bytes. */
+static uint8_t *seq_buf(seq_in *s, size_t n) {
+    if (n == 0) n = 1;
+    if (n > s->cap) {
+        uint8_t *nb = (uint8_t *)realloc(s->buf, n);
+        if (!nb) { perror("realloc"); return NULL; }
+        s->buf = nb;
+        s->cap = n;
+    }
+    return s->buf;
+}
+
+static void seq_names_free(seq_name *names, uint32_t n) {
+    uint32_t i;
+    for (i = 0; i < n && names; ++i) free(names[i].path);
+    free(names);
+}
+
+/* Read a record's name list; names must be safe and lie within the
+   stream's `length` original bytes. */
+static seq_name *seq_read_names(seq_in *s, uint32_t n, uint64_t length, const char *out_dir) {
+    seq_name *names = (seq_name *)calloc(n, sizeof *names);
+    char *name = NULL;
+    uint32_t i;
+
+    if (!names) { perror("calloc"); return NULL; }
+    for (i = 0; i < n; ++i) {
+        uint8_t b[12];
+        uint32_t len;
+
+        if (seq_read(s, b, 4)) goto fail;
+        len = mfa_ld32(b);
+        if (len == 0 || len > SEQ_NAME_MAX) {
+            fprintf(stderr, "%s: bad local record\n", s->path);
+            goto fail;
+        }
+        name = (char *)malloc(len + 1);
+        if (!name) { perror("malloc"); goto fail; }
+        if (seq_read(s, name, len) || seq_read(s, b, 12)) goto fail;
+        name[len] = '\0';
+        if (strlen(name) != len || mfa_sanitize(name) != 0) {
+            fprintf(stderr, "%s: unsafe entry name '%s'\n", s->path, name);
+            goto fail;
+        }
+        names[i].size = mfa_ld64(b);
+        names[i].off  = mfa_ld32(b + 8);
+        if (names[i].off > length || names[i].size > length - names[i].off) {
+            fprintf(stderr, "%s: %s: bad offset or size\n", s->path, name);
+            goto fail;
+        }
+        names[i].path = mfa_join_path(out_dir, name);
+        if (!names[i].path) { perror("malloc"); goto fail; }
+        free(name);
+        name = NULL;
+    }
+    return names;
+
+fail:
+    free(name);
+    seq_names_free(names, n);
+    return NULL;
+}
+
+/* Create the file for nm, with its parent directories. */
+static int seq_open(const seq_name *nm) {
+    if (mfa_make_parents(nm->path) != 0) { perror(nm->path); return -1; }
+    return open_out(nm->path);
+}
+
+/* Copy the extracted file `from` to nm, for duplicates. */
+static int seq_copy(seq_in *s, const char *from, const seq_name *nm) {
+    uint8_t *buf = seq_buf(s, SEQ_COPY);
+    int in, out, rc = 0;
+    ssize_t got;
+
+    if (!buf) return -1;
+    in = open(from, O_RDONLY);
+    if (in < 0) { perror(from); return -1; }
+    out = seq_open(nm);
+    if (out < 0) { close(in); return -1; }
+    while ((got = read(in, buf, SEQ_COPY)) != 0) {
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            perror(from);
+            rc = -1;
+            break;
+        }
+        if (mfa_write_fd_exact(out, buf, (size_t)got)) { perror(nm->path); rc = -1; break; }
+    }
+    close(in);
+    if (close(out) != 0 && rc == 0) { perror(nm->path); rc = -1; }
+    return rc;
+}
+
+/* Compare nm's stored checksum with got, sum_len(keyed) bytes. */
+static int seq_sum_check(const seq_in *s, const seq_name *nm, const uint8_t *got, int keyed) {
+    if (sum_equal(got, nm->sum, sum_len(keyed))) return 0;
+    if (keyed)
+        fprintf(stderr, "%s: %s: authentication failed\n", s->path, nm->path);
+    else
+        fprintf(stderr, "%s: %s: checksum mismatch (stored %08lx, computed %08lx)\n",
+                s->path, nm->path, (unsigned long)mfa_ld32(nm->sum), (unsigned long)mfa_ld32(got));
+    return -1;
+}
+
+/* Data of a clear stored stream: copied through to out (skipped if
+   out < 0) in SEQ_COPY pieces. */
+static int seq_copy_data(seq_in *s, uint64_t length, int out, content_sum *sum) {
+    uint8_t *buf = seq_buf(s, SEQ_COPY);
+
+    if (!buf) return -1;
+    while (length) {
+        size_t n = length < SEQ_COPY ? (size_t)length : SEQ_COPY;
+        if (seq_read(s, buf, n)) return -1;
+        sum_update(sum, buf, n);
+        if (out >= 0 && mfa_write_fd_exact(out, buf, n)) { perror("write"); return -1; }
+        length -= n;
+    }
+    return 0;
+}
+
+/* Read framed block k of r into *plain. */
+static int seq_block(seq_in *s, block_reader *r, size_t k, const uint8_t **plain, size_t *rlen) {
+    uint8_t w[BLOCK_FRAME];
+    uint32_t word;
+    size_t plen;
+    uint8_t *payload;
+
+    *rlen = block_plain_len(r, k);
+    if (seq_read(s, w, BLOCK_FRAME)) return -1;
+    word = mfa_ld32(w);
+    plen = (size_t)(word & ~BLOCK_RAW);
+    if (plen > *rlen) return -1;     /* a block is stored raw before it grows */
+    payload = seq_buf(s, plen);
+    if (!payload || seq_read(s, payload, plen)) return -1;
+    return block_decode(r, k, word, payload, *rlen, plain);
+}
+
+/* One local record, from after its magic to its checksums. Returns
+   -1 if the archive cannot be followed any further, 1 if only an
+   entry failed. */
+static int seq_record(seq_in *s, const mfa_archive *ar, const char *out_dir) {
+    uint8_t b[LOCAL_FIXED], got[MFA_TAG_LEN];
+    uint32_t flags, nn, i;
+    uint64_t length;
+    content_sum sum;
+    int keyed;
+    seq_name *names;
+    block_reader r;
+    const uint8_t *plain = NULL;
+    int out = -1, rc = -1;
+
+    if (seq_read(s, b + 4, LOCAL_FIXED - 4)) return -1;
+    flags  = mfa_ld32(b + 4);
+    length = mfa_ld64(b + 12);
+    nn     = mfa_ld32(b + 28);
+
+    memset(&r, 0, sizeof r);
+    r.a     = ar;
+    r.span  = length;
+    r.frame = BLOCK_FRAME;
+    r.log2  = b[10];
+    if (flags & ENTRY_SOLID) {
+        r.log2 = 0;
+        while (((uint64_t)1 << r.log2) < length) ++r.log2;
+    }
+    keyed = (flags & MFA_ENCRYPT) != 0;
+    if (nn == 0 || r.log2 > BLOCK_LOG2_MAX ||
+        ((flags & (MFA_COMPRESS | MFA_ENCRYPT)) && !(flags & ENTRY_FRAMED)) ||
+        (ar->encrypted && length && !keyed) ||
+        ((flags & ENTRY_SOLID) && (!length || length > SOLID_BLOCK || !(flags & ENTRY_FRAMED)))) {
+        fprintf(stderr, "%s: bad local record\n", s->path);
+        return -1;
+    }
+    if (flags & ENTRY_FRAMED) {
+        r.codec = mfa_codec_get(mfa_ld16(b + 8));
+        if (!r.codec) {
+            fprintf(stderr, "%s: unknown codec %u\n", s->path, (unsigned)mfa_ld16(b + 8));
+            return -1;
+        }
+    }
+    if (flags & MFA_ENCRYPT) {
+        if (!ar->keyed) {
+            fprintf(stderr, "%s: encrypted, passphrase required\n", s->path);
+            return -1;
+        }
+        r.nonce = b + 20;
+    }
+    if (keyed) sum_init(&sum, ar->key, r.nonce, 0);
+    else       sum_init(&sum, NULL, NULL, 0);
+    if (flags & ENTRY_DICT) {
+        r.dict = ar->dict;
+        if (!r.dict || !r.codec || !r.codec->decode_dict) {
+            fprintf(stderr, "%s: dictionary missing\n", s->path);
+            return -1;
+        }
+    }
+    if (flags & ENTRY_DELTA) {
+        r.stride = ENTRY_STRIDE(flags);
+        if (!r.stride || !(flags & ENTRY_FRAMED)) {
+            fprintf(stderr, "%s: bad local record\n", s->path);
+            return -1;
+        }
+    }
+
+    names = seq_read_names(s, nn, length, out_dir);
+    if (!names) return -1;
+    if (!(flags & ENTRY_SOLID)) {
+        for (i = 0; i < nn; ++i) {
+            if (names[i].off != 0 || names[i].size != length) {
+                fprintf(stderr, "%s: %s: bad offset or size\n", s->path, names[i].path);
+                goto out;
+            }
+        }
+    }
+
+    if (flags & ENTRY_SOLID) {
+        /* One block: decoded whole, members written once checked */
+        size_t rlen;
+        if (seq_block(s, &r, 0, &plain, &rlen)) goto bad_data;
+    } else {
+        out = seq_open(&names[0]);
+        if (out < 0) goto drain;
+        if (!(flags & ENTRY_FRAMED)) {
+            if (seq_copy_data(s, length, out, &sum)) goto out;
+        } else {
+            size_t k, nb = entry_blocks(length, 1, r.log2);
+            for (k = 0; k < nb; ++k) {
+                size_t rlen;
+                if (seq_block(s, &r, k, &plain, &rlen)) goto bad_data;
+                sum_update(&sum, plain, rlen);
+                if (mfa_write_fd_exact(out, plain, rlen)) { perror(names[0].path); goto out; }
+            }
+        }
+        if (close(out) != 0) { out = -1; perror(names[0].path); goto out; }
+        out = -1;
+    }
+
+    for (i = 0; i < nn; ++i)
+        if (seq_read(s, names[i].sum, sum_len(keyed))) goto out;
+    if (!(flags & ENTRY_SOLID)) sum_final(&sum, got);
+
+    rc = 0;
+    for (i = 0; i < nn; ++i) {
+        const seq_name *nm = &names[i];
+        if (flags & ENTRY_SOLID) {
+            /* The block may sit in s->buf, so nothing is read here */
+            const uint8_t *p = plain + nm->off;
+            int fd;
+            if (keyed) sum_init(&sum, ar->key, r.nonce, nm->off);
+            else       sum_init(&sum, NULL, NULL, 0);
+            sum_update(&sum, p, (size_t)nm->size);
+            sum_final(&sum, got);
+            if (seq_sum_check(s, nm, got, keyed)) { rc = 1; continue; }
+            fd = seq_open(nm);
+            if (fd < 0) { rc = 1; continue; }
+            if (mfa_write_fd_exact(fd, p, (size_t)nm->size)) { perror(nm->path); rc = 1; }
+            if (close(fd) != 0) { perror(nm->path); rc = 1; }
+        } else if (seq_sum_check(s, nm, got, keyed)) {
+            rc = 1;
+            break;
+        } else if (i > 0 && seq_copy(s, names[0].path, nm)) {
+            rc = 1;
+        }
+        if (rc == 0) s->written += nm->size;
+    }
+    goto out;
+
+drain:
+    /* The first output could not be created: skip the data, keep going */
+    if (!(flags & ENTRY_FRAMED)) {
+        if (seq_copy_data(s, length, -1, &sum) == 0) rc = 1;
+    } else {
+        size_t k, rlen, nb = entry_blocks(length, 1, r.log2);
+        for (k = 0; k < nb; ++k)
+            if (seq_block(s, &r, k, &plain, &rlen)) goto bad_data;
+        rc = 1;
+    }
+    if (rc == 1) {
+        for (i = 0; i < nn && rc == 1; ++i)
+            if (seq_read(s, names[i].sum, sum_len(keyed))) rc = -1;
+    }
+    goto out;
+
+bad_data:
+    fprintf(stderr, "%s: %s: decompression failed\n", s->path, names[0].path);
+out:
+    if (out >= 0) close(out);
+    block_reader_free(&r);
+    seq_names_free(names, nn);
+    return rc;
+}
+
+int mfa_extract_stream(const char *archive_path, const char *out_dir,
+                       const mfa_options *opt) {
+    mfa_archive ar;
+    mfa_options defaults;
+    mfa_phase_mark mark;
+    seq_in s;
+    uint8_t hb[HDR_SIZE];
+    uint8_t tag[4];
+    int rc = -1, failed = 0;
+
+    if (!archive_path) return -1;
+    if (!opt) { mfa_options_init(&defaults); opt = &defaults; }
+    memset(&ar, 0, sizeof ar);
+    memset(&s, 0, sizeof s);
+    s.in = strcmp(archive_path, "-") == 0 ? stdin : fopen(archive_path, "rb");
+    s.path = s.in == stdin ? "stdin" : archive_path;
+    if (!s.in) { perror(archive_path); return -1; }
+
+    /* ---- Header and the extension area right behind it ---- */
+    mfa_phase_begin(opt->stats, &mark);
+    if (seq_read(&s, hb, HDR_SIZE)) goto out;
+    if (hdr_parse(hb, &ar.hdr) != 0) {
+        fprintf(stderr, "%s: not a valid archive\n", s.path);
+        goto out;
+    }
+    if (!(ar.hdr.gflags & GF_STREAMED)) {
+        fprintf(stderr, "%s: not a streamed archive; extract it from a file\n", s.path);
+        goto out;
+    }
+    if (ar.hdr.ext_len) {
+        uint8_t *ext;
+        if (ar.hdr.ext_off != HDR_SIZE || ar.hdr.ext_len > EXT_AREA_MAX) {
+            fprintf(stderr, "%s: not a valid archive\n", s.path);
+            goto out;
+        }
+        ext = seq_buf(&s, ar.hdr.ext_len);
+        if (!ext || seq_read(&s, ext, ar.hdr.ext_len)) goto out;
+        if (ext_parse(&ar, ext, ar.hdr.ext_len) != 0) {
+            fprintf(stderr, "%s: not a valid archive\n", s.path);
+            goto out;
+        }
+    }
+    if (ar.hdr.data_off != s.pos) {
+        fprintf(stderr, "%s: not a valid archive\n", s.path);
+        goto out;
+    }
+    mfa_phase_end(opt->stats, MFA_PHASE_TOC_READ, &mark, s.pos, s.pos);
+    if (archive_unlock(&ar, s.path, opt->pass)) goto out;
+
+    /* ---- Local records, up to the end tag ---- */
+    mfa_phase_begin(opt->stats, &mark);
+    for (;;) {
+        int r;
+        if (seq_read(&s, tag, 4)) goto out;
+        if (memcmp(tag, LOCAL_END, 4) == 0) break;
+        if (memcmp(tag, LOCAL_MAGIC, 4) != 0) {
+            fprintf(stderr, "%s: bad local record at byte %llu\n", s.path,
+                    (unsigned long long)(s.pos - 4));
+            goto out;
+        }
+        r = seq_record(&s, &ar, out_dir);
+        if (r < 0) goto out;
+        if (r > 0) failed = 1;
+    }
+
+    /* The TOC and footer: read to the end so a writer on the other
+       side of a pipe finishes cleanly. */
+    {
+        uint8_t *buf = seq_buf(&s, SEQ_COPY);
+        size_t got;
+        if (!buf) goto out;
+        while ((got = fread(buf, 1, SEQ_COPY, s.in)) > 0) s.pos += got;
+        if (ferror(s.in)) { perror(s.path); goto out; }
+    }
+    mfa_phase_end(opt->stats, MFA_PHASE_COPY, &mark, s.pos - ar.hdr.data_off, s.written);
+    rc = failed ? -1 : 0;
+
+out:
+    archive_close(&ar);
+    if (s.in != stdin) fclose(s.in);
+    free(s.buf);
+    return rc;
+}
+
+/* ============================================================
+   Single-entry extraction
+   ------------------------------------------------------------
+   With a name index the lookup touches one or two index slots
+   and one TOC record, independent of the entry count. Archives
+   without an index fall back to scanning the TOC.
+   ============================================================ */
+
+/* Load the TOC record at off into t, as its only entry, if its
+   stored name is `name`. Returns 1 on match, 0 on mismatch, -1 on
+   a corrupt record. */
+static int entry_at_matches(const mfa_archive *a, uint64_t off, const char *name,
+                            size_t name_len, mfa_toc *t) {
+    uint8_t small[4];
+    uint8_t *rec;
+    uint64_t rec_len;
+    uint16_t meta_len;
+    int rc;
+
+    if (archive_read(a, small, 4, off)) return -1;
+    if (mfa_ld32(small) != name_len) return 0;
+
+    /* Name and fixed fields first; meta length is only known after. */
+    rec_len = (uint64_t)TOC_FIXED + name_len;
+    rec = (uint8_t *)malloc((size_t)rec_len);
+    if (!rec) return -1;
+    if (archive_read(a, rec, (size_t)rec_len, off)) { free(rec); return -1; }
+    if (memcmp(rec + 4, name, name_len) != 0) { free(rec); return 0; }
+
+    meta_len = mfa_ld16(rec + rec_len - 2);
+    if (meta_len) {
+        uint8_t *nb = (uint8_t *)realloc(rec, (size_t)rec_len + meta_len);
+        if (!nb) { free(rec); return -1; }
+        rec = nb;
+        if (archive_read(a, rec + rec_len, meta_len, off + rec_len)) { free(rec); return -1; }
+        rec_len += meta_len;
+    }
+
+    rc = -1;
+    if (toc_init(t, 1, (size_t)rec_len) == 0) {
+        if (toc_add(t, rec, rec_len)) rc = 1;
+        else toc_free(t);
+    }
+    free(rec);
+    return rc;
+}
+
+static int index_lookup(const mfa_archive *a, const char *name, mfa_toc *t) {
+    size_t len = strlen(name);
+    uint64_t h = name_hash(name, len);
+    uint32_t mask = a->index_slots - 1;
+    uint32_t k = (uint32_t)h & mask;
+    uint32_t probes;
+
+    for (probes = 0; probes < a->index_slots; ++probes, k = (k + 1) & mask) {
+        uint8_t slot[INDEX_SLOT];
+        uint64_t sh;
+        int rc;
+
+        if (archive_read(a, slot, INDEX_SLOT, a->index_off + (uint64_t)k * INDEX_SLOT)) return -1;
+        sh = mfa_ld64(slot);
+        if (sh == 0) return 0;
+        if (sh != h) continue;
+
+        rc = entry_at_matches(a, mfa_ld64(slot + 8), name, len, t);
+        if (rc != 0) return rc;
+    }
+    return 0;
+}
+
+/* Find the entry stored as `name` in an archive opened without its
+   TOC, through the name index unless archive_auth has read it
+   since. On success *e points into ar->toc, which then holds either
+   the whole TOC or just that entry; returns -1 if it is missing or
+   corrupt, both cases reported. */
+static int entry_find(mfa_archive *ar, const char *archive_path,
+                      const char *name, const mfa_toc_entry **e) {
+    int found = 0;
+
+    if (ar->index_slots && !ar->toc.ents) {
+        found = index_lookup(ar, name, &ar->toc);
+        if (found == 1) *e = &ar->toc.ents[0];
+    } else {
+        /* No index: scan the TOC, comparing sanitized names. */
+        char *want = (char *)malloc(strlen(name) + 1);
+        size_t i;
+        if (!want) { perror("malloc"); return -1; }
+        strcpy(want, name);
+
+        /* A name that is not a safe path cannot be in the TOC */
+        found = mfa_sanitize(want) ? 0 : archive_load_toc(ar) ? -1 : 0;
+
+        for (i = 0; found == 0 && i < ar->toc.n; ++i) {
+            if (strcmp(toc_name(&ar->toc, &ar->toc.ents[i]), want) == 0) {
+                *e = &ar->toc.ents[i];
+                found = 1;
+            }
+        }
+        free(want);
+    }
+
+    if (found < 0) {
+        fprintf(stderr, "%s: corrupt archive\n", archive_path);
+        return -1;
+    }
+    if (found == 0) {
+        fprintf(stderr, "%s: no entry named '%s'\n", archive_path, name);
+        return -1;
+    }
+    return entry_check(ar, *e);
+}
+
+int mfa_extract_one(const char *archive_path, const char *name, const char *out_path) {
+    return mfa_extract_one_ex(archive_path, name, out_path, NULL);
+}
+
+int mfa_extract_one_ex(const char *archive_path, const char *name, const char *out_path,
+                       const mfa_options *opt) {
+    mfa_archive ar;
+    const mfa_toc_entry *e;
+    mfa_stats *stats = opt ? opt->stats : NULL;
+    mfa_phase_mark mark;
+    uint64_t toc_len, stored, orig;
+    char *owned = NULL;
+    int rc;
+
+    if (!archive_path || !name || !*name) return -1;
+    if (archive_open(archive_path, &ar, 0)) return -1;
+    if (archive_unlock(&ar, archive_path, opt ? opt->pass : NULL)) { archive_close(&ar); return -1; }
+
+    mfa_phase_begin(stats, &mark);
+    if (entry_find(&ar, archive_path, name, &e)) {
+        archive_close(&ar);
+        return -1;
+    }
+    /* ar.toc holds the whole TOC, or just e if the index found it */
+    toc_totals(&ar.toc, &toc_len, &stored, &orig);
+    mfa_phase_end(stats, MFA_PHASE_TOC_READ, &mark, toc_len, toc_len);
+
+    if (!out_path || !*out_path) out_path = owned = mfa_join_path(NULL, entry_name(&ar, e));
+    if (!out_path) { perror("malloc"); archive_close(&ar); return -1; }
+
+    mfa_phase_begin(stats, &mark);
+    rc = extract_to(&ar, e, out_path);
+    mfa_phase_end(stats, MFA_PHASE_COPY, &mark, e->stored_size, e->orig_size);
+
+    free(owned);
+    archive_close(&ar);
+    return rc;
+}
+
+/* ============================================================
+   Byte-range reads
+   ------------------------------------------------------------
+   Stored entries are read in place. Coded entries decode only
+   the blocks overlapping the range; the first block's offset
+   comes from summing the block table before it.
+   ============================================================ */
+
+long long mfa_read_range(const char *archive_path, const char *name,
+                         uint64_t offset, size_t len, void *buf) {
+    return mfa_read_range_ex(archive_path, name, offset, len, buf, NULL);
+}
+
+long long mfa_read_range_ex(const char *archive_path, const char *name,
+                            uint64_t offset, size_t len, void *buf,
+                            const mfa_options *opt) {
+    mfa_archive ar;
+    const mfa_toc_entry *e;
+    long long rc;
+
+    if (!archive_path || !name || !*name || (!buf && len)) return -1;
+    if (archive_open(archive_path, &ar, 0)) return -1;
+
+    if (archive_unlock(&ar, archive_path, opt ? opt->pass : NULL) ||
+        entry_find(&ar, archive_path, name, &e)) {
+        archive_close(&ar);
+        return -1;
+    }
+
+    if (offset >= e->orig_size) {
+        rc = 0;
+    } else {
+        if (len > e->orig_size - offset) len = (size_t)(e->orig_size - offset);
+        if (entry_has_blocks(e)) {
+            rc = read_coded_range(&ar, e, offset, len, (uint8_t *)buf);
+        } else if (e->stored_size < e->orig_size ||
+                   archive_read(&ar, buf, len, e->data_offset + offset) != 0) {
+            fprintf(stderr, "%s: entry '%s' is truncated\n", archive_path, name);
+            rc = -1;
+        } else {
+            rc = (long long)len;
+        }
+    }
+
+    archive_close(&ar);
+    return rc;
+}
+
+/* ============================================================
+   Append
+   ------------------------------------------------------------
+   New entry data goes after everything already in the file,
+   followed by a complete new TOC (the old records copied
+   verbatim, then the new ones), name index and extension area.
+   Nothing the current header points at is overwritten, so
+   until the header is patched at the very end the archive
+   still reads as before; on failure the file is cut back to
+   its old size. The superseded TOC stays behind as dead space.
+   ============================================================ */
+
+/* Offset of each of the count records in toc[] and its name hash;
+   the records have already been bounds-checked by toc_fetch. */
+static void toc_walk(const uint8_t *toc, uint32_t count, uint64_t *rec_off, uint64_t *hashes) {
+    uint64_t pos = 0;
+    uint32_t i;
+    for (i = 0; i < count; ++i) {
+        mfa_toc_entry e;
+        const uint8_t *raw;
+        uint32_t name_len;
+        size_t used = entry_parse(toc + pos, (uint64_t)-1, &e, &raw, &name_len);
+        rec_off[i] = pos;
+        hashes[i]  = name_hash((const char *)raw, name_len);
+        pos += used;
+    }
+}
+
+typedef struct {
+    uint64_t hash;
+    size_t   i;
+} name_ref;
+
+static int name_ref_cmp(const void *a, const void *b) {
+    const name_ref *x = (const name_ref *)a, *y = (const name_ref *)b;
+    if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+    return 0;
+}
+
+/* Fail if any new entry's name is already stored in toc[]. */
+static int check_new_names(const char *archive_path, const pack_job *j,
+                           const uint64_t *new_hashes, const uint8_t *toc,
+                           const uint64_t *rec_off, const uint64_t *hashes, size_t old_n) {
+    name_ref *refs;
+    size_t i;
+    int rc = 0;
+
+    refs = (name_ref *)malloc((old_n ? old_n : 1) * sizeof *refs);
+    if (!refs) { perror("malloc"); return -1; }
+    for (i = 0; i < old_n; ++i) { refs[i].hash = hashes[i]; refs[i].i = i; }
+    qsort(refs, old_n, sizeof *refs, name_ref_cmp);
+
+    for (i = 0; i < j->n && rc == 0; ++i) {
+        const char *name = pack_name(j->files[i]);
+        size_t len = strlen(name);
+        name_ref key, *hit;
+
+        key.hash = new_hashes[i];
+        hit = (name_ref *)bsearch(&key, refs, old_n, sizeof *refs, name_ref_cmp);
+        if (!hit) continue;
+        while (hit > refs && hit[-1].hash == key.hash) --hit;
+        for (; hit < refs + old_n && hit->hash == key.hash; ++hit) {
+            const uint8_t *r = toc + rec_off[hit->i];
+            if (mfa_ld32(r) == len && memcmp(r + 4, name, len) == 0) {
+                fprintf(stderr, "%s: entry '%s' already exists\n", archive_path, name);
+                rc = -1;
+                break;
+            }
+        }
+    }
+    free(refs);
+    return rc;
+}
+
+int mfa_append(const char *archive_path, mfa_file_table *files,
+               const char *pass, unsigned flags,
+               const mfa_options *opt)
+{
+    const unsigned ALIGN = 16;
+    mfa_archive ar;
+    pack_job job;
+    mfa_options defaults;
+    mfa_header h;
+    FILE *f = NULL;
+    uint8_t  *toc = NULL;          /* old records, then the new ones */
+    uint64_t  toc_len = 0, new_len = 0;
+    uint64_t *entry_pos = NULL;
+    uint64_t *hashes = NULL;
+    uint64_t *new_hashes = NULL;
+    uint8_t  *ext = NULL;
+    uint8_t  *old_ext = NULL;
+    uint8_t   mac[EXT_TOCMAC_REC];
+    size_t    mac_len = 0;
+    uint8_t   hb[HDR_SIZE];
+    size_t    old_n, n, i;
+    uint64_t  old_size, cursor, pos;
+    int       started = 0;         /* file may hold new bytes */
+    mfa_phase_mark mark;
+    long long c;
+
+    memset(&job, 0, sizeof job);
+    if (!archive_path || !files || files->count == 0) return -1;
+    if (!opt) { mfa_options_init(&defaults); opt = &defaults; }
+
+    if (archive_open(archive_path, &ar, 0)) return -1;
+    if (!ar.size) {
+        fprintf(stderr, "%s: can only append to a regular file\n", archive_path);
+        archive_close(&ar);
+        return -1;
+    }
+    h = ar.hdr;
+    old_n = h.count;
+    n = files->count;
+    old_size = ar.size;
+    if ((uint64_t)old_n + n > 0xFFFFFFFFu) {
+        fprintf(stderr, "%s: too many entries\n", archive_path);
+        archive_close(&ar);
+        return -1;
+    }
+
+    /* New entries are encrypted exactly when the archive is, with
+       its key; nonces are fresh per entry. */
+    if ((flags & MFA_ENCRYPT) && !ar.encrypted) {
+        fprintf(stderr, "%s: archive is not encrypted\n", archive_path);
+        archive_close(&ar);
+        return -1;
+    }
+    if (archive_unlock(&ar, archive_path, pass)) { archive_close(&ar); return -1; }
+    if (ar.encrypted && !ar.keyed) {
+        fprintf(stderr, "%s: appending to an encrypted archive needs its passphrase\n", archive_path);
+        archive_close(&ar);
+        return -1;
+    }
+
+    entry_pos = (uint64_t *)malloc((old_n + n) * sizeof *entry_pos);
+    hashes    = (uint64_t *)malloc((old_n + n) * sizeof *hashes);
+    ext       = (uint8_t *)malloc(EXT_INDEX_REC + EXT_CRYPT_REC + h.ext_len);
+    if (!entry_pos || !hashes || !ext) { perror("malloc"); goto fail; }
+
+    mfa_phase_begin(opt->stats, &mark);
+    if (toc_fetch(&ar, &toc, &toc_len)) {
+        fprintf(stderr, "%s: not a valid archive\n", archive_path);
+        goto fail;
+    }
+    toc_walk(toc, h.count, entry_pos, hashes);
+    mfa_phase_end(opt->stats, MFA_PHASE_TOC_READ, &mark, toc_len, toc_len);
+    if (h.ext_len) {
+        old_ext = (uint8_t *)malloc(h.ext_len);
+        if (!old_ext) { perror("malloc"); goto fail; }
+        if (archive_read(&ar, old_ext, h.ext_len, h.ext_off)) {
+            fprintf(stderr, "%s: not a valid archive\n", archive_path);
+            goto fail;
+        }
+    }
+
+    if (job_start(&job, files, flags & MFA_COMPRESS, ar.keyed ? ar.key : NULL, ar.dict, opt)) goto fail;
+    new_hashes = job_name_hashes(&job);
+    if (!new_hashes) goto fail;
+    if (check_new_names(archive_path, &job, new_hashes, toc, entry_pos, hashes, old_n)) goto fail;
+
+    for (i = 0; i < n; ++i) new_len += job_record_len(&job, i);
+    {
+        uint8_t *grown = (uint8_t *)realloc(toc, (size_t)(toc_len + new_len));
+        if (!grown) { perror("realloc"); goto fail; }
+        toc = grown;
+    }
+
+    f = fopen(archive_path, "r+b");
+    if (!f) { perror(archive_path); goto fail; }
+    if (fseeko(f, (off_t)old_size, SEEK_SET) != 0) goto io_err;
+    started = 1;
+
+    /* ---- New data ---- */
+    c = mfa_pad_to(f, old_size, ALIGN);
+    if (c < 0) goto io_err;
+    cursor = (uint64_t)c;
+    if (job_stream(&job, f, &cursor, ALIGN)) goto fail;
+
+    /* ---- TOC: old records as they were, then the new ones ---- */
+    mfa_phase_begin(opt->stats, &mark);
+    h.toc_off = cursor;
+    for (i = 0; i < old_n; ++i) entry_pos[i] += h.toc_off;
+    for (i = 0; i < n; ++i) hashes[old_n + i] = new_hashes[i];
+    job_encode_toc(&job, toc + toc_len, h.toc_off + toc_len, entry_pos + old_n);
+    if (mfa_write_exact(f, toc, (size_t)(toc_len + new_len))) goto io_err;
+    pos = h.toc_off + toc_len + new_len;
+
+    /* ---- Name index + extension area ---- */
+    h.ext_len = 0;
+    if (opt->name_index) {
+        uint32_t nslots = index_slots_for(old_n + n);
+        if (write_name_index(f, hashes, old_n + n, entry_pos, nslots)) goto io_err;
+        h.ext_len += (uint32_t)ext_index_rec(ext, pos, nslots);
+        pos += (uint64_t)nslots * INDEX_SLOT;
+    }
+    if (ar.encrypted)
+        h.ext_len += (uint32_t)ext_crypt_rec(ext + h.ext_len, ar.kdf_iterations, ar.salt, ar.check);
+    /* Records this code does not write itself are kept as they were. */
+    {
+        uint32_t p = 0;
+        while (ar.hdr.ext_len - p >= EXT_REC_HDR) {
+            uint16_t tag = mfa_ld16(old_ext + p);
+            uint32_t len = mfa_ld32(old_ext + p + 4);
+            if (ar.hdr.ext_len - p - EXT_REC_HDR < len) break;
+            if (tag != EXT_INDEX && tag != EXT_CRYPT && tag != EXT_TOCMAC) {
+                memcpy(ext + h.ext_len, old_ext + p, EXT_REC_HDR + len);
+                h.ext_len += EXT_REC_HDR + len;
+            }
+            p += EXT_REC_HDR + len;
+        }
+    }
+    if (ar.encrypted &&
+        !(mac_len = ext_tocmac_rec(mac, ar.key, (uint32_t)(old_n + n), toc, toc_len + new_len,
+                                   ext, h.ext_len, job.dict_rec, job.dict_rec_len))) goto fail;
+    h.ext_off = h.ext_len || job.dict_rec_len ? pos : 0;
+    if (mfa_write_exact(f, ext, h.ext_len) ||
+        (job.dict_rec_len && mfa_write_exact(f, job.dict_rec, job.dict_rec_len)) ||
+        mfa_write_exact(f, mac, mac_len)) goto io_err;
+    h.ext_len += (uint32_t)(job.dict_rec_len + mac_len);
+    pos += h.ext_len;
+
+    /* Everything the new header points at must be on disk before
+       the header does. */
+    if (fflush(f) != 0 || fsync(fileno(f)) != 0) goto io_err;
+
+    /* ---- Header: count, toc_off, arch_sz, ext_off/len ---- */
+    h.count   = (uint32_t)(old_n + n);
+    h.arch_sz = pos;
+    h.gflags &= ~GF_STREAMED;   /* a streamed archive's footer is now dead space */
+    if (job_version(&job) > h.version) h.version = job_version(&job);
+    hdr_encode(hb, &h);
+    if (fseeko(f, 0, SEEK_SET) != 0) goto io_err;
+    if (mfa_write_exact(f, hb, HDR_SIZE)) goto io_err;
+    started = 0;
+    if (fflush(f) != 0 || fsync(fileno(f)) != 0) goto io_err;
+    mfa_phase_end(opt->stats, MFA_PHASE_TOC_WRITE, &mark, 0, pos - h.toc_off + HDR_SIZE);
+
+    job_free(&job);
+    archive_close(&ar);
+    free(old_ext);
+    free(ext);
+    free(new_hashes);
+    free(hashes);
+    free(entry_pos);
+    free(toc);
+    if (fclose(f) != 0) { perror("fclose"); return -1; }
+    return 0;
+
+io_err:
+    perror("I/O");
+fail:
+    if (f) {
+        /* Drop whatever was appended; the header still describes
+           the old contents. */
+        if (started && (fflush(f) != 0 || ftruncate(fileno(f), (off_t)old_size) != 0))
+            perror(archive_path);
+        fclose(f);
+    }
+    job_free(&job);
+    archive_close(&ar);
+    free(old_ext);
+    free(ext);
+    free(new_hashes);
+    free(hashes);
+    free(entry_pos);
+    free(toc);
+    return -1;
+}
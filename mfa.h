@@ -1,8 +1,9 @@
 #ifndef MFA_H
 #define MFA_H
 
-#include "linked_list.h"
 #include "mfa_util.h"
+#include "mfa_codec.h"
+#include "mfa_stats.h"
 #include <stddef.h>   /* size_t */
 #include <stdint.h>   /* uint8_t */
 
@@ -13,30 +14,125 @@ extern "C" {
 
 /* ---------------- Transform flags ---------------- */
 enum {
-    MFA_COMPRESS = 1u << 0,  /* (placeholder; no-op until you implement) */
-    MFA_ENCRYPT  = 1u << 1   /* simple XOR demo */
+    MFA_COMPRESS = 1u << 0,  /* code entries with mfa_options.codec */
+    MFA_ENCRYPT  = 1u << 1   /* ChaCha20, key derived from the passphrase */
 };
 
+/* ---------------- File I/O backends ---------------- */
+enum {
+    MFA_IO_AUTO,   /* io_uring batches for small files where available */
+    MFA_IO_STDIO,  /* plain blocking calls, one file at a time */
+    MFA_IO_URING   /* io_uring batches, failing where unavailable */
+};
+
+/* ---------------- Options ---------------- */
+typedef struct {
+    size_t   max_memory;  /* cap on in-flight pack buffers, in bytes */
+    uint16_t codec;       /* MFA_ALG_* used when packing with MFA_COMPRESS,
+                             or MFA_CODEC_AUTO (default): one per entry */
+    unsigned jobs;        /* pack/extract threads; 0 = one per CPU */
+    int      name_index;  /* write a hashed name index for mfa_extract_one */
+    int      dedup;       /* store identical entries once */
+    uint64_t solid;       /* with a codec or encryption, entries of up to
+                             this many bytes share coded blocks; 0 = off */
+    uint64_t dict;        /* with LZ or auto, train a dictionary of up to
+                             this many bytes from the small entries, store
+                             it once and code every entry with it; 0 = off
+                             (appending reuses the archive's own) */
+    int      delta;       /* with a codec, delta-filter entries that look
+                             like bitmaps or fixed-width records (default) */
+    int      stream;      /* write the streamed layout even to a file */
+    unsigned io;          /* MFA_IO_*: how mfa_load_all_ex and
+                             mfa_extract_all_ex open, read and write files */
+    const char *pass;     /* passphrase for reading encrypted archives */
+    mfa_stats  *stats;    /* per-phase instrumentation; NULL = off */
+} mfa_options;
+
+/* Fill `opt` with defaults. */
+void mfa_options_init(mfa_options *opt);
+
 /* ---------------- Public API ---------------- */
 
 /* Load file contents into memory for each entry (fills buf/len). */
-int  mfa_load_all(linked_list *files);
+int  mfa_load_all(mfa_file_table *files);
+
+/* As mfa_load_all, timed into opt->stats when set (opt may be NULL). */
+int  mfa_load_all_ex(mfa_file_table *files, const mfa_options *opt);
 
 /* Free file buffers for each entry (frees buf, zeroes len). */
-void mfa_free_all(linked_list *files);
+void mfa_free_all(mfa_file_table *files);
 
 /* Create an archive from files[]. If flags contain MFA_ENCRYPT, `pass` is used.
+   Entries without a loaded buf are streamed from disk in chunks.
+   archive_path "-" writes to stdout. Output that cannot seek (stdout,
+   pipes) is written in one pass, with the TOC after the data.
    Returns 0 on success. */
 int mfa_pack(const char *archive_path,
-             linked_list *files,
+             mfa_file_table *files,
              const char *pass, unsigned flags);
 
+/* As mfa_pack, with explicit options (NULL = defaults). */
+int mfa_pack_ex(const char *archive_path,
+                mfa_file_table *files,
+                const char *pass, unsigned flags,
+                const mfa_options *opt);
+
+/* Add files[] to an existing archive without rewriting it: their data
+   and a new TOC are written after the current end of file, then the
+   header is updated, so the cost is the new data plus the TOC. New
+   entries are encrypted exactly when the archive is, which then needs
+   `pass`; MFA_ENCRYPT in flags is an error for a clear archive. Names
+   already in the archive are rejected. Returns 0 on success. */
+int mfa_append(const char *archive_path,
+               mfa_file_table *files,
+               const char *pass, unsigned flags,
+               const mfa_options *opt);
+
 /* Print a table of contents for the archive to stdout. */
 int mfa_list(const char *archive_path);
 
 /* Extract all entries to out_dir (or current dir if out_dir NULL/empty). */
 int mfa_extract_all(const char *archive_path, const char *out_dir);
 
+/* As mfa_extract_all; entries are spread over opt->jobs threads. */
+int mfa_extract_all_ex(const char *archive_path, const char *out_dir,
+                       const mfa_options *opt);
+
+/* Extract a streamed archive (see mfa_pack) to out_dir reading it
+   strictly front to back, from archive_path or "-" for stdin: each
+   entry is written as its bytes arrive, so the archive never needs to
+   be stored whole. Archives with the TOC up front must be extracted
+   from a file with mfa_extract_all. Returns 0 if every entry was
+   written and checked. */
+int mfa_extract_stream(const char *archive_path, const char *out_dir,
+                       const mfa_options *opt);
+
+/* Decode every entry (on opt->jobs threads) and check it against its
+   stored CRC32C without writing anything. Prints a summary; returns 0
+   if every entry is intact. */
+int mfa_verify(const char *archive_path, const mfa_options *opt);
+
+/* Extract the single entry stored as `name` to out_path ("-" for stdout;
+   NULL/empty: the entry's name in the current dir). Uses the archive's
+   name index when present, so the cost does not grow with entry count. */
+int mfa_extract_one(const char *archive_path, const char *name, const char *out_path);
+
+/* As mfa_extract_one, with options (opt->pass for encrypted archives). */
+int mfa_extract_one_ex(const char *archive_path, const char *name, const char *out_path,
+                       const mfa_options *opt);
+
+/* Copy up to len bytes of entry `name`, starting at byte `offset` of
+   its contents, into buf. Compressed entries decode only the blocks
+   the range touches. Returns the bytes copied (short or 0 past the
+   end of the entry), or -1 on error. */
+long long mfa_read_range(const char *archive_path, const char *name,
+                         uint64_t offset, size_t len, void *buf);
+
+/* As mfa_read_range, with options (opt->pass for encrypted archives). */
+long long mfa_read_range_ex(const char *archive_path, const char *name,
+                            uint64_t offset, size_t len, void *buf,
+                            const mfa_options *opt);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,500 @@
+#define _GNU_SOURCE  /* wait4, mkdtemp */
+
+#include "mfa.h"
+#include "mfa_util.h"
+#include "mfa_codec.h"
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* ============================================================
+   mfa_bench
+   ------------------------------------------------------------
+   Generates synthetic corpora in a scratch directory and times
+   mfa_pack, mfa_list and mfa_extract_all on each. Every run
+   happens in a forked child, so that its peak RSS (from wait4)
+   and its I/O syscall counts (syscr/syscw from /proc/self/io)
+   belong to that one operation. The best of --reps runs is
+   reported, one JSON object per corpus and operation.
+   ============================================================ */
+
+#define GEN_BUF (1024u * 1024u)
+
+/* Scratch paths: the mkdtemp root, then each level below it (a
+   corpus directory or archive, then a file) adds under PATH_STEP
+   bytes. */
+#define ROOT_MAX  4096u
+#define PATH_STEP 64u
+
+typedef struct {
+    const char *name;
+    unsigned    files;        /* at scale 1 */
+    uint64_t    min_size;     /* per file, at scale 1 */
+    uint64_t    max_size;
+    int         kind;
+} corpus_spec;
+
+enum { GEN_TEXT, GEN_RANDOM, GEN_BMP };
+
+static const corpus_spec corpora[] = {
+    { "tiny",   5000, 64,                 2048,               GEN_TEXT   },
+    { "text",   2,    48u * 1024 * 1024,  48u * 1024 * 1024,  GEN_TEXT   },
+    { "random", 2,    32u * 1024 * 1024,  32u * 1024 * 1024,  GEN_RANDOM },
+    { "bmp",    16,   3u * 1024 * 1024,   3u * 1024 * 1024,   GEN_BMP    }
+};
+#define NCORPORA (sizeof corpora / sizeof corpora[0])
+
+enum { OP_PACK, OP_LIST, OP_EXTRACT, NOPS };
+static const char *const op_names[NOPS] = { "pack", "list", "extract_all" };
+
+/* What a child reports back through its pipe. */
+typedef struct {
+    int                status;    /* 0 if the operation succeeded */
+    unsigned long long syscr, syscw;
+    unsigned long long rchar, wchar;
+} child_report;
+
+typedef struct {
+    double             seconds;
+    double             cpu_user, cpu_sys;
+    long               peak_rss_kb;
+    child_report       io;
+} run_result;
+
+/* ---- Synthetic data ---- */
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t rng_next(void) {
+    uint64_t x = rng_state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return rng_state = x;
+}
+
+static const char *const words[] = {
+    "archive", "block", "chunk", "data", "entry", "file", "index", "table",
+    "stream", "offset", "the", "of", "and", "to", "in", "is", "for", "with",
+    "compress", "header", "record", "buffer", "pipeline", "worker", "thread"
+};
+#define NWORDS (sizeof words / sizeof words[0])
+
+static void fill_text(uint8_t *p, size_t n) {
+    size_t i = 0;
+    while (i < n) {
+        const char *w = words[rng_next() % NWORDS];
+        size_t k = strlen(w);
+        if (k > n - i) k = n - i;
+        memcpy(p + i, w, k);
+        i += k;
+        if (i < n) p[i++] = (rng_next() % 12) ? ' ' : '\n';
+    }
+}
+
+static void fill_random(uint8_t *p, size_t n) {
+    size_t i = 0;
+    while (i < n) {
+        uint64_t v = rng_next();
+        size_t k = n - i < 8 ? n - i : 8;
+        memcpy(p + i, &v, k);
+        i += k;
+    }
+}
+
+/* 24-bit BMP of roughly `size` bytes: smooth gradients plus a
+   little noise, like a photo or a screenshot. */
+static int write_bmp(FILE *f, uint64_t size, uint8_t *buf) {
+    uint32_t w = 1024, h, row, y, x;
+    uint8_t hdr[54];
+
+    h = (uint32_t)(size / (w * 3));
+    if (!h) h = 1;
+    row = w * 3;
+    memset(hdr, 0, sizeof hdr);
+    hdr[0] = 'B'; hdr[1] = 'M';
+    mfa_st32(hdr + 2, 54 + row * h);
+    mfa_st32(hdr + 10, 54);
+    mfa_st32(hdr + 14, 40);
+    mfa_st32(hdr + 18, w);
+    mfa_st32(hdr + 22, h);
+    mfa_st16(hdr + 26, 1);
+    mfa_st16(hdr + 28, 24);
+    mfa_st32(hdr + 34, row * h);
+    if (mfa_write_exact(f, hdr, sizeof hdr)) return -1;
+
+    for (y = 0; y < h; ++y) {
+        for (x = 0; x < w; ++x) {
+            uint8_t noise = (uint8_t)(rng_next() & 3);
+            buf[3 * x]     = (uint8_t)(x / 4 + noise);
+            buf[3 * x + 1] = (uint8_t)(y / 4 + noise);
+            buf[3 * x + 2] = (uint8_t)((x + y) / 8);
+        }
+        if (mfa_write_exact(f, buf, row)) return -1;
+    }
+    return 0;
+}
+
+/* Write one corpus file of `size` bytes. */
+static int gen_file(const char *path, int kind, uint64_t size, uint8_t *buf) {
+    FILE *f = fopen(path, "wb");
+    int rc = 0;
+
+    if (!f) { perror(path); return -1; }
+    if (kind == GEN_BMP) {
+        rc = write_bmp(f, size, buf);
+    } else {
+        while (size && rc == 0) {
+            size_t k = size < GEN_BUF ? (size_t)size : GEN_BUF;
+            if (kind == GEN_TEXT) fill_text(buf, k);
+            else fill_random(buf, k);
+            rc = mfa_write_exact(f, buf, k);
+            size -= k;
+        }
+    }
+    if (fclose(f) != 0) rc = -1;
+    if (rc) perror(path);
+    return rc;
+}
+
+/* Generate corpus c under dir; returns its file count and bytes. */
+static int gen_corpus(const char *dir, const corpus_spec *c, double scale,
+                      unsigned *files, uint64_t *bytes) {
+    uint8_t *buf = (uint8_t *)malloc(GEN_BUF);
+    char path[ROOT_MAX + 2 * PATH_STEP];
+    unsigned i, n;
+    int rc = 0;
+
+    if (!buf) { perror("malloc"); return -1; }
+    if (mkdir(dir, 0755) != 0) { perror(dir); free(buf); return -1; }
+
+    /* Small-file corpora scale in count, large-file ones in size. */
+    n = c->files;
+    if (c->max_size <= 4096) n = (unsigned)(n * scale);
+    if (!n) n = 1;
+    *files = n;
+    *bytes = 0;
+    for (i = 0; i < n && rc == 0; ++i) {
+        uint64_t size = c->min_size + rng_next() % (c->max_size - c->min_size + 1);
+        struct stat st;
+        if (c->max_size > 4096) size = (uint64_t)(size * scale);
+        sprintf(path, "%s/%s_%06u.%s", dir, c->name, i, c->kind == GEN_BMP ? "bmp" : "dat");
+        rc = gen_file(path, c->kind, size, buf);
+        if (rc == 0 && stat(path, &st) == 0) *bytes += (uint64_t)st.st_size;
+    }
+    free(buf);
+    return rc;
+}
+
+/* ---- Directory helpers ---- */
+
+/* Paths of the regular files in dir; the names are owned by *names. */
+static int list_dir(const char *dir, mfa_file_table *t, char ***names, size_t *count) {
+    DIR *d = opendir(dir);
+    struct dirent *de;
+    size_t n = 0, cap = 0;
+    char **v = NULL;
+    int rc = 0;
+
+    if (!d) { perror(dir); return -1; }
+    while ((de = readdir(d)) != NULL) {
+        char *p;
+        if (de->d_name[0] == '.') continue;
+        if (n == cap) {
+            char **nv;
+            cap = cap ? cap * 2 : 256;
+            nv = (char **)realloc(v, cap * sizeof *v);
+            if (!nv) { rc = -1; break; }
+            v = nv;
+        }
+        p = mfa_join_path(dir, de->d_name);
+        if (!p) { rc = -1; break; }
+        v[n++] = p;
+    }
+    closedir(d);
+
+    *names = v;
+    *count = n;
+    if (rc) { perror("malloc"); return -1; }
+    if (t) {
+        size_t i;
+        for (i = 0; i < n; ++i)
+            if (mfa_files_add(t, v[i]) != 0) return -1;
+        mfa_sort_paths(t);
+    }
+    return 0;
+}
+
+static void free_names(char **v, size_t n) {
+    size_t i;
+    for (i = 0; i < n; ++i) free(v[i]);
+    free(v);
+}
+
+/* Remove dir and the files in it (corpora are flat). */
+static void remove_dir(const char *dir) {
+    char **v = NULL;
+    size_t n = 0, i;
+    if (access(dir, F_OK) != 0) return;
+    if (list_dir(dir, NULL, &v, &n) == 0) {
+        for (i = 0; i < n; ++i) unlink(v[i]);
+        free_names(v, n);
+    }
+    rmdir(dir);
+}
+
+/* ---- Measurement ---- */
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static double tv_seconds(const struct timeval *tv) {
+    return (double)tv->tv_sec + (double)tv->tv_usec / 1e6;
+}
+
+/* This process's I/O counters; zeros where /proc is unavailable. */
+static void read_proc_io(child_report *r) {
+    FILE *f = fopen("/proc/self/io", "r");
+    char key[64];
+    unsigned long long v;
+
+    if (!f) return;
+    while (fscanf(f, "%63[^:]: %llu\n", key, &v) == 2) {
+        if (strcmp(key, "syscr") == 0) r->syscr = v;
+        else if (strcmp(key, "syscw") == 0) r->syscw = v;
+        else if (strcmp(key, "rchar") == 0) r->rchar = v;
+        else if (strcmp(key, "wchar") == 0) r->wchar = v;
+    }
+    fclose(f);
+}
+
+typedef struct {
+    const char        *corpus_dir;
+    const char        *archive;
+    const char        *out_dir;
+    const mfa_options *opt;
+} bench_ctx;
+
+/* Body of one measured child. */
+static int child_run(int op, const bench_ctx *b) {
+    mfa_file_table files;
+    char **names = NULL;
+    size_t n = 0;
+    int rc = -1;
+
+    switch (op) {
+    case OP_PACK:
+        mfa_files_init(&files);
+        if (list_dir(b->corpus_dir, &files, &names, &n) == 0)
+            rc = mfa_pack_ex(b->archive, &files, NULL, MFA_COMPRESS, b->opt);
+        mfa_files_free(&files);
+        free_names(names, n);
+        break;
+    case OP_LIST: {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd >= 0) { fflush(stdout); dup2(null_fd, STDOUT_FILENO); close(null_fd); }
+        rc = mfa_list(b->archive);
+        fflush(stdout);
+        break;
+    }
+    case OP_EXTRACT:
+        rc = mfa_extract_all_ex(b->archive, b->out_dir, b->opt);
+        break;
+    }
+    return rc;
+}
+
+/* Run op once in a child and measure it. */
+static int measure(int op, const bench_ctx *b, run_result *res) {
+    int fds[2];
+    pid_t pid;
+    int status = 0;
+    struct rusage ru;
+    double t0;
+
+    memset(res, 0, sizeof *res);
+    if (op == OP_EXTRACT) {
+        remove_dir(b->out_dir);
+        if (mkdir(b->out_dir, 0755) != 0) { perror(b->out_dir); return -1; }
+    }
+    if (pipe(fds) != 0) { perror("pipe"); return -1; }
+
+    fflush(stdout);
+    t0 = now_seconds();
+    pid = fork();
+    if (pid < 0) { perror("fork"); close(fds[0]); close(fds[1]); return -1; }
+    if (pid == 0) {
+        child_report r;
+        memset(&r, 0, sizeof r);
+        close(fds[0]);
+        r.status = child_run(op, b);
+        read_proc_io(&r);
+        if (write(fds[1], &r, sizeof r) != (ssize_t)sizeof r) _exit(2);
+        _exit(r.status == 0 ? 0 : 1);
+    }
+
+    close(fds[1]);
+    memset(&res->io, 0, sizeof res->io);
+    res->io.status = -1;
+    if (read(fds[0], &res->io, sizeof res->io) != (ssize_t)sizeof res->io) res->io.status = -1;
+    close(fds[0]);
+    while (wait4(pid, &status, 0, &ru) < 0) {
+        if (errno != EINTR) { perror("wait4"); return -1; }
+    }
+    res->seconds     = now_seconds() - t0;
+    res->cpu_user    = tv_seconds(&ru.ru_utime);
+    res->cpu_sys     = tv_seconds(&ru.ru_stime);
+    res->peak_rss_kb = ru.ru_maxrss;
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 || res->io.status != 0) {
+        fprintf(stderr, "%s failed\n", op_names[op]);
+        return -1;
+    }
+    return 0;
+}
+
+static void emit(FILE *out, int *first, const char *corpus, unsigned files, uint64_t bytes,
+                 uint64_t archive_bytes, int op, const run_result *r) {
+    double s = r->seconds > 0 ? r->seconds : 1e-9;
+    fprintf(out, "%s\n    {\"corpus\": \"%s\", \"op\": \"%s\", \"files\": %u, \"bytes\": %llu, "
+                 "\"archive_bytes\": %llu, \"seconds\": %.6f, \"cpu_user\": %.6f, \"cpu_sys\": %.6f, "
+                 "\"mb_per_s\": %.2f, \"files_per_s\": %.1f, \"syscr\": %llu, \"syscw\": %llu, "
+                 "\"rchar\": %llu, \"wchar\": %llu, \"peak_rss_kb\": %ld}",
+            *first ? "" : ",", corpus, op_names[op], files, (unsigned long long)bytes,
+            (unsigned long long)archive_bytes, r->seconds, r->cpu_user, r->cpu_sys,
+            (double)bytes / (1024.0 * 1024.0) / s, (double)files / s,
+            r->io.syscr, r->io.syscw, r->io.rchar, r->io.wchar, r->peak_rss_kb);
+    *first = 0;
+    fflush(out);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [--dir=DIR] [--scale=X] [--reps=N] [--only=CORPUS]\n"
+            "          [--codec=auto|raw|rle|lz|huf|lzh] [--jobs=N] [--max-memory=SIZE] [--solid=SIZE]\n"
+            "          [--dict=SIZE] [--no-delta] [--keep]\n"
+            "Prints one JSON document with a result per corpus and operation.\n",
+            prog);
+}
+
+int main(int argc, char **argv) {
+    mfa_options opts;
+    const char *base = "/tmp";
+    const char *only = NULL;
+    double scale = 1.0;
+    unsigned reps = 3;
+    int keep = 0, first = 1, rc = 0;
+    char root[ROOT_MAX];
+    size_t c;
+    int i;
+
+    mfa_options_init(&opts);
+    for (i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        if (strncmp(arg, "--dir=", 6) == 0) {
+            base = arg + 6;
+        } else if (strncmp(arg, "--scale=", 8) == 0) {
+            scale = atof(arg + 8);
+            if (scale <= 0) { usage(argv[0]); return 1; }
+        } else if (strncmp(arg, "--reps=", 7) == 0) {
+            reps = (unsigned)atoi(arg + 7);
+            if (!reps) { usage(argv[0]); return 1; }
+        } else if (strncmp(arg, "--only=", 7) == 0) {
+            only = arg + 7;
+        } else if (strcmp(arg, "--codec=auto") == 0) {
+            opts.codec = MFA_CODEC_AUTO;
+        } else if (strncmp(arg, "--codec=", 8) == 0) {
+            const mfa_codec *codec = mfa_codec_by_name(arg + 8);
+            if (!codec) { fprintf(stderr, "Unknown codec: %s\n", arg + 8); return 1; }
+            opts.codec = codec->id;
+        } else if (strncmp(arg, "--jobs=", 7) == 0) {
+            opts.jobs = (unsigned)atoi(arg + 7);
+        } else if (strncmp(arg, "--max-memory=", 13) == 0) {
+            uint64_t v;
+            if (mfa_parse_size(arg + 13, &v) != 0 || v == 0) { usage(argv[0]); return 1; }
+            opts.max_memory = (size_t)v;
+        } else if (strncmp(arg, "--solid=", 8) == 0) {
+            if (mfa_parse_size(arg + 8, &opts.solid) != 0) { usage(argv[0]); return 1; }
+        } else if (strncmp(arg, "--dict=", 7) == 0) {
+            if (mfa_parse_size(arg + 7, &opts.dict) != 0) { usage(argv[0]); return 1; }
+        } else if (strcmp(arg, "--no-delta") == 0) {
+            opts.delta = 0;
+        } else if (strcmp(arg, "--keep") == 0) {
+            keep = 1;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (strlen(base) > sizeof root - PATH_STEP) { fprintf(stderr, "--dir too long\n"); return 1; }
+    sprintf(root, "%s/mfa_bench.XXXXXX", base);
+    if (!mkdtemp(root)) { perror(root); return 1; }
+
+    printf("{\n  \"codec\": \"%s\", \"jobs\": %u, \"max_memory\": %lu, \"solid\": %llu,"
+           " \"dict\": %llu, \"delta\": %s, \"scale\": %g, \"reps\": %u,\n  \"results\": [",
+           opts.codec == MFA_CODEC_AUTO ? "auto" : mfa_codec_get(opts.codec)->name,
+           opts.jobs, (unsigned long)opts.max_memory,
+           (unsigned long long)opts.solid, (unsigned long long)opts.dict,
+           opts.delta ? "true" : "false", scale, reps);
+
+    for (c = 0; c < NCORPORA && rc == 0; ++c) {
+        char dir[ROOT_MAX + PATH_STEP], archive[ROOT_MAX + PATH_STEP], out_dir[ROOT_MAX + PATH_STEP];
+        unsigned files = 0;
+        uint64_t bytes = 0, archive_bytes = 0;
+        bench_ctx b;
+        int op;
+
+        if (only && strcmp(only, corpora[c].name) != 0) continue;
+        sprintf(dir, "%s/%s", root, corpora[c].name);
+        sprintf(archive, "%s/%s.mfa", root, corpora[c].name);
+        sprintf(out_dir, "%s/%s.out", root, corpora[c].name);
+        fprintf(stderr, "generating %s...\n", corpora[c].name);
+        if (gen_corpus(dir, &corpora[c], scale, &files, &bytes) != 0) { rc = -1; break; }
+
+        b.corpus_dir = dir;
+        b.archive    = archive;
+        b.out_dir    = out_dir;
+        b.opt        = &opts;
+
+        for (op = 0; op < NOPS && rc == 0; ++op) {
+            run_result best, r;
+            unsigned k;
+            memset(&best, 0, sizeof best);
+            for (k = 0; k < reps; ++k) {
+                if (measure(op, &b, &r) != 0) { rc = -1; break; }
+                if (k == 0 || r.seconds < best.seconds) best = r;
+            }
+            if (rc) break;
+            if (op == OP_PACK) {
+                uint64_t sz;
+                if (mfa_file_size(archive, &sz) == 0) archive_bytes = sz;
+            }
+            emit(stdout, &first, corpora[c].name, files, bytes, archive_bytes, op, &best);
+        }
+
+        if (!keep) {
+            remove_dir(dir);
+            remove_dir(out_dir);
+            unlink(archive);
+        }
+    }
+
+    printf("\n  ]\n}\n");
+    if (!keep) rmdir(root);
+    else fprintf(stderr, "kept %s\n", root);
+    return rc ? 1 : 0;
+}
@@ -0,0 +1,968 @@
+#include "mfa_codec.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* ============================================================
+   Word-at-a-time helpers
+   ------------------------------------------------------------
+   Scans compare 8 bytes per step. Unaligned loads go through
+   memcpy, which compilers lower to a single mov.
+   ============================================================ */
+
+#define ONES  0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+
+static uint64_t ld64(const uint8_t *p) { uint64_t v; memcpy(&v, p, 8); return v; }
+static uint32_t ld32(const uint8_t *p) { uint32_t v; memcpy(&v, p, 4); return v; }
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define MFA_BIG_ENDIAN 1
+#endif
+
+/* Index of the first (lowest-address) non-zero byte of x != 0. */
+static unsigned first_byte(uint64_t x) {
+#if defined(MFA_BIG_ENDIAN)
+    return (unsigned)__builtin_clzll(x) >> 3;
+#else
+    return (unsigned)__builtin_ctzll(x) >> 3;
+#endif
+}
+
+/* Number of equal leading bytes of a and b, reading b up to `end`. */
+static size_t common_len(const uint8_t *a, const uint8_t *b, const uint8_t *end) {
+    const uint8_t *start = b;
+    while (b + 8 <= end) {
+        uint64_t x = ld64(a) ^ ld64(b);
+        if (x) return (size_t)(b - start) + first_byte(x);
+        a += 8; b += 8;
+    }
+    while (b < end && *a == *b) { ++a; ++b; }
+    return (size_t)(b - start);
+}
+
+/* Length of the run of p[0] starting at p. */
+static size_t run_len(const uint8_t *p, const uint8_t *end) {
+    const uint64_t v = (uint64_t)p[0] * ONES;
+    const uint8_t *q = p;
+    while (q + 8 <= end) {
+        uint64_t x = ld64(q) ^ v;
+        if (x) return (size_t)(q - p) + first_byte(x);
+        q += 8;
+    }
+    while (q < end && *q == p[0]) ++q;
+    return (size_t)(q - p);
+}
+
+/* First position >= p where three equal bytes start, or `end`. */
+static const uint8_t *find_run3(const uint8_t *p, const uint8_t *end) {
+#if !defined(MFA_BIG_ENDIAN)
+    /* d has a zero byte at k iff p[k] == p[k+1] == p[k+2]; the lowest
+       flagged byte of the classic has-zero test is always exact. */
+    while (p + 10 <= end) {
+        uint64_t x = ld64(p), y = ld64(p + 1), z = ld64(p + 2);
+        uint64_t d = (x ^ y) | (y ^ z);
+        uint64_t t = (d - ONES) & ~d & HIGHS;
+        if (t) return p + first_byte(t);
+        p += 8;
+    }
+#endif
+    for (; p + 3 <= end; ++p)
+        if (p[0] == p[1] && p[1] == p[2]) return p;
+    return end;
+}
+
+static size_t put_varint(uint8_t *out, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) { out[n++] = (uint8_t)(v | 0x80); v >>= 7; }
+    out[n++] = (uint8_t)v;
+    return n;
+}
+
+static int get_varint(const uint8_t **pp, const uint8_t *end, uint64_t *out) {
+    const uint8_t *p = *pp;
+    uint64_t v = 0;
+    unsigned shift = 0;
+    while (p < end && shift < 64) {
+        uint8_t b = *p++;
+        v |= (uint64_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) { *pp = p; *out = v; return 0; }
+        shift += 7;
+    }
+    return -1;
+}
+
+/* ============================================================
+   Raw
+   ============================================================ */
+
+static size_t raw_bound(size_t n) { return n; }
+
+static int raw_encode(const uint8_t *in, size_t n, uint8_t *out, size_t cap, size_t *out_n) {
+    if (cap < n) return -1;
+    memcpy(out, in, n);
+    *out_n = n;
+    return 0;
+}
+
+static int raw_decode(const uint8_t *in, size_t n, uint8_t *out, size_t out_n) {
+    if (n != out_n) return -1;
+    memcpy(out, in, n);
+    return 0;
+}
+
+/* ============================================================
+   RLE
+   ------------------------------------------------------------
+   Control byte c:
+     0x00..0x7F  literal: c+1 bytes follow
+     0x80..0xFE  run: next byte repeated (c & 0x7F) + 3 times
+     0xFF        run: varint extra, then byte; 130 + extra times
+   ============================================================ */
+
+#define RLE_MIN_RUN   3
+#define RLE_SHORT_MAX 129   /* longest run with a one-byte control */
+#define RLE_LIT_MAX   128
+
+static size_t rle_bound(size_t n) { return n + n / RLE_LIT_MAX + 16; }
+
+static int rle_encode(const uint8_t *in, size_t n, uint8_t *out, size_t cap, size_t *out_n) {
+    const uint8_t *p = in, *end = in + n;
+    uint8_t *o = out;
+
+    if (cap < rle_bound(n)) return -1;
+
+    while (p < end) {
+        const uint8_t *r = find_run3(p, end);
+
+        while (p < r) {
+            size_t lit = (size_t)(r - p);
+            if (lit > RLE_LIT_MAX) lit = RLE_LIT_MAX;
+            *o++ = (uint8_t)(lit - 1);
+            memcpy(o, p, lit);
+            o += lit; p += lit;
+        }
+        if (r == end) break;
+
+        {
+            size_t len = run_len(r, end);
+            if (len <= RLE_SHORT_MAX) {
+                *o++ = (uint8_t)(0x80 | (len - RLE_MIN_RUN));
+            } else {
+                *o++ = 0xFF;
+                o += put_varint(o, (uint64_t)(len - RLE_SHORT_MAX - 1));
+            }
+            *o++ = *r;
+            p = r + len;
+        }
+    }
+
+    *out_n = (size_t)(o - out);
+    return 0;
+}
+
+static int rle_decode(const uint8_t *in, size_t n, uint8_t *out, size_t out_n) {
+    const uint8_t *p = in, *end = in + n;
+    uint8_t *o = out, *oend = out + out_n;
+
+    while (p < end) {
+        uint8_t c = *p++;
+        if (c < 0x80) {
+            size_t lit = (size_t)c + 1;
+            if ((size_t)(end - p) < lit || (size_t)(oend - o) < lit) return -1;
+            memcpy(o, p, lit);
+            o += lit; p += lit;
+        } else {
+            uint64_t len;
+            if (c == 0xFF) {
+                if (get_varint(&p, end, &len)) return -1;
+                len += RLE_SHORT_MAX + 1;
+            } else {
+                len = (uint64_t)(c & 0x7F) + RLE_MIN_RUN;
+            }
+            if (p >= end || (uint64_t)(oend - o) < len) return -1;
+            memset(o, *p++, (size_t)len);
+            o += len;
+        }
+    }
+    return o == oend ? 0 : -1;
+}
+
+/* ============================================================
+   LZ77
+   ------------------------------------------------------------
+   A sequence of
+     token      hi nibble: literal count, lo nibble: match len - 4
+                (15 in either = continued in 255-terminated bytes)
+     literals
+     offset     u16 LE, 1..65535
+   The final sequence carries literals only and ends the block.
+   With a dictionary, offsets reaching back past the block's start
+   continue into the dictionary's tail.
+   ============================================================ */
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFF   65535u
+#define LZ_HASH_LOG  16
+
+static size_t lz_bound(size_t n) { return n + n / 255 + 16; }
+
+static uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_LOG);
+}
+
+static uint8_t *lz_put_len(uint8_t *o, size_t len) {
+    while (len >= 255) { *o++ = 255; len -= 255; }
+    *o++ = (uint8_t)len;
+    return o;
+}
+
+static uint8_t *lz_emit(uint8_t *o, const uint8_t *lit, size_t lit_len,
+                        size_t off, size_t match_len) {
+    uint8_t *tok = o++;
+    size_t ml = match_len ? match_len - LZ_MIN_MATCH : 0;
+
+    *tok = (uint8_t)(((lit_len < 15 ? lit_len : 15) << 4) | (ml < 15 ? ml : 15));
+    if (lit_len >= 15) o = lz_put_len(o, lit_len - 15);
+    memcpy(o, lit, lit_len);
+    o += lit_len;
+
+    if (match_len) {
+        *o++ = (uint8_t)off;
+        *o++ = (uint8_t)(off >> 8);
+        if (ml >= 15) o = lz_put_len(o, ml - 15);
+    }
+    return o;
+}
+
+/* Code in[start..n); in[0..start) is history that matches may
+   reach into, already entered in table. */
+static uint8_t *lz_encode_from(const uint8_t *in, size_t start, size_t n,
+                               uint32_t *table, uint8_t *out) {
+    const uint8_t *end = in + n;
+    size_t i = start, anchor = start;
+    uint8_t *o = out;
+
+    while (i + LZ_MIN_MATCH <= n) {
+        uint32_t v = ld32(in + i);
+        uint32_t h = lz_hash(v);
+        size_t cand = table[h];
+        table[h] = (uint32_t)i;
+
+        if (cand < i && i - cand <= LZ_MAX_OFF && ld32(in + cand) == v) {
+            size_t len = LZ_MIN_MATCH + common_len(in + cand + LZ_MIN_MATCH,
+                                                   in + i + LZ_MIN_MATCH, end);
+            while (i > anchor && cand > 0 && in[i - 1] == in[cand - 1]) {
+                --i; --cand; ++len;
+            }
+            o = lz_emit(o, in + anchor, i - anchor, i - cand, len);
+            i += len;
+            anchor = i;
+            if (i + LZ_MIN_MATCH <= n && i >= 2)
+                table[lz_hash(ld32(in + i - 2))] = (uint32_t)(i - 2);
+        } else {
+            /* Step faster through data that keeps missing. */
+            i += 1 + ((i - anchor) >> 6);
+        }
+    }
+
+    return lz_emit(o, in + anchor, n - anchor, 0, 0);
+}
+
+static int lz_encode(const uint8_t *in, size_t n, uint8_t *out, size_t cap, size_t *out_n) {
+    uint32_t *table;
+
+    if (cap < lz_bound(n)) return -1;
+    table = (uint32_t *)calloc((size_t)1 << LZ_HASH_LOG, sizeof *table);
+    if (!table) return -1;
+    *out_n = (size_t)(lz_encode_from(in, 0, n, table, out) - out);
+    free(table);
+    return 0;
+}
+
+static int lz_get_len(const uint8_t **pp, const uint8_t *end, size_t *len) {
+    const uint8_t *p = *pp;
+    uint8_t b;
+    do {
+        if (p >= end) return -1;
+        b = *p++;
+        *len += b;
+    } while (b == 255);
+    *pp = p;
+    return 0;
+}
+
+/* hist[0..hist_n) is the history before out (a dictionary's bytes,
+   or nothing). */
+static int lz_decode_hist(const uint8_t *hist, size_t hist_n,
+                          const uint8_t *in, size_t n, uint8_t *out, size_t out_n) {
+    const uint8_t *p = in, *end = in + n;
+    uint8_t *o = out, *oend = out + out_n;
+
+    while (p < end) {
+        uint8_t token = *p++;
+        size_t lit = token >> 4;
+        size_t len, off;
+        const uint8_t *src;
+
+        if (lit == 15 && lz_get_len(&p, end, &lit)) return -1;
+        if ((size_t)(end - p) < lit || (size_t)(oend - o) < lit) return -1;
+        memcpy(o, p, lit);
+        o += lit; p += lit;
+
+        if (p == end) break;  /* final, literal-only sequence */
+
+        if (end - p < 2) return -1;
+        off = (size_t)p[0] | ((size_t)p[1] << 8);
+        p += 2;
+        len = token & 15;
+        if (len == 15 && lz_get_len(&p, end, &len)) return -1;
+        len += LZ_MIN_MATCH;
+
+        if (off == 0 || (size_t)(oend - o) < len) return -1;
+
+        if (off > (size_t)(o - out)) {
+            /* Starts in the history; the rest follows from out[0]. */
+            size_t back = off - (size_t)(o - out);
+            size_t k = back < len ? back : len;
+            if (back > hist_n) return -1;
+            memcpy(o, hist + hist_n - back, k);
+            o += k; len -= k;
+            src = out;
+        } else {
+            src = o - off;
+        }
+        if (off >= 8) {
+            /* Source trails by at least a word: copy 8 at a time. */
+            while (len >= 8) { memcpy(o, src, 8); o += 8; src += 8; len -= 8; }
+        }
+        while (len--) *o++ = *src++;
+    }
+    return o == oend ? 0 : -1;
+}
+
+static int lz_decode(const uint8_t *in, size_t n, uint8_t *out, size_t out_n) {
+    return lz_decode_hist(NULL, 0, in, n, out, out_n);
+}
+
+/* ============================================================
+   Dictionaries
+   ------------------------------------------------------------
+   A dictionary keeps its bytes and an LZ hash table already
+   filled from them. Coding with it copies that table and puts
+   the block right after the bytes, so the match search runs as
+   if the block simply continued the dictionary.
+   ============================================================ */
+
+struct mfa_dict {
+    size_t    n;
+    uint32_t *table;
+    uint8_t   bytes[1];
+};
+
+mfa_dict *mfa_dict_new(const uint8_t *p, size_t n) {
+    mfa_dict *d;
+    size_t i;
+
+    if (n > MFA_DICT_MAX) return NULL;
+    d = (mfa_dict *)malloc(sizeof *d + n);
+    if (!d) return NULL;
+    d->table = (uint32_t *)calloc((size_t)1 << LZ_HASH_LOG, sizeof *d->table);
+    if (!d->table) { free(d); return NULL; }
+    d->n = n;
+    memcpy(d->bytes, p, n);
+    for (i = 0; i + LZ_MIN_MATCH <= n; ++i)
+        d->table[lz_hash(ld32(p + i))] = (uint32_t)i;
+    return d;
+}
+
+void mfa_dict_free(mfa_dict *d) {
+    if (!d) return;
+    free(d->table);
+    free(d);
+}
+
+static int lz_encode_dict(const mfa_dict *d, const uint8_t *in, size_t n,
+                          uint8_t *out, size_t cap, size_t *out_n) {
+    size_t tsize = ((size_t)1 << LZ_HASH_LOG) * sizeof *d->table;
+    uint32_t *table;
+    uint8_t *buf;
+
+    if (cap < lz_bound(n)) return -1;
+    table = (uint32_t *)malloc(tsize);
+    buf = (uint8_t *)malloc(d->n + n + 1);
+    if (!table || !buf) { free(table); free(buf); return -1; }
+    memcpy(table, d->table, tsize);
+    memcpy(buf, d->bytes, d->n);
+    memcpy(buf + d->n, in, n);
+    *out_n = (size_t)(lz_encode_from(buf, d->n, d->n + n, table, out) - out);
+    free(table);
+    free(buf);
+    return 0;
+}
+
+static int lz_decode_dict(const mfa_dict *d, const uint8_t *in, size_t n,
+                          uint8_t *out, size_t out_n) {
+    return lz_decode_hist(d->bytes, d->n, in, n, out, out_n);
+}
+
+/* ============================================================
+   Huffman
+   ------------------------------------------------------------
+   Canonical codes of at most HUF_MAX_BITS bits, so that a single
+   table lookup on the next HUF_MAX_BITS bits decodes a symbol.
+   The block is cut into HUF_STREAMS equal segments, each coded
+   into a bit stream of its own; the decoder steps all of them
+   in lockstep, so that their lookups, which do not depend on
+   each other, overlap in the CPU. A block is
+     u8 mode      HUF_STORED: the bytes follow as they are
+                  HUF_SINGLE: u8 byte, repeated for the whole block
+                  HUF_CODED:  as below
+     u8 nsym      lengths follow for symbols 0..nsym-1 (0 = 256)
+     lengths      4 bits each, low nibble first; 0 = not used
+     u32 LE x 3   bytes in streams 0..2; stream 3 takes the rest
+     streams      LSB-first bit streams, each padded to a byte
+   ============================================================ */
+
+#define HUF_MAX_BITS  11
+#define HUF_TABLE     (1u << HUF_MAX_BITS)
+#define HUF_STREAMS   4u
+#define HUF_HDR_MAX   (2u + 128u + 4u * (HUF_STREAMS - 1))
+
+enum { HUF_STORED, HUF_SINGLE, HUF_CODED };
+
+static size_t huf_bound(size_t n) { return n + HUF_HDR_MAX; }
+
+static uint64_t ld64le(const uint8_t *p) {
+#if defined(MFA_BIG_ENDIAN)
+    return __builtin_bswap64(ld64(p));
+#else
+    return ld64(p);
+#endif
+}
+
+static void st32le(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)v; p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16); p[3] = (uint8_t)(v >> 24);
+}
+
+static uint32_t ld32le(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+           ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int u64_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Code lengths for the symbols with non-zero freq: Huffman
+   tree depths, then lengths over HUF_MAX_BITS folded back in while
+   keeping the code complete, longest codes to the rarest symbols. */
+static void huf_lengths(const size_t *freq, uint8_t *len) {
+    uint64_t key[256];
+    size_t weight[511];
+    uint16_t parent[511];
+    uint8_t depth[511];
+    unsigned count[HUF_MAX_BITS + 1];
+    unsigned ns = 0, leaf, node, next, i, l;
+    uint32_t total = 0;
+
+    for (i = 0; i < 256; ++i)
+        if (freq[i]) key[ns++] = ((uint64_t)freq[i] << 8) | i;
+    qsort(key, ns, sizeof *key, u64_cmp);
+    memset(len, 0, 256);
+    if (ns < 2) {
+        if (ns) len[key[0] & 255] = 1;
+        return;
+    }
+    for (i = 0; i < ns; ++i) weight[i] = (size_t)(key[i] >> 8);
+
+    /* Leaves in weight order and internal nodes as made are both
+       sorted, so the two lightest are always at their fronts. */
+    leaf = 0; node = next = ns;
+    for (i = 0; i + 1 < ns; ++i, ++next) {
+        unsigned k, pick[2];
+        for (k = 0; k < 2; ++k) {
+            if (leaf < ns && (node == next || weight[leaf] <= weight[node]))
+                pick[k] = leaf++;
+            else
+                pick[k] = node++;
+        }
+        weight[next] = weight[pick[0]] + weight[pick[1]];
+        parent[pick[0]] = parent[pick[1]] = (uint16_t)next;
+    }
+    depth[next - 1] = 0;
+    for (i = next - 1; i-- > 0;) depth[i] = (uint8_t)(depth[parent[i]] + 1);
+
+    memset(count, 0, sizeof count);
+    for (i = 0; i < ns; ++i) count[depth[i] < HUF_MAX_BITS ? depth[i] : HUF_MAX_BITS]++;
+    for (l = 1; l <= HUF_MAX_BITS; ++l) total += count[l] << (HUF_MAX_BITS - l);
+    while (total > HUF_TABLE) {
+        /* Drop a longest code and split a shorter one in two */
+        count[HUF_MAX_BITS]--;
+        for (l = HUF_MAX_BITS - 1; l > 0; --l) {
+            if (count[l]) { count[l]--; count[l + 1] += 2; break; }
+        }
+        total--;
+    }
+
+    for (i = 0, l = HUF_MAX_BITS; l > 0; --l) {
+        unsigned c;
+        for (c = 0; c < count[l]; ++c) len[key[i++] & 255] = (uint8_t)l;
+    }
+}
+
+/* Canonical codes for len[0..256), bit-reversed for LSB-first
+   streams. Returns -1 if the lengths oversubscribe the code. */
+static int huf_codes(const uint8_t *len, uint16_t *code) {
+    unsigned count[HUF_MAX_BITS + 1], next[HUF_MAX_BITS + 1];
+    unsigned s, l, c = 0, used = 0;
+
+    memset(count, 0, sizeof count);
+    for (s = 0; s < 256; ++s) count[len[s]]++;
+    count[0] = 0;
+    for (l = 1; l <= HUF_MAX_BITS; ++l) {
+        c = (c + count[l - 1]) << 1;
+        next[l] = c;
+        used += count[l] << (HUF_MAX_BITS - l);
+    }
+    if (used > HUF_TABLE) return -1;
+
+    for (s = 0; s < 256; ++s) {
+        unsigned v, r = 0, k;
+        if (!len[s]) continue;
+        v = next[len[s]]++;
+        for (k = 0; k < len[s]; ++k) r |= ((v >> k) & 1u) << (len[s] - 1 - k);
+        code[s] = (uint16_t)r;
+    }
+    return 0;
+}
+
+/* Bounds of stream k's segment of an n-byte block. */
+static size_t huf_seg(size_t n, unsigned k) {
+    size_t seg = (n + HUF_STREAMS - 1) / HUF_STREAMS;
+    return k * seg < n ? k * seg : n;
+}
+
+static uint8_t *huf_put_stream(uint8_t *o, const uint8_t *in, size_t n,
+                               const uint16_t *code, const uint8_t *len) {
+    uint64_t acc = 0;
+    unsigned nb = 0;
+    size_t i;
+
+    for (i = 0; i < n; ++i) {
+        acc |= (uint64_t)code[in[i]] << nb;
+        nb += len[in[i]];
+        if (nb >= 32) { st32le(o, (uint32_t)acc); o += 4; acc >>= 32; nb -= 32; }
+    }
+    for (; nb; nb = nb > 8 ? nb - 8 : 0) { *o++ = (uint8_t)acc; acc >>= 8; }
+    return o;
+}
+
+static int huf_encode(const uint8_t *in, size_t n, uint8_t *out, size_t cap, size_t *out_n) {
+    size_t freq[256], bytes[HUF_STREAMS], total;
+    uint8_t len[256];
+    uint16_t code[256];
+    unsigned used = 0, nsym = 0, s, k;
+    uint8_t *o;
+    size_t i;
+
+    if (cap < huf_bound(n)) return -1;
+    memset(freq, 0, sizeof freq);
+    for (i = 0; i < n; ++i) freq[in[i]]++;
+    for (s = 0; s < 256; ++s) if (freq[s]) { ++used; nsym = s + 1; }
+
+    if (used == 1) {
+        out[0] = HUF_SINGLE;
+        out[1] = in[0];
+        *out_n = 2;
+        return 0;
+    }
+    if (used > 1) {
+        huf_lengths(freq, len);
+        huf_codes(len, code);
+        total = 2 + (nsym + 1) / 2 + 4 * (HUF_STREAMS - 1);
+        for (k = 0; k < HUF_STREAMS; ++k) {
+            size_t bits = 0;
+            for (i = huf_seg(n, k); i < huf_seg(n, k + 1); ++i) bits += len[in[i]];
+            bytes[k] = (bits + 7) / 8;
+            total += bytes[k];
+        }
+    }
+    if (used == 0 || total >= n + 1) {
+        out[0] = HUF_STORED;
+        memcpy(out + 1, in, n);
+        *out_n = n + 1;
+        return 0;
+    }
+
+    o = out;
+    *o++ = HUF_CODED;
+    *o++ = (uint8_t)nsym;
+    for (s = 0; s < nsym; s += 2)
+        *o++ = (uint8_t)(len[s] | (s + 1 < nsym ? len[s + 1] << 4 : 0));
+    for (k = 0; k + 1 < HUF_STREAMS; ++k) { st32le(o, (uint32_t)bytes[k]); o += 4; }
+    for (k = 0; k < HUF_STREAMS; ++k)
+        o = huf_put_stream(o, in + huf_seg(n, k), huf_seg(n, k + 1) - huf_seg(n, k), code, len);
+    *out_n = (size_t)(o - out);
+    return 0;
+}
+
+/* One bit stream being read: `n` bits are valid in `bits`, and
+   the bytes from p on are still to be loaded. */
+typedef struct {
+    uint64_t       bits;
+    int            n;
+    const uint8_t *p, *end;
+} huf_in;
+
+/* Top bits up to 56 or more with one 8-byte load; a byte only
+   partly taken is loaded again next time, to the same place.
+   Needs 8 bytes left. */
+static void huf_refill_fast(huf_in *s) {
+    s->bits |= ld64le(s->p) << s->n;
+    s->p += (63 - s->n) >> 3;
+    s->n |= 56;
+}
+
+/* As huf_refill_fast, byte by byte near the end. */
+static void huf_refill(huf_in *s) {
+    if (s->end - s->p >= 8) {
+        huf_refill_fast(s);
+    } else {
+        while (s->n < 56 && s->p < s->end) {
+            s->bits |= (uint64_t)*s->p++ << s->n;
+            s->n += 8;
+        }
+    }
+}
+
+/* In the fast loop a stream's bits carry a marker: the highest set
+   bit sits just above the valid ones, so their count need not be
+   kept per symbol, only found again (one clz) at each refill. */
+static void huf_mark(huf_in *s) {
+    s->bits = (s->bits & (((uint64_t)1 << s->n) - 1)) | ((uint64_t)1 << s->n);
+}
+
+static void huf_unmark(huf_in *s) {
+    s->n = 63 - __builtin_clzll(s->bits);
+    s->bits ^= (uint64_t)1 << s->n;
+}
+
+static void huf_refill_marked(uint64_t *bits, const uint8_t **p) {
+    unsigned n = 63u - (unsigned)__builtin_clzll(*bits);
+    uint64_t v = (*bits ^ ((uint64_t)1 << n)) | (ld64le(*p) << n);
+    *p += (63 - n) >> 3;
+    n |= 56;
+    *bits = (v & (((uint64_t)1 << n) - 1)) | ((uint64_t)1 << n);
+}
+
+/* One-symbol table entries are length | symbol << 8: shifts take
+   their count mod 64, so the length needs no masking out. */
+static uint8_t huf_sym(const uint16_t *one, huf_in *s) {
+    unsigned e = one[s->bits & (HUF_TABLE - 1)];
+    s->bits >>= e & 63;
+    s->n -= (int)(e & 63);
+    return (uint8_t)(e >> 8);
+}
+
+/* Two-symbol table: what the next HUF_MAX_BITS bits decode to,
+   two symbols where both codes fit, else one. Entries are
+     bits 0..5    bits taken
+     bits 6..7    symbols (1 or 2)
+     bits 16..31  the symbols, as the two bytes to store
+   so that a lookup costs one shift and one 2-byte store. */
+static void huf_pairs(const uint16_t *one, uint32_t *two) {
+    unsigned i;
+    for (i = 0; i < HUF_TABLE; ++i) {
+        unsigned e1 = one[i], l1 = e1 & 63, rest = HUF_MAX_BITS - l1;
+        unsigned count = 1, bits = l1;
+        uint8_t syms[2];
+        uint16_t w;
+
+        syms[0] = (uint8_t)(e1 >> 8);
+        syms[1] = 0;
+        if (l1 && rest) {
+            unsigned e2 = one[(i >> l1) & ((1u << rest) - 1)];
+            if ((e2 & 63) && (e2 & 63) <= rest) {
+                syms[1] = (uint8_t)(e2 >> 8);
+                bits += e2 & 63;
+                count = 2;
+            }
+        }
+        memcpy(&w, syms, 2);
+        two[i] = bits | (count << 6) | ((uint32_t)w << 16);
+    }
+}
+
+static int huf_decode(const uint8_t *in, size_t n, uint8_t *out, size_t out_n) {
+    const uint8_t *p = in, *end = in + n;
+    uint16_t one[HUF_TABLE], code[256];
+    uint32_t two[HUF_TABLE];
+    uint8_t len[256], *o[HUF_STREAMS], *oend[HUF_STREAMS];
+    huf_in s[HUF_STREAMS];
+    uint64_t b0, b1, b2, b3;
+    const uint8_t *p0, *p1, *p2, *p3;
+    uint8_t *o0, *o1, *o2, *o3;
+    unsigned nsym, sym, k, e;
+    size_t left;
+
+    if (n < 1) return -1;
+    if (*p == HUF_STORED) {
+        if (n - 1 != out_n) return -1;
+        memcpy(out, p + 1, out_n);
+        return 0;
+    }
+    if (*p == HUF_SINGLE) {
+        if (n != 2) return -1;
+        memset(out, p[1], out_n);
+        return 0;
+    }
+    if (*p != HUF_CODED || n < 2) return -1;
+
+    /* Lengths, codes, and the lookup tables */
+    nsym = p[1] ? p[1] : 256;
+    p += 2;
+    if ((size_t)(end - p) < (nsym + 1) / 2 + 4 * (HUF_STREAMS - 1)) return -1;
+    memset(len, 0, sizeof len);
+    for (sym = 0; sym < nsym; ++sym) len[sym] = (uint8_t)((p[sym / 2] >> (4 * (sym & 1))) & 15);
+    p += (nsym + 1) / 2;
+    for (sym = 0; sym < 256; ++sym) if (len[sym] > HUF_MAX_BITS) return -1;
+    if (huf_codes(len, code)) return -1;
+    memset(one, 0, sizeof one);
+    for (sym = 0; sym < 256; ++sym) {
+        unsigned i;
+        if (!len[sym]) continue;
+        for (i = code[sym]; i < HUF_TABLE; i += 1u << len[sym])
+            one[i] = (uint16_t)(len[sym] | (sym << 8));
+    }
+    huf_pairs(one, two);
+
+    /* Streams and their segments of out */
+    left = (size_t)(end - p) - 4 * (HUF_STREAMS - 1);
+    for (k = 0; k < HUF_STREAMS; ++k) {
+        size_t size = left;
+        if (k + 1 < HUF_STREAMS) {
+            size = ld32le(p + 4 * k);
+            if (size > left) return -1;
+        }
+        left -= size;
+        s[k].bits = 0;
+        s[k].n = 0;
+        s[k].p = s[k].end = end - left - size;
+        s[k].end += size;
+        o[k] = out + huf_seg(out_n, k);
+        oend[k] = out + huf_seg(out_n, k + 1);
+    }
+
+    /* All streams at once while each has 8 bytes to load and room
+       for 10 symbols: 56 bits cover 5 lookups, so no checks. Marked
+       bits (see huf_mark) in locals keep the loop in registers. */
+    for (k = 0; k < HUF_STREAMS; ++k) huf_mark(&s[k]);
+    b0 = s[0].bits; b1 = s[1].bits; b2 = s[2].bits; b3 = s[3].bits;
+    p0 = s[0].p;    p1 = s[1].p;    p2 = s[2].p;    p3 = s[3].p;
+    o0 = o[0];      o1 = o[1];      o2 = o[2];      o3 = o[3];
+    while (oend[0] - o0 >= 10 && oend[1] - o1 >= 10 &&
+           oend[2] - o2 >= 10 && oend[3] - o3 >= 10 &&
+           s[0].end - p0 >= 8 && s[1].end - p1 >= 8 &&
+           s[2].end - p2 >= 8 && s[3].end - p3 >= 8) {
+        huf_refill_marked(&b0, &p0); huf_refill_marked(&b1, &p1);
+        huf_refill_marked(&b2, &p2); huf_refill_marked(&b3, &p3);
+        for (k = 0; k < 5; ++k) {
+            uint16_t w;
+            e = two[b0 & (HUF_TABLE - 1)]; b0 >>= e & 63;
+            w = (uint16_t)(e >> 16); memcpy(o0, &w, 2); o0 += (e >> 6) & 3;
+            e = two[b1 & (HUF_TABLE - 1)]; b1 >>= e & 63;
+            w = (uint16_t)(e >> 16); memcpy(o1, &w, 2); o1 += (e >> 6) & 3;
+            e = two[b2 & (HUF_TABLE - 1)]; b2 >>= e & 63;
+            w = (uint16_t)(e >> 16); memcpy(o2, &w, 2); o2 += (e >> 6) & 3;
+            e = two[b3 & (HUF_TABLE - 1)]; b3 >>= e & 63;
+            w = (uint16_t)(e >> 16); memcpy(o3, &w, 2); o3 += (e >> 6) & 3;
+        }
+    }
+    s[0].bits = b0; s[1].bits = b1; s[2].bits = b2; s[3].bits = b3;
+    s[0].p = p0;    s[1].p = p1;    s[2].p = p2;    s[3].p = p3;
+    o[0] = o0;      o[1] = o1;      o[2] = o2;      o[3] = o3;
+    for (k = 0; k < HUF_STREAMS; ++k) huf_unmark(&s[k]);
+
+    /* Then each to its end, checking as it goes */
+    for (k = 0; k < HUF_STREAMS; ++k) {
+        while (o[k] < oend[k]) {
+            huf_refill(&s[k]);
+            *o[k]++ = huf_sym(one, &s[k]);
+            if (s[k].n < 0) return -1;
+        }
+        if (s[k].p != s[k].end || s[k].n >= 8) return -1;
+    }
+    return 0;
+}
+
+/* ============================================================
+   LZ77 + Huffman
+   ------------------------------------------------------------
+   LZ77 output, as above, coded again with Huffman:
+     varint  length of the LZ77 output
+     a Huffman block of that length
+   The dictionary, if any, is LZ77's.
+   ============================================================ */
+
+static size_t lzh_bound(size_t n) { return huf_bound(lz_bound(n)) + 10; }
+
+static int lzh_encode_with(const mfa_dict *d, const uint8_t *in, size_t n,
+                           uint8_t *out, size_t cap, size_t *out_n) {
+    size_t lz_cap = lz_bound(n), lz_n = 0, hdr, huf_n = 0;
+    uint8_t *tmp;
+    int rc;
+
+    if (cap < lzh_bound(n)) return -1;
+    tmp = (uint8_t *)malloc(lz_cap);
+    if (!tmp) return -1;
+    rc = d ? lz_encode_dict(d, in, n, tmp, lz_cap, &lz_n) : lz_encode(in, n, tmp, lz_cap, &lz_n);
+    if (rc == 0) {
+        hdr = put_varint(out, lz_n);
+        rc = huf_encode(tmp, lz_n, out + hdr, cap - hdr, &huf_n);
+        *out_n = hdr + huf_n;
+    }
+    free(tmp);
+    return rc;
+}
+
+static int lzh_decode_with(const mfa_dict *d, const uint8_t *in, size_t n,
+                           uint8_t *out, size_t out_n) {
+    const uint8_t *p = in;
+    uint64_t lz_n;
+    uint8_t *tmp;
+    int rc;
+
+    if (get_varint(&p, in + n, &lz_n) || lz_n > lz_bound(out_n)) return -1;
+    tmp = (uint8_t *)malloc(lz_n ? (size_t)lz_n : 1);
+    if (!tmp) return -1;
+    rc = huf_decode(p, (size_t)(in + n - p), tmp, (size_t)lz_n);
+    if (rc == 0)
+        rc = lz_decode_hist(d ? d->bytes : NULL, d ? d->n : 0, tmp, (size_t)lz_n, out, out_n);
+    free(tmp);
+    return rc;
+}
+
+static int lzh_encode(const uint8_t *in, size_t n, uint8_t *out, size_t cap, size_t *out_n) {
+    return lzh_encode_with(NULL, in, n, out, cap, out_n);
+}
+
+static int lzh_decode(const uint8_t *in, size_t n, uint8_t *out, size_t out_n) {
+    return lzh_decode_with(NULL, in, n, out, out_n);
+}
+
+static int lzh_encode_dict(const mfa_dict *d, const uint8_t *in, size_t n,
+                           uint8_t *out, size_t cap, size_t *out_n) {
+    return lzh_encode_with(d, in, n, out, cap, out_n);
+}
+
+static int lzh_decode_dict(const mfa_dict *d, const uint8_t *in, size_t n,
+                           uint8_t *out, size_t out_n) {
+    return lzh_decode_with(d, in, n, out, out_n);
+}
+
+/* ============================================================
+   Registry
+   ============================================================ */
+
+static const mfa_codec codecs[] = {
+    { MFA_ALG_RAW, "raw", raw_bound, raw_encode, raw_decode, NULL, NULL },
+    { MFA_ALG_RLE, "rle", rle_bound, rle_encode, rle_decode, NULL, NULL },
+    { MFA_ALG_LZ,  "lz",  lz_bound,  lz_encode,  lz_decode,
+      lz_encode_dict, lz_decode_dict },
+    { MFA_ALG_HUF, "huf", huf_bound, huf_encode, huf_decode, NULL, NULL },
+    { MFA_ALG_LZH, "lzh", lzh_bound, lzh_encode, lzh_decode,
+      lzh_encode_dict, lzh_decode_dict }
+};
+
+const mfa_codec *mfa_codec_get(uint16_t id) {
+    size_t i;
+    for (i = 0; i < sizeof codecs / sizeof codecs[0]; ++i)
+        if (codecs[i].id == id) return &codecs[i];
+    return NULL;
+}
+
+const mfa_codec *mfa_codec_by_name(const char *name) {
+    size_t i;
+    if (!name) return NULL;
+    for (i = 0; i < sizeof codecs / sizeof codecs[0]; ++i)
+        if (strcmp(codecs[i].name, name) == 0) return &codecs[i];
+    return NULL;
+}
+
+/* ============================================================
+   Codec choice
+   ------------------------------------------------------------
+   The sample is PICK_SLICES slices of PICK_SLICE bytes spread
+   evenly over the input, so a header or a padded tail does not
+   decide for the whole entry. Order-0 entropy of random bytes
+   estimated over 8 KiB comes out just under 8 bits; PICK_RAW_BITS
+   leaves room for that bias and no more, since LZ can still find
+   repeats in data whose histogram looks flat. The Huffman codecs
+   decode slower than RLE or LZ alone, so they are only picked if
+   they save at least 1/PICK_HUF_GAIN of the better one's output.
+   ============================================================ */
+
+#define PICK_SLICE     2048u
+#define PICK_SLICES    4u
+#define PICK_SAMPLE    (PICK_SLICE * PICK_SLICES)
+#define PICK_MIN       4096u
+#define PICK_RAW_BITS  7.9
+#define PICK_HUF_GAIN  8u
+
+/* Order-0 entropy of p[0..n), in bits per byte. */
+static double byte_entropy(const uint8_t *p, size_t n) {
+    size_t hist[256];
+    double h = 0.0;
+    size_t i;
+
+    memset(hist, 0, sizeof hist);
+    for (i = 0; i < n; ++i) hist[p[i]]++;
+    for (i = 0; i < 256; ++i) {
+        if (hist[i]) {
+            double f = (double)hist[i] / (double)n;
+            h -= f * log(f);
+        }
+    }
+    return h / log(2.0);
+}
+
+uint16_t mfa_codec_pick(const uint8_t *p, size_t n) {
+    uint8_t sample[PICK_SAMPLE];
+    uint8_t *out;
+    size_t len, cap, rle_n, lz_n, huf_n, lzh_n, best, k;
+    uint16_t alg;
+
+    if (n < PICK_MIN) return MFA_ALG_LZ;
+
+    if (n <= PICK_SAMPLE) {
+        memcpy(sample, p, n);
+        len = n;
+    } else {
+        size_t step = (n - PICK_SLICE) / (PICK_SLICES - 1);
+        for (k = 0; k < PICK_SLICES; ++k)
+            memcpy(sample + k * PICK_SLICE, p + k * step, PICK_SLICE);
+        len = PICK_SAMPLE;
+    }
+    if (byte_entropy(sample, len) >= PICK_RAW_BITS) return MFA_ALG_RAW;
+
+    cap = rle_bound(len) > lzh_bound(len) ? rle_bound(len) : lzh_bound(len);
+    out = (uint8_t *)malloc(cap);
+    if (!out) return MFA_ALG_LZ;
+    if (rle_encode(sample, len, out, cap, &rle_n) != 0) rle_n = cap;
+    if (lz_encode(sample, len, out, cap, &lz_n) != 0) lz_n = cap;
+    if (huf_encode(sample, len, out, cap, &huf_n) != 0) huf_n = cap;
+    if (lzh_encode(sample, len, out, cap, &lzh_n) != 0) lzh_n = cap;
+    free(out);
+
+    alg  = rle_n <= lz_n ? MFA_ALG_RLE : MFA_ALG_LZ;
+    best = rle_n <= lz_n ? rle_n : lz_n;
+    if ((huf_n < lzh_n ? huf_n : lzh_n) < best - best / PICK_HUF_GAIN) {
+        alg  = huf_n < lzh_n ? MFA_ALG_HUF : MFA_ALG_LZH;
+        best = huf_n < lzh_n ? huf_n : lzh_n;
+    }
+    return best < len ? alg : MFA_ALG_RAW;
+}
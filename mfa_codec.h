@@ -0,0 +1,86 @@
+#ifndef MFA_CODEC_H
+#define MFA_CODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* ============================================================
+   Block codecs
+   ------------------------------------------------------------
+   Every codec turns one block of bytes into another and back.
+   The alg_id stored in each TOC entry selects the codec used
+   for that entry's blocks; ids are part of the file format and
+   must never be renumbered.
+   ============================================================ */
+
+enum {
+    MFA_ALG_RAW = 0,   /* stored as-is */
+    MFA_ALG_RLE = 1,   /* byte run-length */
+    MFA_ALG_LZ  = 2,   /* LZ77, 64 KiB window */
+    MFA_ALG_HUF = 3,   /* canonical Huffman, 4 interleaved streams */
+    MFA_ALG_LZH = 4    /* LZ77, then Huffman over its output */
+};
+
+/* A dictionary: bytes that codecs able to use one treat as history
+   just before every block, so that even a block's first bytes can
+   be coded as matches. Immutable once made; share it freely. */
+typedef struct mfa_dict mfa_dict;
+
+/* Largest dictionary: LZ offsets reach 64 KiB back, and the block's
+   own bytes take part of that. */
+#define MFA_DICT_MAX  (60u * 1024u)
+
+/* Copy p[0..n), n <= MFA_DICT_MAX, into a new dictionary; NULL if
+   out of memory. */
+mfa_dict *mfa_dict_new(const uint8_t *p, size_t n);
+void      mfa_dict_free(mfa_dict *d);
+
+typedef struct {
+    uint16_t    id;
+    const char *name;
+
+    /* Worst-case encoded size for n input bytes. */
+    size_t (*bound)(size_t n);
+
+    /* Encode in[0..n) into out (capacity cap, at least bound(n)).
+       Returns 0 and sets *out_n, or -1 on error. */
+    int (*encode)(const uint8_t *in, size_t n,
+                  uint8_t *out, size_t cap, size_t *out_n);
+
+    /* Decode in[0..n) into exactly out_n bytes.
+       Returns 0 on success, -1 on malformed input. */
+    int (*decode)(const uint8_t *in, size_t n,
+                  uint8_t *out, size_t out_n);
+
+    /* As encode/decode, with dictionary d as history; NULL for
+       codecs that have no use for one. Output of one pair is only
+       readable by the other, with the same dictionary. */
+    int (*encode_dict)(const mfa_dict *d, const uint8_t *in, size_t n,
+                       uint8_t *out, size_t cap, size_t *out_n);
+    int (*decode_dict)(const mfa_dict *d, const uint8_t *in, size_t n,
+                       uint8_t *out, size_t out_n);
+} mfa_codec;
+
+/* Look up a codec by alg_id / by name; NULL if unknown. */
+const mfa_codec *mfa_codec_get(uint16_t id);
+const mfa_codec *mfa_codec_by_name(const char *name);
+
+/* ============================================================
+   Codec choice
+   ------------------------------------------------------------
+   Picks a codec for data from a few KB sampled across it: data
+   whose byte histogram is near-uniform (already compressed or
+   encrypted) is stored raw without trying to code it; otherwise
+   the sample is trial-coded with RLE and LZ and the smaller
+   wins, RLE on a tie as it is the faster of the two. HUF or LZH
+   replaces it only when clearly smaller still, as they decode
+   slower. Inputs too short to sample get LZ.
+   ============================================================ */
+
+/* Not an alg_id: asks the packer to pick one per entry. */
+#define MFA_CODEC_AUTO  0xFFFFu
+
+/* The MFA_ALG_* to code p[0..n) with. */
+uint16_t mfa_codec_pick(const uint8_t *p, size_t n);
+
+#endif /* MFA_CODEC_H */
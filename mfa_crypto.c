@@ -0,0 +1,459 @@
+#include "mfa_crypto.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define MFA_HAVE_AVX2 1
+#endif
+
+static uint32_t ld32le(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+           ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void st32le(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)v;         p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16); p[3] = (uint8_t)(v >> 24);
+}
+
+static void st32be(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24); p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);  p[3] = (uint8_t)v;
+}
+
+/* ============================================================
+   ChaCha20
+   ------------------------------------------------------------
+   State words: 4 constants, 8 key words, block counter, then
+   3 nonce words. The scalar path makes one 64-byte block at a
+   time; the AVX2 path keeps word i of eight consecutive blocks
+   in one register and transposes back before XORing.
+   ============================================================ */
+
+#define ROTL32(x, r) (((x) << (r)) | ((x) >> (32 - (r))))
+#define QR(a, b, c, d)                          \
+    a += b; d ^= a; d = ROTL32(d, 16);          \
+    c += d; b ^= c; b = ROTL32(b, 12);          \
+    a += b; d ^= a; d = ROTL32(d, 8);           \
+    c += d; b ^= c; b = ROTL32(b, 7)
+
+static void chacha_init(uint32_t s[16], const uint8_t *key, const uint8_t *nonce,
+                        uint32_t counter) {
+    int i;
+    s[0] = 0x61707865u; s[1] = 0x3320646eu; s[2] = 0x79622d32u; s[3] = 0x6b206574u;
+    for (i = 0; i < 8; ++i) s[4 + i] = ld32le(key + 4 * i);
+    s[12] = counter;
+    for (i = 0; i < 3; ++i) s[13 + i] = ld32le(nonce + 4 * i);
+}
+
+static void chacha_block(const uint32_t s[16], uint8_t out[64]) {
+    uint32_t x[16];
+    int i;
+
+    memcpy(x, s, sizeof x);
+    for (i = 0; i < 10; ++i) {
+        QR(x[0], x[4], x[8],  x[12]);
+        QR(x[1], x[5], x[9],  x[13]);
+        QR(x[2], x[6], x[10], x[14]);
+        QR(x[3], x[7], x[11], x[15]);
+        QR(x[0], x[5], x[10], x[15]);
+        QR(x[1], x[6], x[11], x[12]);
+        QR(x[2], x[7], x[8],  x[13]);
+        QR(x[3], x[4], x[9],  x[14]);
+    }
+    for (i = 0; i < 16; ++i) st32le(out + 4 * i, x[i] + s[i]);
+}
+
+#if defined(MFA_HAVE_AVX2)
+
+#define V_ROTL(v, r) _mm256_or_si256(_mm256_slli_epi32(v, r), _mm256_srli_epi32(v, 32 - (r)))
+#define V_QR(a, b, c, d)                                                         \
+    a = _mm256_add_epi32(a, b); d = _mm256_shuffle_epi8(_mm256_xor_si256(d, a), rot16); \
+    c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c); b = V_ROTL(b, 12);         \
+    a = _mm256_add_epi32(a, b); d = _mm256_shuffle_epi8(_mm256_xor_si256(d, a), rot8);  \
+    c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c); b = V_ROTL(b, 7)
+
+/* Transpose 8 registers of 8 words: in[i] lane j -> out[j] lane i. */
+__attribute__((target("avx2")))
+static void transpose8(__m256i v[8]) {
+    __m256i t0 = _mm256_unpacklo_epi32(v[0], v[1]), t1 = _mm256_unpackhi_epi32(v[0], v[1]);
+    __m256i t2 = _mm256_unpacklo_epi32(v[2], v[3]), t3 = _mm256_unpackhi_epi32(v[2], v[3]);
+    __m256i t4 = _mm256_unpacklo_epi32(v[4], v[5]), t5 = _mm256_unpackhi_epi32(v[4], v[5]);
+    __m256i t6 = _mm256_unpacklo_epi32(v[6], v[7]), t7 = _mm256_unpackhi_epi32(v[6], v[7]);
+    __m256i u0 = _mm256_unpacklo_epi64(t0, t2), u1 = _mm256_unpackhi_epi64(t0, t2);
+    __m256i u2 = _mm256_unpacklo_epi64(t1, t3), u3 = _mm256_unpackhi_epi64(t1, t3);
+    __m256i u4 = _mm256_unpacklo_epi64(t4, t6), u5 = _mm256_unpackhi_epi64(t4, t6);
+    __m256i u6 = _mm256_unpacklo_epi64(t5, t7), u7 = _mm256_unpackhi_epi64(t5, t7);
+    v[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+    v[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+    v[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+    v[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+    v[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+    v[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+    v[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+    v[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+}
+
+/* XOR whole 512-byte groups; returns the bytes consumed. s[12] is
+   advanced past the blocks used. */
+__attribute__((target("avx2")))
+static size_t chacha_xor_avx2(uint32_t s[16], const uint8_t *in, uint8_t *out, size_t n) {
+    const __m256i rot16 = _mm256_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+                                           2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+    const __m256i rot8  = _mm256_setr_epi8(3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14,
+                                           3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14);
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    size_t done = 0;
+
+    while (n - done >= 512) {
+        __m256i x[16], o[16];
+        int i, j;
+
+        for (i = 0; i < 16; ++i) o[i] = _mm256_set1_epi32((int)s[i]);
+        o[12] = _mm256_add_epi32(o[12], lanes);
+        for (i = 0; i < 16; ++i) x[i] = o[i];
+
+        for (i = 0; i < 10; ++i) {
+            V_QR(x[0], x[4], x[8],  x[12]);
+            V_QR(x[1], x[5], x[9],  x[13]);
+            V_QR(x[2], x[6], x[10], x[14]);
+            V_QR(x[3], x[7], x[11], x[15]);
+            V_QR(x[0], x[5], x[10], x[15]);
+            V_QR(x[1], x[6], x[11], x[12]);
+            V_QR(x[2], x[7], x[8],  x[13]);
+            V_QR(x[3], x[4], x[9],  x[14]);
+        }
+        for (i = 0; i < 16; ++i) x[i] = _mm256_add_epi32(x[i], o[i]);
+
+        /* x[0..7] -> words 0-7 of blocks 0..7, likewise x[8..15]. */
+        transpose8(x);
+        transpose8(x + 8);
+        for (j = 0; j < 8; ++j) {
+            const uint8_t *src = in + done + 64 * (size_t)j;
+            uint8_t *dst = out + done + 64 * (size_t)j;
+            __m256i lo = _mm256_loadu_si256((const __m256i *)src);
+            __m256i hi = _mm256_loadu_si256((const __m256i *)(src + 32));
+            _mm256_storeu_si256((__m256i *)dst, _mm256_xor_si256(lo, x[j]));
+            _mm256_storeu_si256((__m256i *)(dst + 32), _mm256_xor_si256(hi, x[8 + j]));
+        }
+
+        s[12] += 8;
+        done += 512;
+    }
+    return done;
+}
+
+#endif /* MFA_HAVE_AVX2 */
+
+void mfa_chacha20_xor(const uint8_t key[MFA_KEY_LEN], const uint8_t nonce[MFA_NONCE_LEN],
+                      uint32_t counter, const uint8_t *in, uint8_t *out, size_t n) {
+    uint32_t s[16];
+    uint8_t ks[64];
+    size_t i;
+
+    chacha_init(s, key, nonce, counter);
+
+#if defined(MFA_HAVE_AVX2)
+    if (n >= 512 && __builtin_cpu_supports("avx2")) {
+        size_t done = chacha_xor_avx2(s, in, out, n);
+        in += done; out += done; n -= done;
+    }
+#endif
+
+    while (n) {
+        size_t k = n < 64 ? n : 64;
+        chacha_block(s, ks);
+        for (i = 0; i < k; ++i) out[i] = in[i] ^ ks[i];
+        ++s[12];
+        in += k; out += k; n -= k;
+    }
+}
+
+/* ============================================================
+   Poly1305
+   ------------------------------------------------------------
+   The accumulator and r are kept in five 26-bit limbs so every
+   product fits a 64-bit word; reduction mod 2^130 - 5 folds the
+   carry out of the top limb back in times five.
+   ============================================================ */
+
+#define LIMB 0x3ffffffu
+
+static void poly_blocks(mfa_poly1305 *st, const uint8_t *m, size_t n, uint32_t hibit) {
+    const uint32_t r0 = st->r[0], r1 = st->r[1], r2 = st->r[2], r3 = st->r[3], r4 = st->r[4];
+    const uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+    uint32_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2], h3 = st->h[3], h4 = st->h[4];
+    uint64_t d0, d1, d2, d3, d4;
+    uint32_t c;
+
+    for (; n >= 16; m += 16, n -= 16) {
+        h0 += ld32le(m) & LIMB;
+        h1 += (ld32le(m + 3) >> 2) & LIMB;
+        h2 += (ld32le(m + 6) >> 4) & LIMB;
+        h3 += (ld32le(m + 9) >> 6) & LIMB;
+        h4 += (ld32le(m + 12) >> 8) | hibit;
+
+        d0 = (uint64_t)h0 * r0 + (uint64_t)h1 * s4 + (uint64_t)h2 * s3 + (uint64_t)h3 * s2 + (uint64_t)h4 * s1;
+        d1 = (uint64_t)h0 * r1 + (uint64_t)h1 * r0 + (uint64_t)h2 * s4 + (uint64_t)h3 * s3 + (uint64_t)h4 * s2;
+        d2 = (uint64_t)h0 * r2 + (uint64_t)h1 * r1 + (uint64_t)h2 * r0 + (uint64_t)h3 * s4 + (uint64_t)h4 * s3;
+        d3 = (uint64_t)h0 * r3 + (uint64_t)h1 * r2 + (uint64_t)h2 * r1 + (uint64_t)h3 * r0 + (uint64_t)h4 * s4;
+        d4 = (uint64_t)h0 * r4 + (uint64_t)h1 * r3 + (uint64_t)h2 * r2 + (uint64_t)h3 * r1 + (uint64_t)h4 * r0;
+
+        c = (uint32_t)(d0 >> 26); h0 = (uint32_t)d0 & LIMB;
+        d1 += c; c = (uint32_t)(d1 >> 26); h1 = (uint32_t)d1 & LIMB;
+        d2 += c; c = (uint32_t)(d2 >> 26); h2 = (uint32_t)d2 & LIMB;
+        d3 += c; c = (uint32_t)(d3 >> 26); h3 = (uint32_t)d3 & LIMB;
+        d4 += c; c = (uint32_t)(d4 >> 26); h4 = (uint32_t)d4 & LIMB;
+        h0 += c * 5; c = h0 >> 26; h0 &= LIMB;
+        h1 += c;
+    }
+    st->h[0] = h0; st->h[1] = h1; st->h[2] = h2; st->h[3] = h3; st->h[4] = h4;
+}
+
+void mfa_poly1305_init(mfa_poly1305 *st, const uint8_t key[32]) {
+    int i;
+
+    /* r is clamped as the RFC requires */
+    st->r[0] = ld32le(key) & 0x3ffffffu;
+    st->r[1] = (ld32le(key + 3) >> 2) & 0x3ffff03u;
+    st->r[2] = (ld32le(key + 6) >> 4) & 0x3ffc0ffu;
+    st->r[3] = (ld32le(key + 9) >> 6) & 0x3f03fffu;
+    st->r[4] = (ld32le(key + 12) >> 8) & 0x00fffffu;
+    for (i = 0; i < 5; ++i) st->h[i] = 0;
+    for (i = 0; i < 4; ++i) st->pad[i] = ld32le(key + 16 + 4 * i);
+    st->len = 0;
+}
+
+void mfa_poly1305_update(mfa_poly1305 *st, const void *data, size_t n) {
+    const uint8_t *m = (const uint8_t *)data;
+
+    if (st->len) {
+        size_t k = 16 - st->len < n ? 16 - st->len : n;
+        memcpy(st->buf + st->len, m, k);
+        st->len += k; m += k; n -= k;
+        if (st->len < 16) return;
+        poly_blocks(st, st->buf, 16, 1u << 24);
+        st->len = 0;
+    }
+    if (n >= 16) {
+        size_t whole = n & ~(size_t)15;
+        poly_blocks(st, m, whole, 1u << 24);
+        m += whole; n -= whole;
+    }
+    memcpy(st->buf, m, n);
+    st->len = n;
+}
+
+void mfa_poly1305_final(mfa_poly1305 *st, uint8_t tag[MFA_TAG_LEN]) {
+    uint32_t h0, h1, h2, h3, h4, g0, g1, g2, g3, g4, c, mask;
+    uint64_t f;
+
+    if (st->len) {
+        /* A short last block is padded with 1 then zeros, and
+           carries no 2^128 bit */
+        st->buf[st->len++] = 1;
+        memset(st->buf + st->len, 0, 16 - st->len);
+        poly_blocks(st, st->buf, 16, 0);
+    }
+    h0 = st->h[0]; h1 = st->h[1]; h2 = st->h[2]; h3 = st->h[3]; h4 = st->h[4];
+
+    c = h1 >> 26; h1 &= LIMB;
+    h2 += c; c = h2 >> 26; h2 &= LIMB;
+    h3 += c; c = h3 >> 26; h3 &= LIMB;
+    h4 += c; c = h4 >> 26; h4 &= LIMB;
+    h0 += c * 5; c = h0 >> 26; h0 &= LIMB;
+    h1 += c;
+
+    /* h - p, kept instead of h unless it went negative */
+    g0 = h0 + 5; c = g0 >> 26; g0 &= LIMB;
+    g1 = h1 + c; c = g1 >> 26; g1 &= LIMB;
+    g2 = h2 + c; c = g2 >> 26; g2 &= LIMB;
+    g3 = h3 + c; c = g3 >> 26; g3 &= LIMB;
+    g4 = h4 + c - (1u << 26);
+    mask = (g4 >> 31) - 1;
+    h0 = (h0 & ~mask) | (g0 & mask);
+    h1 = (h1 & ~mask) | (g1 & mask);
+    h2 = (h2 & ~mask) | (g2 & mask);
+    h3 = (h3 & ~mask) | (g3 & mask);
+    h4 = (h4 & ~mask) | (g4 & mask);
+
+    h0 = h0 | (h1 << 26);
+    h1 = (h1 >> 6) | (h2 << 20);
+    h2 = (h2 >> 12) | (h3 << 14);
+    h3 = (h3 >> 18) | (h4 << 8);
+
+    f = (uint64_t)h0 + st->pad[0];             st32le(tag, (uint32_t)f);
+    f = (uint64_t)h1 + st->pad[1] + (f >> 32); st32le(tag + 4, (uint32_t)f);
+    f = (uint64_t)h2 + st->pad[2] + (f >> 32); st32le(tag + 8, (uint32_t)f);
+    f = (uint64_t)h3 + st->pad[3] + (f >> 32); st32le(tag + 12, (uint32_t)f);
+    memset(st, 0, sizeof *st);
+}
+
+/* ============================================================
+   SHA-256, HMAC, PBKDF2
+   ============================================================ */
+
+typedef struct {
+    uint32_t h[8];
+    uint64_t total;
+    uint8_t  buf[64];
+    size_t   len;
+} sha256_ctx;
+
+static const uint32_t K256[64] = {
+    0x428a2f98u, 0x71374491u, 0xb5c0fbcfu, 0xe9b5dba5u, 0x3956c25bu, 0x59f111f1u, 0x923f82a4u, 0xab1c5ed5u,
+    0xd807aa98u, 0x12835b01u, 0x243185beu, 0x550c7dc3u, 0x72be5d74u, 0x80deb1feu, 0x9bdc06a7u, 0xc19bf174u,
+    0xe49b69c1u, 0xefbe4786u, 0x0fc19dc6u, 0x240ca1ccu, 0x2de92c6fu, 0x4a7484aau, 0x5cb0a9dcu, 0x76f988dau,
+    0x983e5152u, 0xa831c66du, 0xb00327c8u, 0xbf597fc7u, 0xc6e00bf3u, 0xd5a79147u, 0x06ca6351u, 0x14292967u,
+    0x27b70a85u, 0x2e1b2138u, 0x4d2c6dfcu, 0x53380d13u, 0x650a7354u, 0x766a0abbu, 0x81c2c92eu, 0x92722c85u,
+    0xa2bfe8a1u, 0xa81a664bu, 0xc24b8b70u, 0xc76c51a3u, 0xd192e819u, 0xd6990624u, 0xf40e3585u, 0x106aa070u,
+    0x19a4c116u, 0x1e376c08u, 0x2748774cu, 0x34b0bcb5u, 0x391c0cb3u, 0x4ed8aa4au, 0x5b9cca4fu, 0x682e6ff3u,
+    0x748f82eeu, 0x78a5636fu, 0x84c87814u, 0x8cc70208u, 0x90befffau, 0xa4506cebu, 0xbef9a3f7u, 0xc67178f2u
+};
+
+#define ROTR32(x, r) (((x) >> (r)) | ((x) << (32 - (r))))
+
+static void sha256_compress(uint32_t h[8], const uint8_t *p) {
+    uint32_t w[64], a, b, c, d, e, f, g, hh;
+    int i;
+
+    for (i = 0; i < 16; ++i)
+        w[i] = ((uint32_t)p[4 * i] << 24) | ((uint32_t)p[4 * i + 1] << 16) |
+               ((uint32_t)p[4 * i + 2] << 8) | (uint32_t)p[4 * i + 3];
+    for (i = 16; i < 64; ++i) {
+        uint32_t s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4]; f = h[5]; g = h[6]; hh = h[7];
+    for (i = 0; i < 64; ++i) {
+        uint32_t t1 = hh + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) +
+                      ((e & f) ^ (~e & g)) + K256[i] + w[i];
+        uint32_t t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) +
+                      ((a & b) ^ (a & c) ^ (b & c));
+        hh = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+    h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+}
+
+static void sha256_init(sha256_ctx *c) {
+    static const uint32_t iv[8] = {
+        0x6a09e667u, 0xbb67ae85u, 0x3c6ef372u, 0xa54ff53au,
+        0x510e527fu, 0x9b05688cu, 0x1f83d9abu, 0x5be0cd19u
+    };
+    memcpy(c->h, iv, sizeof iv);
+    c->total = 0;
+    c->len = 0;
+}
+
+static void sha256_update(sha256_ctx *c, const void *data, size_t n) {
+    const uint8_t *p = (const uint8_t *)data;
+    c->total += n;
+    while (n) {
+        size_t k = 64 - c->len;
+        if (k > n) k = n;
+        memcpy(c->buf + c->len, p, k);
+        c->len += k; p += k; n -= k;
+        if (c->len == 64) { sha256_compress(c->h, c->buf); c->len = 0; }
+    }
+}
+
+static void sha256_final(sha256_ctx *c, uint8_t out[32]) {
+    uint64_t bits = c->total * 8;
+    uint8_t pad = 0x80, zero = 0, len[8];
+    int i;
+
+    sha256_update(c, &pad, 1);
+    while (c->len != 56) sha256_update(c, &zero, 1);
+    for (i = 0; i < 8; ++i) len[i] = (uint8_t)(bits >> (56 - 8 * i));
+    sha256_update(c, len, 8);
+    for (i = 0; i < 8; ++i) st32be(out + 4 * i, c->h[i]);
+}
+
+void mfa_sha256(const void *data, size_t n, uint8_t out[32]) {
+    sha256_ctx c;
+    sha256_init(&c);
+    sha256_update(&c, data, n);
+    sha256_final(&c, out);
+}
+
+/* HMAC-SHA256 with the key pads absorbed up front, so PBKDF2's
+   inner loop costs two compressions per iteration. */
+typedef struct {
+    sha256_ctx inner, outer;
+} hmac_ctx;
+
+static void hmac_init(hmac_ctx *m, const void *key, size_t key_len) {
+    uint8_t k[64], pad[64];
+    int i;
+
+    memset(k, 0, sizeof k);
+    if (key_len > 64) mfa_sha256(key, key_len, k);
+    else if (key_len) memcpy(k, key, key_len);
+
+    for (i = 0; i < 64; ++i) pad[i] = (uint8_t)(k[i] ^ 0x36);
+    sha256_init(&m->inner);
+    sha256_update(&m->inner, pad, 64);
+    for (i = 0; i < 64; ++i) pad[i] = (uint8_t)(k[i] ^ 0x5c);
+    sha256_init(&m->outer);
+    sha256_update(&m->outer, pad, 64);
+}
+
+static void hmac_run(const hmac_ctx *m, const void *msg, size_t n, uint8_t out[32]) {
+    sha256_ctx c = m->inner;
+    uint8_t ih[32];
+    sha256_update(&c, msg, n);
+    sha256_final(&c, ih);
+    c = m->outer;
+    sha256_update(&c, ih, 32);
+    sha256_final(&c, out);
+}
+
+void mfa_pbkdf2_sha256(const void *pass, size_t pass_len,
+                       const uint8_t *salt, size_t salt_len,
+                       uint32_t iterations, uint8_t *out, size_t out_len) {
+    hmac_ctx m;
+    uint32_t block = 1;
+
+    hmac_init(&m, pass, pass_len);
+    while (out_len) {
+        sha256_ctx c = m.inner;
+        uint8_t u[32], t[32], ib[4], ih[32];
+        uint32_t it;
+        size_t k, i;
+
+        /* U1 = HMAC(P, S || INT(block)) */
+        st32be(ib, block);
+        sha256_update(&c, salt, salt_len);
+        sha256_update(&c, ib, 4);
+        sha256_final(&c, ih);
+        c = m.outer;
+        sha256_update(&c, ih, 32);
+        sha256_final(&c, u);
+        memcpy(t, u, 32);
+
+        for (it = 1; it < iterations; ++it) {
+            hmac_run(&m, u, 32, u);
+            for (i = 0; i < 32; ++i) t[i] ^= u[i];
+        }
+
+        k = out_len < 32 ? out_len : 32;
+        memcpy(out, t, k);
+        out += k; out_len -= k;
+        ++block;
+    }
+}
+
+int mfa_random_bytes(void *buf, size_t n) {
+    FILE *f = fopen("/dev/urandom", "rb");
+    size_t got;
+    if (!f) { perror("/dev/urandom"); return -1; }
+    got = fread(buf, 1, n, f);
+    fclose(f);
+    return got == n ? 0 : -1;
+}
@@ -0,0 +1,51 @@
+#ifndef MFA_CRYPTO_H
+#define MFA_CRYPTO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* ============================================================
+   Encryption primitives
+   ------------------------------------------------------------
+   ChaCha20 (RFC 8439) for entry data, with an AVX2 kernel that
+   produces eight blocks of keystream per step when the CPU has
+   it, Poly1305 (also RFC 8439) to authenticate what it hides,
+   and PBKDF2-HMAC-SHA256 to turn a passphrase into a key. The
+   cipher provides confidentiality only; each encrypted entry's
+   integrity comes from a Poly1305 tag of its contents under a
+   one-time key drawn from the keystream, and the TOC's and
+   extension area's from one more such tag.
+   ============================================================ */
+
+#define MFA_KEY_LEN   32u
+#define MFA_NONCE_LEN 12u
+#define MFA_TAG_LEN   16u
+
+/* out[i] = in[i] ^ keystream(key, nonce) starting at 64-byte block
+   `counter`. in and out may be the same buffer. */
+void mfa_chacha20_xor(const uint8_t key[MFA_KEY_LEN], const uint8_t nonce[MFA_NONCE_LEN],
+                      uint32_t counter, const uint8_t *in, uint8_t *out, size_t n);
+
+/* Poly1305 state; the key must never authenticate two messages. */
+typedef struct {
+    uint32_t r[5], h[5], pad[4];
+    uint8_t  buf[16];
+    size_t   len;
+} mfa_poly1305;
+
+void mfa_poly1305_init(mfa_poly1305 *st, const uint8_t key[32]);
+void mfa_poly1305_update(mfa_poly1305 *st, const void *data, size_t n);
+void mfa_poly1305_final(mfa_poly1305 *st, uint8_t tag[MFA_TAG_LEN]);
+
+/* SHA-256 of data[0..n). */
+void mfa_sha256(const void *data, size_t n, uint8_t out[32]);
+
+/* PBKDF2 with HMAC-SHA256 (RFC 8018), out_len bytes of key. */
+void mfa_pbkdf2_sha256(const void *pass, size_t pass_len,
+                       const uint8_t *salt, size_t salt_len,
+                       uint32_t iterations, uint8_t *out, size_t out_len);
+
+/* Fill buf with n bytes from the system CSPRNG; 0 or -1. */
+int mfa_random_bytes(void *buf, size_t n);
+
+#endif /* MFA_CRYPTO_H */
@@ -0,0 +1,252 @@
+#include "mfa_filter.h"
+
+#include <math.h>
+#include <string.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define MFA_HAVE_AVX2 1
+#endif
+
+#define DELTA_MIN      4096u         /* shorter inputs are left alone */
+#define DELTA_WINDOW   (32u * 1024u) /* bytes judged, from mid-input */
+#define DELTA_PERIOD   256u          /* longest record period sought */
+#define DELTA_PROBES   1024u         /* positions the period is sought at */
+#define DELTA_SMALL    4u            /* strides 1..DELTA_SMALL always tried */
+#define DELTA_GAIN     0.5           /* bits per byte the filter must save */
+
+#define LANE_HI  0x8080808080808080ULL
+#define LANE_LO  0x7F7F7F7F7F7F7F7FULL
+
+/* Words are loaded in native byte order; only lane order within a
+   word, which decoding short strides depends on, differs. */
+static uint64_t ld64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static void st64(uint8_t *p, uint64_t v) {
+    memcpy(p, &v, 8);
+}
+
+static int little_endian(void) {
+    const uint16_t one = 1;
+    return *(const uint8_t *)&one;
+}
+
+/* Bytewise a + b and a - b, mod 256 in each lane. */
+static uint64_t lanes_add(uint64_t a, uint64_t b) {
+    return ((a & LANE_LO) + (b & LANE_LO)) ^ ((a ^ b) & LANE_HI);
+}
+
+static uint64_t lanes_sub(uint64_t a, uint64_t b) {
+    return ((a | LANE_HI) - (b & LANE_LO)) ^ ((a ^ ~b) & LANE_HI);
+}
+
+#if defined(MFA_HAVE_AVX2)
+
+/* Encode from i on, 32 bytes at a time; returns where it stopped. */
+__attribute__((target("avx2")))
+static size_t encode_avx2(const uint8_t *in, uint8_t *out, size_t i, size_t n, unsigned stride) {
+    for (; i + 32 <= n; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(in + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(in + i - stride));
+        _mm256_storeu_si256((__m256i *)(out + i), _mm256_sub_epi8(a, b));
+    }
+    return i;
+}
+
+/* Decode from i on; returns where it stopped. A stride of 16 or
+   more reaches back past the whole vector, so it is added as is.
+   Shorter ones run the SWAR prefix sum on 16 lanes, pshufb doing
+   the byte shifts a variable count allows. */
+__attribute__((target("avx2")))
+static size_t decode_avx2(uint8_t *p, size_t i, size_t n, unsigned stride) {
+    if (stride >= 32) {
+        for (; i + 32 <= n; i += 32) {
+            __m256i a = _mm256_loadu_si256((const __m256i *)(p + i));
+            __m256i b = _mm256_loadu_si256((const __m256i *)(p + i - stride));
+            _mm256_storeu_si256((__m256i *)(p + i), _mm256_add_epi8(a, b));
+        }
+    } else if (stride >= 16) {
+        for (; i + 16 <= n; i += 16) {
+            __m128i a = _mm_loadu_si128((const __m128i *)(p + i));
+            __m128i b = _mm_loadu_si128((const __m128i *)(p + i - stride));
+            _mm_storeu_si128((__m128i *)(p + i), _mm_add_epi8(a, b));
+        }
+    } else {
+        uint8_t ctl[5][16];
+        __m128i up[4], down, w, prev;
+        unsigned d, k, steps = 0;
+
+        for (; i < 16 && i < n; ++i) p[i] = (uint8_t)(p[i] + p[i - stride]);
+        if (i + 16 > n) return i;
+
+        /* down: the previous vector's last stride bytes to lanes
+           under stride; up[k]: every lane 2^k * stride higher */
+        for (k = 0; k < 16; ++k) ctl[0][k] = (uint8_t)(k < stride ? 16 - stride + k : 0x80);
+        for (d = stride; d < 16; d *= 2, ++steps)
+            for (k = 0; k < 16; ++k) ctl[steps + 1][k] = (uint8_t)(k >= d ? k - d : 0x80);
+        down = _mm_loadu_si128((const __m128i *)ctl[0]);
+        for (k = 0; k < steps; ++k) up[k] = _mm_loadu_si128((const __m128i *)ctl[k + 1]);
+
+        prev = _mm_loadu_si128((const __m128i *)(p + i - 16));
+        for (; i + 16 <= n; i += 16) {
+            w = _mm_add_epi8(_mm_loadu_si128((const __m128i *)(p + i)), _mm_shuffle_epi8(prev, down));
+            for (k = 0; k < steps; ++k) w = _mm_add_epi8(w, _mm_shuffle_epi8(w, up[k]));
+            _mm_storeu_si128((__m128i *)(p + i), w);
+            prev = w;
+        }
+    }
+    return i;
+}
+
+#endif /* MFA_HAVE_AVX2 */
+
+void mfa_delta_encode(const uint8_t *in, uint8_t *out, size_t n, unsigned stride) {
+    size_t i = stride < n ? stride : n;
+
+    memcpy(out, in, i);
+#if defined(MFA_HAVE_AVX2)
+    if (n - i >= 64 && __builtin_cpu_supports("avx2")) i = encode_avx2(in, out, i, n, stride);
+#endif
+    for (; i + 8 <= n; i += 8)
+        st64(out + i, lanes_sub(ld64(in + i), ld64(in + i - stride)));
+    for (; i < n; ++i)
+        out[i] = (uint8_t)(in[i] - in[i - stride]);
+}
+
+void mfa_delta_decode(uint8_t *p, size_t n, unsigned stride) {
+    size_t i = stride;
+
+#if defined(MFA_HAVE_AVX2)
+    if (n >= (size_t)stride + 64 && __builtin_cpu_supports("avx2")) i = decode_avx2(p, i, n, stride);
+#endif
+    if (stride >= 8) {
+        /* The word a stride back is already decoded whole */
+        for (; i + 8 <= n; i += 8)
+            st64(p + i, lanes_add(ld64(p + i), ld64(p + i - stride)));
+    } else if (little_endian()) {
+        unsigned shift = 8 * (8 - stride);
+
+        for (; i < 8 && i < n; ++i) p[i] = (uint8_t)(p[i] + p[i - stride]);
+        for (; i + 8 <= n; i += 8) {
+            /* Lanes under stride take the previous word's last
+               stride bytes, then each lane adds the one stride
+               below it, doubling the reach each step */
+            uint64_t w = lanes_add(ld64(p + i), ld64(p + i - 8) >> shift);
+            unsigned d;
+            for (d = stride; d < 8; d *= 2) w = lanes_add(w, w << (8 * d));
+            st64(p + i, w);
+        }
+    } else {
+        unsigned shift = 8 * (8 - stride);
+
+        for (; i < 8 && i < n; ++i) p[i] = (uint8_t)(p[i] + p[i - stride]);
+        for (; i + 8 <= n; i += 8) {
+            uint64_t w = lanes_add(ld64(p + i), ld64(p + i - 8) << shift);
+            unsigned d;
+            for (d = stride; d < 8; d *= 2) w = lanes_add(w, w >> (8 * d));
+            st64(p + i, w);
+        }
+    }
+    for (; i < n; ++i) p[i] = (uint8_t)(p[i] + p[i - stride]);
+}
+
+/* ============================================================
+   Stride detection
+   ------------------------------------------------------------
+   Candidates are judged over a window from the middle of the
+   input, away from headers, by the order-0 entropy of the bytes
+   they would leave. That is a cheap stand-in for a trial coding:
+   LZ and Huffman both gain from a sharper byte histogram, and
+   text and code, which delta filtering only spoils, come out
+   worse filtered than not.
+   ============================================================ */
+
+/* Order-0 entropy, in bits per byte, of p[s..n) less p[0..n-s)
+   (of p[0..n) itself for s == 0). */
+static double delta_entropy(const uint8_t *p, size_t n, size_t s) {
+    size_t hist[256];
+    double h = 0.0;
+    size_t i;
+
+    memset(hist, 0, sizeof hist);
+    if (s) for (i = s; i < n; ++i) hist[(uint8_t)(p[i] - p[i - s])]++;
+    else   for (i = 0; i < n; ++i) hist[p[i]]++;
+    for (i = 0; i < 256; ++i) {
+        if (hist[i]) {
+            double f = (double)hist[i] / (double)(n - s);
+            h -= f * log(f);
+        }
+    }
+    return h / log(2.0);
+}
+
+/* The period, above DELTA_SMALL, at which p[0..n) repeats a byte
+   exactly most often; 0 if n is too short to tell. Multiples of a
+   record's length can score a little higher than the length
+   itself, so the shortest period within 1/16 of the best wins. */
+static unsigned record_period(const uint8_t *p, size_t n) {
+    size_t hits[DELTA_PERIOD + 1], i, most = 0;
+    unsigned s;
+
+    if (n < DELTA_PERIOD + DELTA_PROBES) return 0;
+    p += DELTA_PERIOD;
+    for (s = DELTA_SMALL + 1; s <= DELTA_PERIOD; ++s) {
+        hits[s] = 0;
+        for (i = 0; i < DELTA_PROBES; ++i) hits[s] += p[i] == p[i - s];
+        if (hits[s] > most) most = hits[s];
+    }
+    if (!most) return 0;
+    for (s = DELTA_SMALL + 1; hits[s] < most - most / 16; ++s) {}
+    return s;
+}
+
+static uint32_t ld32le(const uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/* Pixel and row sizes, in bytes, of an uncompressed BMP of 8 bits
+   or more per pixel starting at p; 0 if it is not one. */
+static int bmp_strides(const uint8_t *p, size_t n, unsigned *pixel, unsigned *row) {
+    uint32_t dib, width, bpp, comp;
+
+    if (n < 54 || p[0] != 'B' || p[1] != 'M') return 0;
+    dib   = ld32le(p + 14);
+    width = ld32le(p + 18);
+    bpp   = (uint32_t)p[28] | (uint32_t)p[29] << 8;
+    comp  = ld32le(p + 30);
+    if (dib < 40 || (comp != 0 && comp != 3) || bpp % 8 || bpp < 8 || bpp > 32) return 0;
+    if (!width || width > MFA_DELTA_MAX) return 0;
+    *pixel = bpp / 8;
+    *row   = ((width * bpp + 31) / 32) * 4;
+    return 1;
+}
+
+unsigned mfa_delta_detect(const uint8_t *p, size_t n) {
+    unsigned cand[DELTA_SMALL + 3];
+    unsigned k, nc = 0, best = 0;
+    const uint8_t *w;
+    size_t wn;
+    double h, best_h;
+
+    if (n < DELTA_MIN) return 0;
+    for (k = 1; k <= DELTA_SMALL; ++k) cand[nc++] = k;
+    if (bmp_strides(p, n, &cand[nc], &cand[nc + 1])) nc += 2;
+
+    wn = n < DELTA_WINDOW ? n : DELTA_WINDOW;
+    w  = p + (n - wn) / 2;
+    cand[nc] = record_period(w, wn);
+    if (cand[nc]) ++nc;
+
+    best_h = delta_entropy(w, wn, 0) - DELTA_GAIN;
+    for (k = 0; k < nc; ++k) {
+        /* Strides too long for the window cannot be judged */
+        if (cand[k] > MFA_DELTA_MAX || cand[k] > wn / 2) continue;
+        h = delta_entropy(w, wn, cand[k]);
+        if (h < best_h) { best_h = h; best = cand[k]; }
+    }
+    return best;
+}
@@ -0,0 +1,42 @@
+#ifndef MFA_FILTER_H
+#define MFA_FILTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* ============================================================
+   Delta filter
+   ------------------------------------------------------------
+   In a bitmap or a table of fixed-width records a byte seldom
+   repeats what came before it, so LZ finds little, yet it is
+   usually close to the byte one pixel, row or record earlier.
+   Storing each byte as its difference from the byte `stride`
+   positions back turns that into runs of small values, which
+   the codecs code well. The filter is applied to each block on
+   its own: its first stride bytes stay as they are.
+
+   Both directions go a 64-bit word at a time, eight byte lanes
+   added or subtracted without carries between them, or with
+   AVX2 registers where the CPU has it. Decoding a stride shorter
+   than the word or register, where lanes depend on each other,
+   runs a prefix sum across it in log2(lanes / stride) steps.
+   ============================================================ */
+
+/* Largest stride (it is stored in 16 bits). */
+#define MFA_DELTA_MAX  0xFFFFu
+
+/* Stride to filter p[0..n) with, or 0 to leave it alone. The
+   candidates are the pixel and row sizes an uncompressed BMP
+   header gives, small strides and the period of any fixed-width
+   records; the one whose filtered bytes have the lowest order-0
+   entropy wins if it saves enough over the bytes as they are. */
+unsigned mfa_delta_detect(const uint8_t *p, size_t n);
+
+/* out[i] = in[i] - in[i - stride], in[i] for i < stride. in and
+   out must not overlap. */
+void mfa_delta_encode(const uint8_t *in, uint8_t *out, size_t n, unsigned stride);
+
+/* Undo mfa_delta_encode, in place. */
+void mfa_delta_decode(uint8_t *p, size_t n, unsigned stride);
+
+#endif /* MFA_FILTER_H */
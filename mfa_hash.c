@@ -0,0 +1,179 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "mfa_hash.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <nmmintrin.h>
+#define MFA_HAVE_SSE42_CRC 1
+#endif
+
+/* ============================================================
+   MurmurHash3 x64_128
+   ------------------------------------------------------------
+   Same digest as the reference one-shot function: blocks are
+   read little-endian, and the final partial block is mixed in
+   by mfa_murmur3_final().
+   ============================================================ */
+
+#define C1 0x87c37b91114253d5ULL
+#define C2 0x4cf5ad432745937fULL
+
+static uint64_t rotl64(uint64_t x, unsigned r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t fmix64(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+static uint64_t ld64le(const uint8_t *p) {
+    return  (uint64_t)p[0]        | ((uint64_t)p[1] << 8)  |
+           ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+           ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) |
+           ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+static void mix_block(mfa_murmur3 *s, const uint8_t *b) {
+    uint64_t k1 = ld64le(b), k2 = ld64le(b + 8);
+
+    k1 *= C1; k1 = rotl64(k1, 31); k1 *= C2; s->h1 ^= k1;
+    s->h1 = rotl64(s->h1, 27); s->h1 += s->h2; s->h1 = s->h1 * 5 + 0x52dce729;
+
+    k2 *= C2; k2 = rotl64(k2, 33); k2 *= C1; s->h2 ^= k2;
+    s->h2 = rotl64(s->h2, 31); s->h2 += s->h1; s->h2 = s->h2 * 5 + 0x38495ab5;
+}
+
+void mfa_murmur3_init(mfa_murmur3 *s, uint64_t seed) {
+    memset(s, 0, sizeof *s);
+    s->h1 = seed;
+    s->h2 = seed;
+}
+
+void mfa_murmur3_update(mfa_murmur3 *s, const void *data, size_t n) {
+    const uint8_t *p = (const uint8_t *)data;
+
+    s->total += n;
+    if (s->tail_len) {
+        size_t take = 16 - s->tail_len;
+        if (take > n) take = n;
+        memcpy(s->tail + s->tail_len, p, take);
+        s->tail_len += take;
+        p += take; n -= take;
+        if (s->tail_len < 16) return;
+        mix_block(s, s->tail);
+        s->tail_len = 0;
+    }
+    for (; n >= 16; p += 16, n -= 16) mix_block(s, p);
+    memcpy(s->tail, p, n);
+    s->tail_len = n;
+}
+
+void mfa_murmur3_final(mfa_murmur3 *s, uint64_t out[2]) {
+    uint64_t k1 = 0, k2 = 0;
+    const uint8_t *t = s->tail;
+    uint64_t h1 = s->h1, h2 = s->h2;
+
+    switch (s->tail_len) {
+    case 15: k2 ^= (uint64_t)t[14] << 48; /* fall through */
+    case 14: k2 ^= (uint64_t)t[13] << 40; /* fall through */
+    case 13: k2 ^= (uint64_t)t[12] << 32; /* fall through */
+    case 12: k2 ^= (uint64_t)t[11] << 24; /* fall through */
+    case 11: k2 ^= (uint64_t)t[10] << 16; /* fall through */
+    case 10: k2 ^= (uint64_t)t[9]  << 8;  /* fall through */
+    case 9:  k2 ^= (uint64_t)t[8];
+             k2 *= C2; k2 = rotl64(k2, 33); k2 *= C1; h2 ^= k2;
+             /* fall through */
+    case 8:  k1 ^= (uint64_t)t[7] << 56; /* fall through */
+    case 7:  k1 ^= (uint64_t)t[6] << 48; /* fall through */
+    case 6:  k1 ^= (uint64_t)t[5] << 40; /* fall through */
+    case 5:  k1 ^= (uint64_t)t[4] << 32; /* fall through */
+    case 4:  k1 ^= (uint64_t)t[3] << 24; /* fall through */
+    case 3:  k1 ^= (uint64_t)t[2] << 16; /* fall through */
+    case 2:  k1 ^= (uint64_t)t[1] << 8;  /* fall through */
+    case 1:  k1 ^= (uint64_t)t[0];
+             k1 *= C1; k1 = rotl64(k1, 31); k1 *= C2; h1 ^= k1;
+    }
+
+    h1 ^= s->total; h2 ^= s->total;
+    h1 += h2; h2 += h1;
+    h1 = fmix64(h1); h2 = fmix64(h2);
+    h1 += h2; h2 += h1;
+
+    out[0] = h1;
+    out[1] = h2;
+}
+
+/* ============================================================
+   CRC32C
+   ============================================================ */
+
+#define CRC32C_POLY 0x82F63B78u  /* reflected */
+
+static uint32_t crc_table[8][256];
+static int crc_hw;
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void) {
+    uint32_t i, k;
+    for (i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for (k = 0; k < 8; ++k) c = (c >> 1) ^ (CRC32C_POLY & (0u - (c & 1)));
+        crc_table[0][i] = c;
+    }
+    for (i = 0; i < 256; ++i)
+        for (k = 1; k < 8; ++k)
+            crc_table[k][i] = (crc_table[k - 1][i] >> 8) ^ crc_table[0][crc_table[k - 1][i] & 0xFF];
+#if defined(MFA_HAVE_SSE42_CRC)
+    crc_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+/* Slicing-by-8: one table lookup per byte, eight bytes per step. */
+static uint32_t crc_sw(uint32_t c, const uint8_t *p, size_t n) {
+    for (; n >= 8; p += 8, n -= 8) {
+        uint32_t lo = c ^ ((uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+                           ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24));
+        c = crc_table[7][lo & 0xFF] ^ crc_table[6][(lo >> 8) & 0xFF] ^
+            crc_table[5][(lo >> 16) & 0xFF] ^ crc_table[4][lo >> 24] ^
+            crc_table[3][p[4]] ^ crc_table[2][p[5]] ^
+            crc_table[1][p[6]] ^ crc_table[0][p[7]];
+    }
+    while (n--) c = (c >> 8) ^ crc_table[0][(c ^ *p++) & 0xFF];
+    return c;
+}
+
+#if defined(MFA_HAVE_SSE42_CRC)
+__attribute__((target("sse4.2")))
+static uint32_t crc_sse42(uint32_t c, const uint8_t *p, size_t n) {
+    uint64_t c64;
+    while (n && ((uintptr_t)p & 7)) { c = _mm_crc32_u8(c, *p++); --n; }
+    c64 = c;
+    for (; n >= 8; p += 8, n -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c64 = _mm_crc32_u64(c64, v);
+    }
+    c = (uint32_t)c64;
+    while (n--) c = _mm_crc32_u8(c, *p++);
+    return c;
+}
+#endif
+
+uint32_t mfa_crc32c(uint32_t crc, const void *data, size_t n) {
+    const uint8_t *p = (const uint8_t *)data;
+    uint32_t c = ~crc;
+
+    pthread_once(&crc_once, crc_init);
+#if defined(MFA_HAVE_SSE42_CRC)
+    if (crc_hw) return ~crc_sse42(c, p, n);
+#endif
+    return ~crc_sw(c, p, n);
+}
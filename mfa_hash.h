@@ -0,0 +1,37 @@
+#ifndef MFA_HASH_H
+#define MFA_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* ============================================================
+   Content hashes
+   ------------------------------------------------------------
+   MurmurHash3 x64_128, fed incrementally so entries can be
+   hashed while streaming. Fast and well distributed, but not
+   cryptographic: it identifies content, it does not protect it.
+   ============================================================ */
+
+typedef struct {
+    uint64_t h1, h2;
+    uint64_t total;      /* bytes fed so far */
+    uint8_t  tail[16];   /* partial block carried between updates */
+    size_t   tail_len;
+} mfa_murmur3;
+
+void mfa_murmur3_init(mfa_murmur3 *s, uint64_t seed);
+void mfa_murmur3_update(mfa_murmur3 *s, const void *data, size_t n);
+/* Finish and store the 128-bit digest as two words. */
+void mfa_murmur3_final(mfa_murmur3 *s, uint64_t out[2]);
+
+/* ============================================================
+   CRC32C (Castagnoli)
+   ------------------------------------------------------------
+   Uses the SSE4.2 crc32 instruction when the CPU has it and a
+   slicing-by-8 table otherwise; both give the same value.
+   ============================================================ */
+
+/* Extend crc (0 to start) over data[0..n) and return the result. */
+uint32_t mfa_crc32c(uint32_t crc, const void *data, size_t n);
+
+#endif /* MFA_HASH_H */
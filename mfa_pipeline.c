@@ -0,0 +1,433 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "mfa_pipeline.h"
+#include "mfa_util.h"
+
+#include <pthread.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* ============================================================
+   Ring state
+   ------------------------------------------------------------
+   Chunks are numbered in production order. Chunk `seq` lives in
+   slot seq % nslots; the reader may fill it once the consumer
+   has released seq - nslots. Workers claim filled chunks in
+   order but may finish them in any order; the consumer waits
+   for the specific chunk it needs next.
+   ============================================================ */
+
+struct mfa_pipe {
+    mfa_file      **files;
+    size_t          n;
+    mfa_pipe_config cfg;
+
+    mfa_chunk      *slots;
+    int            *ready;     /* per slot: transform finished */
+    size_t          nslots;
+    size_t          chunk_size;
+
+    uint64_t        filled;    /* chunks produced so far */
+    uint64_t        claimed;   /* chunks taken by workers */
+    uint64_t        consumed;  /* chunks released so far */
+    int             done;      /* reader finished (ok or not) */
+    int             failed;    /* reader or a worker hit an error */
+    int             abort;     /* consumer gave up */
+
+    pthread_mutex_t mu;
+    pthread_cond_t  can_fill;
+    pthread_cond_t  can_work;
+    pthread_cond_t  can_take;
+    pthread_t       reader;
+    pthread_t      *workers;
+    unsigned        nworkers;
+};
+
+unsigned mfa_cpu_count(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (unsigned)n : 1u;
+}
+
+/* Wait for a free slot; NULL if the pack is being torn down. */
+static mfa_chunk *wait_free_slot(mfa_pipe *p) {
+    mfa_chunk *c = NULL;
+    pthread_mutex_lock(&p->mu);
+    while (!p->abort && !p->failed && p->filled - p->consumed >= p->nslots)
+        pthread_cond_wait(&p->can_fill, &p->mu);
+    if (!p->abort && !p->failed) c = &p->slots[p->filled % p->nslots];
+    pthread_mutex_unlock(&p->mu);
+    return c;
+}
+
+static int publish_slot(mfa_pipe *p, mfa_chunk *c) {
+    size_t k = (size_t)(c - p->slots);
+
+    if (c->index == 0 && p->cfg.first_chunk && p->cfg.first_chunk(c, p->cfg.ctx) != 0)
+        return -1;
+
+    if (!p->nworkers) {
+        c->payload = c->data;
+        c->payload_len = c->len;
+        c->raw = 1;
+    }
+
+    pthread_mutex_lock(&p->mu);
+    p->ready[k] = (p->nworkers == 0);
+    p->filled++;
+    pthread_cond_signal(p->nworkers ? &p->can_work : &p->can_take);
+    pthread_mutex_unlock(&p->mu);
+    return 0;
+}
+
+/* Read a solid group's parts back to back into one chunk. */
+static int read_group(mfa_pipe *p, size_t idx) {
+    mfa_file *group = p->files[idx];
+    mfa_chunk *c;
+    size_t k, off = 0;
+
+    if (group->size > p->chunk_size) {
+        fprintf(stderr, "solid group larger than a chunk\n");
+        return -1;
+    }
+    c = wait_free_slot(p);
+    if (!c) return -1;
+
+    for (k = 0; k < group->nparts; ++k) {
+        const mfa_file *part = group->parts[k];
+        size_t len = (size_t)part->size;
+        FILE *f;
+        int rc;
+
+        if (part->buf) {
+            memcpy(c->data + off, part->buf, len);
+            off += len;
+            continue;
+        }
+        f = fopen(part->path, "rb");
+        if (!f) { perror(part->path); return -1; }
+        rc = mfa_read_exact(f, c->data + off, len);
+        if (rc) fprintf(stderr, "%s: short read (file changed while packing?)\n", part->path);
+        if (fclose(f) != 0 && rc == 0) { perror("fclose"); rc = -1; }
+        if (rc) return -1;
+        off += len;
+    }
+
+    c->file_index = idx;
+    c->index      = 0;
+    c->offset     = 0;
+    c->len        = off;
+    c->last       = 1;
+    return publish_slot(p, c);
+}
+
+static int read_one(mfa_pipe *p, size_t idx) {
+    mfa_file *file = p->files[idx];
+    FILE *f = NULL;
+    uint64_t off = 0;
+
+    if (file->nparts) return read_group(p, idx);
+
+    if (!file->buf) {
+        f = fopen(file->path, "rb");
+        if (!f) { perror(file->path); return -1; }
+    }
+
+    do {
+        mfa_chunk *c = wait_free_slot(p);
+        uint64_t left = file->size - off;
+        size_t len = left > p->chunk_size ? p->chunk_size : (size_t)left;
+
+        if (!c) { if (f) fclose(f); return -1; }
+
+        if (len) {
+            if (f) {
+                if (mfa_read_exact(f, c->data, len)) {
+                    fprintf(stderr, "%s: short read (file changed while packing?)\n", file->path);
+                    fclose(f);
+                    return -1;
+                }
+            } else {
+                memcpy(c->data, file->buf + off, len);
+            }
+        }
+
+        c->file_index = idx;
+        c->index      = off / p->chunk_size;
+        c->offset     = off;
+        c->len        = len;
+        off          += len;
+        c->last       = (off == file->size);
+        if (publish_slot(p, c)) { if (f) fclose(f); return -1; }
+    } while (off < file->size);
+
+    if (f && fclose(f) != 0) { perror("fclose"); return -1; }
+    return 0;
+}
+
+static void *reader_main(void *arg) {
+    mfa_pipe *p = (mfa_pipe *)arg;
+    size_t i;
+    int failed = 0;
+
+    for (i = 0; i < p->n && !failed; ++i)
+        if (read_one(p, i)) failed = 1;
+
+    pthread_mutex_lock(&p->mu);
+    p->done = 1;
+    if (failed) p->failed = 1;
+    pthread_cond_broadcast(&p->can_work);
+    pthread_cond_broadcast(&p->can_take);
+    pthread_mutex_unlock(&p->mu);
+    return NULL;
+}
+
+static void *worker_main(void *arg) {
+    mfa_pipe *p = (mfa_pipe *)arg;
+
+    pthread_mutex_lock(&p->mu);
+    for (;;) {
+        size_t k;
+        int rc;
+
+        while (!p->abort && !p->failed && p->claimed == p->filled && !p->done)
+            pthread_cond_wait(&p->can_work, &p->mu);
+        if (p->abort || p->failed || p->claimed == p->filled) break;
+
+        k = (size_t)(p->claimed++ % p->nslots);
+        pthread_mutex_unlock(&p->mu);
+
+        rc = p->cfg.transform(&p->slots[k], p->cfg.ctx);
+
+        pthread_mutex_lock(&p->mu);
+        if (rc != 0) p->failed = 1;
+        p->ready[k] = 1;
+        pthread_cond_broadcast(&p->can_take);
+        if (p->failed) pthread_cond_broadcast(&p->can_fill);
+    }
+    pthread_mutex_unlock(&p->mu);
+    return NULL;
+}
+
+/* ============================================================
+   Public API
+   ============================================================ */
+
+static void pipe_free(mfa_pipe *p) {
+    size_t i;
+    if (!p) return;
+    if (p->slots) {
+        for (i = 0; i < p->nslots; ++i) {
+            free(p->slots[i].data);
+            free(p->slots[i].out);
+        }
+    }
+    free(p->slots);
+    free(p->ready);
+    free(p->workers);
+    free(p);
+}
+
+/* Wake everything, join all threads and release sync objects. */
+static void pipe_stop(mfa_pipe *p, unsigned started_workers, int reader_started) {
+    unsigned w;
+
+    pthread_mutex_lock(&p->mu);
+    if (!p->done || p->consumed < p->filled) p->abort = 1;
+    pthread_cond_broadcast(&p->can_fill);
+    pthread_cond_broadcast(&p->can_work);
+    pthread_mutex_unlock(&p->mu);
+
+    if (reader_started) pthread_join(p->reader, NULL);
+    for (w = 0; w < started_workers; ++w) pthread_join(p->workers[w], NULL);
+
+    pthread_cond_destroy(&p->can_take);
+    pthread_cond_destroy(&p->can_work);
+    pthread_cond_destroy(&p->can_fill);
+    pthread_mutex_destroy(&p->mu);
+}
+
+mfa_pipe *mfa_pipe_start(mfa_file **files, size_t n, const mfa_pipe_config *cfg) {
+    mfa_pipe *p;
+    size_t i, budget, out_cap, target;
+    unsigned w;
+
+    if (!files || !cfg) return NULL;
+
+    p = (mfa_pipe *)calloc(1, sizeof *p);
+    if (!p) { perror("calloc"); return NULL; }
+    p->files = files;
+    p->n = n;
+    p->cfg = *cfg;
+
+    if (p->cfg.transform) {
+        p->nworkers = p->cfg.workers ? p->cfg.workers : mfa_cpu_count();
+    }
+
+    /* Aim for two chunks per worker plus read-ahead and the one being
+       written, so no stage starves the others. */
+    budget = p->cfg.max_memory;
+    if (budget < 2 * MFA_MIN_CHUNK) budget = 2 * MFA_MIN_CHUNK;
+    target = 2 * (size_t)p->nworkers + 4;
+
+    p->chunk_size = MFA_MIN_CHUNK;
+    while (p->chunk_size < MFA_MAX_CHUNK &&
+           2 * p->chunk_size <= budget / (target * (p->cfg.transform ? 2 : 1)))
+        p->chunk_size *= 2;
+    /* Very large entries need bigger chunks than the budget suggests. */
+    while (p->chunk_size < p->cfg.min_chunk) p->chunk_size *= 2;
+
+    out_cap = p->cfg.out_bound ? p->cfg.out_bound(p->chunk_size, p->cfg.ctx) : 0;
+    p->nslots = budget / (p->chunk_size + out_cap);
+    if (p->nslots < 2) p->nslots = 2;
+
+    p->slots   = (mfa_chunk *)calloc(p->nslots, sizeof *p->slots);
+    p->ready   = (int *)calloc(p->nslots, sizeof *p->ready);
+    p->workers = (pthread_t *)calloc(p->nworkers ? p->nworkers : 1, sizeof *p->workers);
+    if (!p->slots || !p->ready || !p->workers) { perror("calloc"); pipe_free(p); return NULL; }
+
+    for (i = 0; i < p->nslots; ++i) {
+        p->slots[i].data = (uint8_t *)malloc(p->chunk_size);
+        if (!p->slots[i].data) { perror("malloc"); pipe_free(p); return NULL; }
+        if (out_cap) {
+            p->slots[i].out = (uint8_t *)malloc(out_cap);
+            if (!p->slots[i].out) { perror("malloc"); pipe_free(p); return NULL; }
+            p->slots[i].out_cap = out_cap;
+        }
+    }
+
+    pthread_mutex_init(&p->mu, NULL);
+    pthread_cond_init(&p->can_fill, NULL);
+    pthread_cond_init(&p->can_work, NULL);
+    pthread_cond_init(&p->can_take, NULL);
+
+    for (w = 0; w < p->nworkers; ++w) {
+        if (pthread_create(&p->workers[w], NULL, worker_main, p) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            pipe_stop(p, w, 0);
+            pipe_free(p);
+            return NULL;
+        }
+    }
+    if (pthread_create(&p->reader, NULL, reader_main, p) != 0) {
+        fprintf(stderr, "pthread_create failed\n");
+        pipe_stop(p, p->nworkers, 0);
+        pipe_free(p);
+        return NULL;
+    }
+    return p;
+}
+
+const mfa_chunk *mfa_pipe_next(mfa_pipe *p) {
+    const mfa_chunk *c = NULL;
+    if (!p) return NULL;
+
+    pthread_mutex_lock(&p->mu);
+    for (;;) {
+        if (p->failed) break;
+        if (p->consumed < p->filled) {
+            size_t k = (size_t)(p->consumed % p->nslots);
+            if (p->ready[k]) { c = &p->slots[k]; break; }
+        } else if (p->done) {
+            break;
+        }
+        pthread_cond_wait(&p->can_take, &p->mu);
+    }
+    pthread_mutex_unlock(&p->mu);
+    return c;
+}
+
+size_t mfa_pipe_chunk_size(const mfa_pipe *p) {
+    return p ? p->chunk_size : 0;
+}
+
+void mfa_pipe_release(mfa_pipe *p) {
+    if (!p) return;
+    pthread_mutex_lock(&p->mu);
+    if (p->consumed < p->filled) {
+        p->ready[p->consumed % p->nslots] = 0;
+        p->consumed++;
+    }
+    pthread_cond_signal(&p->can_fill);
+    pthread_mutex_unlock(&p->mu);
+}
+
+int mfa_pipe_finish(mfa_pipe *p) {
+    int rc;
+    if (!p) return -1;
+
+    pipe_stop(p, p->nworkers, 1);
+    rc = (p->failed || p->abort) ? -1 : 0;
+    pipe_free(p);
+    return rc;
+}
+
+/* ============================================================
+   Parallel for
+   ============================================================ */
+
+typedef struct {
+    size_t          n;
+    size_t          next;
+    int             failed;
+    int           (*fn)(size_t i, void *ctx);
+    void           *ctx;
+    pthread_mutex_t mu;
+} pfor_state;
+
+static void *pfor_main(void *arg) {
+    pfor_state *st = (pfor_state *)arg;
+    for (;;) {
+        size_t i;
+        pthread_mutex_lock(&st->mu);
+        if (st->failed || st->next >= st->n) { pthread_mutex_unlock(&st->mu); break; }
+        i = st->next++;
+        pthread_mutex_unlock(&st->mu);
+
+        if (st->fn(i, st->ctx) != 0) {
+            pthread_mutex_lock(&st->mu);
+            st->failed = 1;
+            pthread_mutex_unlock(&st->mu);
+        }
+    }
+    return NULL;
+}
+
+int mfa_parallel_for(size_t n, unsigned jobs,
+                     int (*fn)(size_t i, void *ctx), void *ctx) {
+    pfor_state st;
+    pthread_t *threads;
+    unsigned t, started = 0;
+
+    if (!fn) return -1;
+    if (jobs > n) jobs = (unsigned)n;
+
+    if (jobs <= 1) {
+        size_t i;
+        for (i = 0; i < n; ++i)
+            if (fn(i, ctx) != 0) return -1;
+        return 0;
+    }
+
+    threads = (pthread_t *)calloc(jobs, sizeof *threads);
+    if (!threads) { perror("calloc"); return -1; }
+
+    st.n = n;
+    st.next = 0;
+    st.failed = 0;
+    st.fn = fn;
+    st.ctx = ctx;
+    pthread_mutex_init(&st.mu, NULL);
+
+    for (t = 0; t < jobs; ++t) {
+        if (pthread_create(&threads[t], NULL, pfor_main, &st) != 0) break;
+        ++started;
+    }
+    if (!started) pfor_main(&st);  /* could not spawn: run inline */
+    for (t = 0; t < started; ++t) pthread_join(threads[t], NULL);
+
+    pthread_mutex_destroy(&st.mu);
+    free(threads);
+    return st.failed ? -1 : 0;
+}
@@ -0,0 +1,96 @@
+#ifndef MFA_PIPELINE_H
+#define MFA_PIPELINE_H
+
+#include "mfa_util.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* ============================================================
+   Bounded read-ahead pipeline used by the packer
+   ------------------------------------------------------------
+   A background thread streams every input file in fixed-size
+   chunks into a fixed ring of buffers. A pool of worker threads
+   runs the transform (compression etc.) on chunks as they
+   arrive, and the packer consumes finished chunks strictly in
+   entry order. Reading, transforming and writing all overlap,
+   and buffer memory never exceeds the configured budget.
+   ============================================================ */
+
+/* Smallest chunk the pipeline will use, and the default budget. */
+#define MFA_MIN_CHUNK      (64u * 1024u)
+#define MFA_MAX_CHUNK      (1024u * 1024u)
+#define MFA_DEFAULT_MEMORY (8u * 1024u * 1024u)
+
+typedef struct {
+    size_t    file_index;  /* entry this chunk belongs to */
+    uint64_t  index;       /* chunk number within the entry */
+    uint64_t  offset;      /* byte offset of data within the entry */
+    size_t    len;         /* valid bytes in data */
+    int       last;        /* non-zero on the final chunk of an entry */
+    uint8_t  *data;        /* chunk bytes (owned by the pipeline) */
+
+    /* Transform output; without a transform, payload == data. */
+    uint8_t       *out;          /* scratch of out_cap bytes (owned) */
+    size_t         out_cap;
+    const uint8_t *payload;      /* bytes to store: data or out */
+    size_t         payload_len;
+    int            raw;          /* payload is the untransformed data */
+} mfa_chunk;
+
+typedef struct {
+    size_t    max_memory;  /* cap on chunk + scratch buffers, in bytes */
+    unsigned  workers;     /* transform threads; 0 = one per CPU */
+    size_t    min_chunk;   /* chunk size floor (power of two); 0 = none */
+
+    /* Optional transform, run on worker threads. It must set
+       payload/payload_len/raw; returns 0 or -1 to abort the pack. */
+    int     (*transform)(mfa_chunk *c, void *ctx);
+    /* Scratch bytes the transform needs for a chunk of n bytes. */
+    size_t  (*out_bound)(size_t n, void *ctx);
+    /* Optional, run on the reader thread on each entry's first chunk
+       before any of the entry's chunks reaches a worker; per-entry
+       decisions it stores in ctx are seen by all of them. Returns
+       0 or -1 to abort the pack. */
+    int     (*first_chunk)(const mfa_chunk *c, void *ctx);
+    void     *ctx;
+} mfa_pipe_config;
+
+typedef struct mfa_pipe mfa_pipe;
+
+/* Number of online CPUs (at least 1). */
+unsigned mfa_cpu_count(void);
+
+/* Start streaming files[0..n) (each file->size must already be set).
+   Entries with a loaded buf are served from memory. A solid group
+   (nparts != 0) must fit one chunk and comes out as that chunk. */
+mfa_pipe *mfa_pipe_start(mfa_file **files, size_t n, const mfa_pipe_config *cfg);
+
+/* Next finished chunk in entry order, or NULL at end of input / on
+   error. The chunk stays valid until mfa_pipe_release(). */
+const mfa_chunk *mfa_pipe_next(mfa_pipe *p);
+
+/* Size of the chunks this pipeline produces, always a power of two
+   (the last chunk of an entry may be shorter). */
+size_t mfa_pipe_chunk_size(const mfa_pipe *p);
+
+/* Hand the chunk returned by the last mfa_pipe_next() back. */
+void mfa_pipe_release(mfa_pipe *p);
+
+/* Stop all threads and free everything. Returns 0 if every file was
+   read and transformed, -1 otherwise. */
+int mfa_pipe_finish(mfa_pipe *p);
+
+/* ============================================================
+   Parallel for
+   ------------------------------------------------------------
+   Run fn(i, ctx) for every i in [0, n) on up to `jobs` threads.
+   Items are handed out one at a time in index order; after the
+   first failure no new items are started. Returns 0 if every
+   call returned 0, -1 otherwise.
+   ============================================================ */
+
+int mfa_parallel_for(size_t n, unsigned jobs,
+                     int (*fn)(size_t i, void *ctx), void *ctx);
+
+#endif /* MFA_PIPELINE_H */
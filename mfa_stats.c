@@ -0,0 +1,186 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "mfa_stats.h"
+#include "mfa_codec.h"
+
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char *const phase_names[MFA_NPHASES] = {
+    "load", "transform", "toc_write", "toc_read", "copy"
+};
+
+static double now_wall(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static double tv_sec(const struct timeval *tv) {
+    return (double)tv->tv_sec + (double)tv->tv_usec / 1e6;
+}
+
+/* Value of `key` in a /proc/self/io dump, 0 if missing. */
+static uint64_t io_field(const char *text, const char *key) {
+    const char *p = strstr(text, key);
+    uint64_t v = 0;
+
+    if (!p) return 0;
+    for (p += strlen(key); *p == ' '; ++p) {}
+    for (; *p >= '0' && *p <= '9'; ++p) v = v * 10 + (uint64_t)(*p - '0');
+    return v;
+}
+
+/* Process-wide read/write syscall counts; zero where /proc/self/io
+   is unavailable. Costs one read() itself, which shows up in the
+   next sample. */
+static void io_counts(uint64_t *reads, uint64_t *writes) {
+    char text[512];
+    ssize_t n = -1;
+    int fd = open("/proc/self/io", O_RDONLY);
+
+    *reads = *writes = 0;
+    if (fd < 0) return;
+    n = read(fd, text, sizeof text - 1);
+    close(fd);
+    if (n <= 0) return;
+    text[n] = '\0';
+    *reads  = io_field(text, "syscr:");
+    *writes = io_field(text, "syscw:");
+}
+
+void mfa_stats_init(mfa_stats *s) {
+    memset(s, 0, sizeof *s);
+}
+
+void mfa_phase_begin(const mfa_stats *s, mfa_phase_mark *m) {
+    struct rusage ru;
+
+    if (!s) return;
+    memset(m, 0, sizeof *m);
+    if (getrusage(RUSAGE_SELF, &ru) == 0) {
+        m->cpu_user = tv_sec(&ru.ru_utime);
+        m->cpu_sys  = tv_sec(&ru.ru_stime);
+    }
+    io_counts(&m->reads, &m->writes);
+    m->wall = now_wall();
+}
+
+void mfa_phase_end(mfa_stats *s, int phase, const mfa_phase_mark *m,
+                   uint64_t in, uint64_t out) {
+    mfa_phase_stats *p;
+    struct rusage ru;
+    uint64_t reads, writes;
+    double wall;
+
+    if (!s || phase < 0 || phase >= MFA_NPHASES) return;
+    wall = now_wall();
+    io_counts(&reads, &writes);
+    p = &s->phase[phase];
+
+    p->runs++;
+    p->wall += wall - m->wall;
+    p->bytes_in  += in;
+    p->bytes_out += out;
+    /* Less the read() of the begin sample */
+    if (reads > m->reads) p->reads += reads - m->reads - 1;
+    if (writes > m->writes) p->writes += writes - m->writes;
+    if (getrusage(RUSAGE_SELF, &ru) == 0) {
+        p->cpu_user += tv_sec(&ru.ru_utime) - m->cpu_user;
+        p->cpu_sys  += tv_sec(&ru.ru_stime) - m->cpu_sys;
+        if (ru.ru_maxrss > s->peak_rss_kb) s->peak_rss_kb = ru.ru_maxrss;
+    }
+}
+
+void mfa_stats_codec(mfa_stats *s, unsigned alg, uint64_t in, uint64_t out) {
+    mfa_codec_stats *c;
+
+    if (!s || alg >= MFA_STATS_CODECS) return;
+    c = &s->codec[alg];
+    c->chunks++;
+    c->bytes_in  += in;
+    c->bytes_out += out;
+}
+
+static const char *codec_name(unsigned alg, char *buf) {
+    const mfa_codec *c = mfa_codec_get((uint16_t)alg);
+    if (c) return c->name;
+    sprintf(buf, "alg%u", alg);
+    return buf;
+}
+
+static double ratio(uint64_t in, uint64_t out) {
+    return in ? (double)out / (double)in : 0.0;
+}
+
+static void print_json(const mfa_stats *s, FILE *out) {
+    char nb[16];
+    unsigned i;
+    int first = 1;
+
+    fprintf(out, "{\n  \"phases\": {");
+    for (i = 0; i < MFA_NPHASES; ++i) {
+        const mfa_phase_stats *p = &s->phase[i];
+        if (!p->runs) continue;
+        fprintf(out, "%s\n    \"%s\": {\"runs\": %u, \"wall\": %.6f, \"cpu_user\": %.6f, "
+                "\"cpu_sys\": %.6f, \"bytes_in\": %llu, \"bytes_out\": %llu, "
+                "\"reads\": %llu, \"writes\": %llu}",
+                first ? "" : ",", phase_names[i], p->runs, p->wall, p->cpu_user,
+                p->cpu_sys, (unsigned long long)p->bytes_in,
+                (unsigned long long)p->bytes_out, (unsigned long long)p->reads,
+                (unsigned long long)p->writes);
+        first = 0;
+    }
+    fprintf(out, "%s},\n  \"codecs\": {", first ? "" : "\n  ");
+    first = 1;
+    for (i = 0; i < MFA_STATS_CODECS; ++i) {
+        const mfa_codec_stats *c = &s->codec[i];
+        if (!c->chunks) continue;
+        fprintf(out, "%s\n    \"%s\": {\"chunks\": %llu, \"bytes_in\": %llu, "
+                "\"bytes_out\": %llu, \"ratio\": %.4f}",
+                first ? "" : ",", codec_name(i, nb), (unsigned long long)c->chunks,
+                (unsigned long long)c->bytes_in, (unsigned long long)c->bytes_out,
+                ratio(c->bytes_in, c->bytes_out));
+        first = 0;
+    }
+    fprintf(out, "%s},\n  \"peak_rss_kb\": %ld\n}\n", first ? "" : "\n  ", s->peak_rss_kb);
+}
+
+static void print_table(const mfa_stats *s, FILE *out) {
+    char nb[16];
+    unsigned i;
+    uint64_t chunks = 0;
+
+    fprintf(out, "%-10s %4s %10s %10s %10s %14s %14s %9s %9s\n",
+            "phase", "runs", "wall(s)", "user(s)", "sys(s)",
+            "bytes in", "bytes out", "reads", "writes");
+    for (i = 0; i < MFA_NPHASES; ++i) {
+        const mfa_phase_stats *p = &s->phase[i];
+        if (!p->runs) continue;
+        fprintf(out, "%-10s %4u %10.4f %10.4f %10.4f %14llu %14llu %9llu %9llu\n",
+                phase_names[i], p->runs, p->wall, p->cpu_user, p->cpu_sys,
+                (unsigned long long)p->bytes_in, (unsigned long long)p->bytes_out,
+                (unsigned long long)p->reads, (unsigned long long)p->writes);
+    }
+
+    for (i = 0; i < MFA_STATS_CODECS; ++i) chunks += s->codec[i].chunks;
+    if (chunks)
+        fprintf(out, "\n%-10s %10s %14s %14s %8s\n", "codec", "chunks", "bytes in", "bytes out", "ratio");
+    for (i = 0; i < MFA_STATS_CODECS; ++i) {
+        const mfa_codec_stats *c = &s->codec[i];
+        if (!c->chunks) continue;
+        fprintf(out, "%-10s %10llu %14llu %14llu %8.4f\n",
+                codec_name(i, nb), (unsigned long long)c->chunks,
+                (unsigned long long)c->bytes_in, (unsigned long long)c->bytes_out,
+                ratio(c->bytes_in, c->bytes_out));
+    }
+    fprintf(out, "\npeak RSS: %ld KiB\n", s->peak_rss_kb);
+}
+
+void mfa_stats_print(const mfa_stats *s, FILE *out, int json) {
+    if (json) print_json(s, out);
+    else print_table(s, out);
+}
@@ -0,0 +1,70 @@
+#ifndef MFA_STATS_H
+#define MFA_STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* ============================================================
+   Instrumentation (--stats)
+   ------------------------------------------------------------
+   An mfa_stats passed in mfa_options collects, per phase, wall
+   and CPU time, bytes in and out and read/write syscall counts,
+   plus in/out bytes per codec and the process's peak RSS. CPU
+   time and syscalls are process-wide, so they include the
+   pipeline's reader and worker threads. With no mfa_stats set
+   nothing is measured.
+   ============================================================ */
+
+enum {
+    MFA_PHASE_LOAD,       /* mfa_load_all: whole files into memory */
+    MFA_PHASE_TRANSFORM,  /* read, code and write entry data */
+    MFA_PHASE_TOC_WRITE,  /* TOC, name index, ext area, header */
+    MFA_PHASE_TOC_READ,   /* open an archive and decode its TOC */
+    MFA_PHASE_COPY,       /* entry data decoded and written out */
+    MFA_NPHASES
+};
+
+/* Codec slots, indexed by alg_id. */
+#define MFA_STATS_CODECS 8
+
+typedef struct {
+    unsigned  runs;               /* times the phase was entered */
+    double    wall;               /* seconds */
+    double    cpu_user, cpu_sys;
+    uint64_t  bytes_in, bytes_out;
+    uint64_t  reads, writes;      /* read/write syscalls (Linux) */
+} mfa_phase_stats;
+
+typedef struct {
+    uint64_t  chunks;
+    uint64_t  bytes_in, bytes_out;
+} mfa_codec_stats;
+
+typedef struct {
+    mfa_phase_stats phase[MFA_NPHASES];
+    mfa_codec_stats codec[MFA_STATS_CODECS];
+    long            peak_rss_kb;
+} mfa_stats;
+
+/* Counters at the start of a phase. */
+typedef struct {
+    double    wall, cpu_user, cpu_sys;
+    uint64_t  reads, writes;
+} mfa_phase_mark;
+
+/* Zero every counter. */
+void mfa_stats_init(mfa_stats *s);
+
+/* Start / finish one run of a phase; both do nothing if s is NULL.
+   in/out are the bytes the run consumed and produced. */
+void mfa_phase_begin(const mfa_stats *s, mfa_phase_mark *m);
+void mfa_phase_end(mfa_stats *s, int phase, const mfa_phase_mark *m,
+                   uint64_t in, uint64_t out);
+
+/* Account one chunk coded with alg (s may be NULL). */
+void mfa_stats_codec(mfa_stats *s, unsigned alg, uint64_t in, uint64_t out);
+
+/* Print s as an aligned table, or as one JSON object if json. */
+void mfa_stats_print(const mfa_stats *s, FILE *out, int json);
+
+#endif /* MFA_STATS_H */
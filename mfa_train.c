@@ -0,0 +1,125 @@
+#include "mfa_train.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define TRAIN_K        8u          /* bytes per scored string */
+#define TRAIN_SEG      256u        /* bytes per dictionary segment */
+#define TRAIN_LOG      18          /* hash buckets for the strings */
+#define TRAIN_BUCKETS  ((size_t)1 << TRAIN_LOG)
+
+typedef struct {
+    size_t   sample, off;   /* where the segment starts */
+    size_t   len;
+    uint64_t score;
+} train_seg;
+
+static uint32_t kmer_hash(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return (uint32_t)((v * 0x9E3779B97F4A7C15ULL) >> (64 - TRAIN_LOG));
+}
+
+/* Score of a string: the samples it was seen in, if more than one. */
+static uint32_t kmer_score(const uint32_t *freq, uint32_t h) {
+    return freq[h] > 1 ? freq[h] : 0;
+}
+
+/* Best segment within p[lo..hi), hi - lo >= TRAIN_K, each distinct
+   string counted once: occ tracks the strings inside the sliding
+   window, and is left all zero again. */
+static void best_segment(const uint8_t *p, size_t lo, size_t hi,
+                         const uint32_t *freq, uint16_t *occ, train_seg *best,
+                         size_t sample) {
+    size_t len = hi - lo < TRAIN_SEG ? hi - lo : TRAIN_SEG;
+    size_t nk = len - TRAIN_K + 1;   /* strings per window */
+    uint64_t score = 0;
+    size_t i;
+
+    for (i = lo; i + TRAIN_K <= hi; ++i) {
+        uint32_t h = kmer_hash(p + i);
+        if (occ[h]++ == 0) score += kmer_score(freq, h);
+        if (i >= lo + nk) {
+            uint32_t g = kmer_hash(p + i - nk);
+            if (--occ[g] == 0) score -= kmer_score(freq, g);
+        }
+        if (i + 1 >= lo + nk && score > best->score) {
+            best->sample = sample;
+            best->off    = i + 1 - nk;
+            best->len    = len;
+            best->score  = score;
+        }
+    }
+    for (i = hi - TRAIN_K + 1 - nk; i + TRAIN_K <= hi; ++i)
+        --occ[kmer_hash(p + i)];
+}
+
+static int seg_score_cmp(const void *a, const void *b) {
+    const train_seg *x = (const train_seg *)a, *y = (const train_seg *)b;
+    return (x->score > y->score) - (x->score < y->score);
+}
+
+size_t mfa_dict_train(const uint8_t *const *samples, const size_t *lens, size_t n,
+                      uint8_t *out, size_t cap) {
+    uint32_t *freq, *seen;
+    uint16_t *occ;
+    train_seg *segs;
+    size_t nseg = cap / TRAIN_SEG, kept = 0, total = 0, used = 0;
+    size_t s, e, i, base;
+
+    for (s = 0; s < n; ++s) total += lens[s];
+    if (nseg > total / TRAIN_SEG) nseg = total / TRAIN_SEG;
+    if (!nseg) return 0;
+
+    freq = (uint32_t *)calloc(TRAIN_BUCKETS, sizeof *freq);
+    seen = (uint32_t *)calloc(TRAIN_BUCKETS, sizeof *seen);
+    occ  = (uint16_t *)calloc(TRAIN_BUCKETS, sizeof *occ);
+    segs = (train_seg *)calloc(nseg, sizeof *segs);
+    if (!freq || !seen || !occ || !segs) goto out;
+
+    /* Document frequency: a string counts once per sample */
+    for (s = 0; s < n; ++s) {
+        for (i = 0; i + TRAIN_K <= lens[s]; ++i) {
+            uint32_t h = kmer_hash(samples[s] + i);
+            if (seen[h] != (uint32_t)s + 1) { seen[h] = (uint32_t)s + 1; ++freq[h]; }
+        }
+    }
+
+    /* One segment per stretch of the samples laid end to end;
+       sample s starts at byte base of that. */
+    s = 0; base = 0;
+    for (e = 0; e < nseg; ++e) {
+        size_t from = (size_t)((double)total * (double)e / (double)nseg);
+        size_t to   = (size_t)((double)total * (double)(e + 1) / (double)nseg);
+        train_seg best;
+
+        memset(&best, 0, sizeof best);
+        for (;;) {
+            size_t lo = from > base ? from - base : 0;
+            size_t hi = to - base < lens[s] ? to - base : lens[s];
+
+            if (hi >= lo + TRAIN_K)
+                best_segment(samples[s], lo, hi, freq, occ, &best, s);
+            if (base + lens[s] > to || s + 1 == n) break;
+            base += lens[s++];
+        }
+        if (!best.score) continue;
+
+        segs[kept++] = best;
+        for (i = best.off; i + TRAIN_K <= best.off + best.len; ++i)
+            freq[kmer_hash(samples[best.sample] + i)] = 0;
+    }
+
+    qsort(segs, kept, sizeof *segs, seg_score_cmp);
+    for (i = 0; i < kept; ++i) {
+        memcpy(out + used, samples[segs[i].sample] + segs[i].off, segs[i].len);
+        used += segs[i].len;
+    }
+
+out:
+    free(segs);
+    free(occ);
+    free(seen);
+    free(freq);
+    return used;
+}
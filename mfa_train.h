@@ -0,0 +1,26 @@
+#ifndef MFA_TRAIN_H
+#define MFA_TRAIN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* ============================================================
+   Dictionary training
+   ------------------------------------------------------------
+   Builds a dictionary (see mfa_dict) out of the byte strings
+   that recur across many small samples, in the manner of COVER:
+   every 8-byte string is scored by how many samples contain it,
+   the samples are split into as many stretches as the dictionary
+   has segments, and from each stretch the segment covering the
+   highest total score is kept. Strings already covered score
+   nothing afterwards, so segments do not repeat each other. The
+   best segments go last, where LZ offsets to them are shortest.
+   ============================================================ */
+
+/* Train up to cap bytes into out from samples[0..n) (lens[i] bytes
+   each). Returns the dictionary's length: 0 when the samples share
+   too little to be worth one, or on running out of memory. */
+size_t mfa_dict_train(const uint8_t *const *samples, const size_t *lens, size_t n,
+                      uint8_t *out, size_t cap);
+
+#endif /* MFA_TRAIN_H */
@@ -0,0 +1,365 @@
+#define _GNU_SOURCE  /* syscall */
+
+#include "mfa_uring.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+#ifdef MFA_HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+/* SQEs per file: open, read or write, close. */
+#define URING_CHAIN  3u
+
+/* user_data: file index within the window, and the step */
+#define STEP_OPEN    0u
+#define STEP_IO      1u
+#define STEP_CLOSE   2u
+#define STEP_STATX   3u
+#define UD(i, step)  (((uint64_t)(i) << 2) | (step))
+
+struct mfa_uring {
+    int       fd;
+    unsigned  window;            /* files per submission = file slots */
+
+    unsigned *sq_head, *sq_tail, *sq_array;
+    unsigned  sq_mask, sq_entries;
+    unsigned  tail;              /* local SQ tail, published on submit */
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head, *cq_tail;
+    unsigned  cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void     *sq_map, *cq_map;
+    size_t    sq_map_len, cq_map_len, sqes_len;
+};
+
+static int ring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int ring_enter(int fd, unsigned submit, unsigned wait) {
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait,
+                        wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+static int ring_register(int fd, unsigned op, void *arg, unsigned n) {
+    return (int)syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+/* A zeroed SQE at the local tail; the caller keeps within sq_entries. */
+static struct io_uring_sqe *sqe_next(mfa_uring *u) {
+    unsigned idx = u->tail & u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[idx];
+
+    memset(sqe, 0, sizeof *sqe);
+    u->sq_array[idx] = idx;
+    ++u->tail;
+    return sqe;
+}
+
+typedef void (*cqe_fn)(uint64_t data, int res, void *ctx);
+
+/* Submit everything queued and hand each of the `expect` completions
+   to fn. */
+static int ring_run(mfa_uring *u, unsigned expect, cqe_fn fn, void *ctx) {
+    unsigned submit = u->tail - *u->sq_tail;
+
+    __atomic_store_n(u->sq_tail, u->tail, __ATOMIC_RELEASE);
+    while (expect) {
+        unsigned head = *u->cq_head;
+        unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+        if (head == tail || submit) {
+            int rc = ring_enter(u->fd, submit, head == tail ? 1 : 0);
+            if (rc < 0) {
+                if (errno == EINTR) continue;
+                return -1;
+            }
+            submit -= (unsigned)rc < submit ? (unsigned)rc : submit;
+            continue;
+        }
+        for (; head != tail && expect; ++head, --expect) {
+            const struct io_uring_cqe *c = &u->cqes[head & u->cq_mask];
+            fn(c->user_data, c->res, ctx);
+        }
+        __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+/* Queue "open path into slot, then io, then close the slot". A failed
+   open cancels the rest; the close runs whatever the io did. */
+static void queue_chain(mfa_uring *u, unsigned i, const char *path, int oflags,
+                        uint8_t op, uint8_t *buf, size_t len) {
+    struct io_uring_sqe *s;
+
+    s = sqe_next(u);
+    s->opcode     = IORING_OP_OPENAT;
+    s->fd         = AT_FDCWD;
+    s->addr       = (uint64_t)(uintptr_t)path;
+    s->len        = 0666;
+    s->open_flags = (uint32_t)oflags;    /* slots are never exec'd; O_CLOEXEC is EINVAL */
+    s->file_index = i + 1;
+    s->flags      = IOSQE_IO_LINK;
+    s->user_data  = UD(i, STEP_OPEN);
+
+    s = sqe_next(u);
+    s->opcode    = op;
+    s->fd        = (int)i;
+    s->addr      = (uint64_t)(uintptr_t)buf;
+    s->len       = (uint32_t)len;
+    s->off       = 0;
+    s->flags     = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+    s->user_data = UD(i, STEP_IO);
+
+    s = sqe_next(u);
+    s->opcode     = IORING_OP_CLOSE;
+    s->file_index = i + 1;
+    s->user_data  = UD(i, STEP_CLOSE);
+}
+
+/* Whether this kernel opens into a slot (5.15+): older ones ignore
+   file_index and hand back a plain descriptor. */
+static void probe_cqe(uint64_t data, int res, void *ctx) {
+    int *out = (int *)ctx;
+    if ((data & 3u) == STEP_OPEN) out[0] = res;
+    else if ((data & 3u) == STEP_IO) out[1] = res;
+}
+
+static int probe_direct_open(mfa_uring *u) {
+    uint8_t b;
+    int res[2] = { -1, -1 };
+
+    queue_chain(u, 0, "/dev/null", O_RDONLY, IORING_OP_READ, &b, 1);
+    if (ring_run(u, URING_CHAIN, probe_cqe, res) != 0) return -1;
+    if (res[0] > 0) close(res[0]);
+    return res[0] == 0 && res[1] == 0 ? 0 : -1;
+}
+
+static int ops_supported(int fd) {
+    static const unsigned char need[] = {
+        IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE, IORING_OP_STATX
+    };
+    struct io_uring_probe *p;
+    size_t i, sz = sizeof *p + 256 * sizeof p->ops[0];
+    int ok;
+
+    p = (struct io_uring_probe *)calloc(1, sz);
+    if (!p) return 0;
+    ok = ring_register(fd, IORING_REGISTER_PROBE, p, 256) == 0;
+    for (i = 0; ok && i < sizeof need; ++i)
+        ok = need[i] <= p->last_op && (p->ops[need[i]].flags & IO_URING_OP_SUPPORTED);
+    free(p);
+    return ok;
+}
+
+mfa_uring *mfa_uring_open(unsigned files) {
+    struct io_uring_params p;
+    mfa_uring *u;
+    int *slots;
+    unsigned i;
+    int rc;
+
+    if (files == 0) files = 1;
+    u = (mfa_uring *)calloc(1, sizeof *u);
+    if (!u) return NULL;
+    u->fd = -1;
+
+    memset(&p, 0, sizeof p);
+    u->fd = ring_setup(files * URING_CHAIN, &p);
+    if (u->fd < 0 || !ops_supported(u->fd)) goto fail;
+
+    u->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_map_len > u->sq_map_len) u->sq_map_len = u->cq_map_len;
+        u->cq_map_len = 0;
+    }
+    u->sq_map = mmap(NULL, u->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_map == MAP_FAILED) { u->sq_map = NULL; goto fail; }
+    u->cq_map = u->sq_map;
+    if (u->cq_map_len) {
+        u->cq_map = mmap(NULL, u->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         u->fd, IORING_OFF_CQ_RING);
+        if (u->cq_map == MAP_FAILED) { u->cq_map = NULL; goto fail; }
+    }
+    u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = (struct io_uring_sqe *)mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+                                          MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) { u->sqes = NULL; goto fail; }
+
+    u->sq_head    = (unsigned *)((char *)u->sq_map + p.sq_off.head);
+    u->sq_tail    = (unsigned *)((char *)u->sq_map + p.sq_off.tail);
+    u->sq_array   = (unsigned *)((char *)u->sq_map + p.sq_off.array);
+    u->sq_mask    = *(unsigned *)((char *)u->sq_map + p.sq_off.ring_mask);
+    u->sq_entries = p.sq_entries;
+    u->tail       = *u->sq_tail;
+    u->cq_head    = (unsigned *)((char *)u->cq_map + p.cq_off.head);
+    u->cq_tail    = (unsigned *)((char *)u->cq_map + p.cq_off.tail);
+    u->cq_mask    = *(unsigned *)((char *)u->cq_map + p.cq_off.ring_mask);
+    u->cqes       = (struct io_uring_cqe *)((char *)u->cq_map + p.cq_off.cqes);
+    u->window     = p.sq_entries / URING_CHAIN;
+    if (p.cq_entries / URING_CHAIN < u->window) u->window = p.cq_entries / URING_CHAIN;
+
+    /* An empty file table for the direct opens */
+    slots = (int *)malloc(u->window * sizeof *slots);
+    if (!slots) goto fail;
+    for (i = 0; i < u->window; ++i) slots[i] = -1;
+    rc = ring_register(u->fd, IORING_REGISTER_FILES, slots, u->window);
+    free(slots);
+    if (rc != 0 || probe_direct_open(u) != 0) goto fail;
+    return u;
+
+fail:
+    mfa_uring_close(u);
+    return NULL;
+}
+
+void mfa_uring_close(mfa_uring *u) {
+    if (!u) return;
+    if (u->sqes) munmap(u->sqes, u->sqes_len);
+    if (u->cq_map && u->cq_map != u->sq_map) munmap(u->cq_map, u->cq_map_len);
+    if (u->sq_map) munmap(u->sq_map, u->sq_map_len);
+    if (u->fd >= 0) close(u->fd);
+    free(u);
+}
+
+/* Results of one window. */
+typedef struct {
+    mfa_uring_file *f;
+    struct statx   *st;
+} window_ctx;
+
+static void set_err(mfa_uring_file *f, int err) {
+    if (!f->err) f->err = err;
+}
+
+static void io_cqe(uint64_t data, int res, void *ctx) {
+    window_ctx *w = (window_ctx *)ctx;
+    mfa_uring_file *f = &w->f[data >> 2];
+
+    switch ((unsigned)(data & 3u)) {
+    case STEP_STATX:
+    case STEP_OPEN:
+        if (res < 0) set_err(f, -res);
+        break;
+    case STEP_IO:
+        if (res == -ECANCELED) break;          /* its open failed */
+        if (res < 0) set_err(f, -res);
+        else if ((size_t)res != f->len) set_err(f, EIO);   /* changed under us */
+        break;
+    case STEP_CLOSE:
+        if (res < 0 && res != -ECANCELED && res != -EBADF) set_err(f, -res);
+        break;
+    }
+}
+
+/* Stat a window of files for their sizes, then allocate them. */
+static int read_sizes(mfa_uring *u, mfa_uring_file *f, unsigned n, struct statx *st) {
+    window_ctx w;
+    unsigned i;
+
+    for (i = 0; i < n; ++i) {
+        struct io_uring_sqe *s = sqe_next(u);
+        s->opcode      = IORING_OP_STATX;
+        s->fd          = AT_FDCWD;
+        s->addr        = (uint64_t)(uintptr_t)f[i].path;
+        s->len         = STATX_SIZE | STATX_TYPE;
+        s->off         = (uint64_t)(uintptr_t)&st[i];
+        s->statx_flags = 0;
+        s->user_data   = UD(i, STEP_STATX);
+    }
+    w.f = f;
+    w.st = st;
+    if (ring_run(u, n, io_cqe, &w) != 0) return -1;
+
+    for (i = 0; i < n; ++i) {
+        if (f[i].err) continue;
+        if (!S_ISREG(st[i].stx_mode))          { f[i].err = EINVAL; continue; }
+        if (st[i].stx_size > MFA_URING_MAX_IO) { f[i].err = EFBIG;  continue; }
+        f[i].len = (size_t)st[i].stx_size;
+        f[i].buf = (uint8_t *)malloc(f[i].len ? f[i].len : 1);
+        if (!f[i].buf) f[i].err = ENOMEM;
+    }
+    return 0;
+}
+
+int mfa_uring_read(mfa_uring *u, mfa_uring_file *f, size_t n) {
+    struct statx *st = (struct statx *)malloc(u->window * sizeof *st);
+    size_t done;
+    int rc = 0;
+
+    if (!st) return -1;
+    for (done = 0; done < n && rc == 0; done += u->window) {
+        mfa_uring_file *wf = f + done;
+        unsigned i, k = (unsigned)(n - done < u->window ? n - done : u->window), queued = 0;
+        window_ctx w;
+
+        for (i = 0; i < k; ++i) { wf[i].buf = NULL; wf[i].len = 0; wf[i].err = 0; }
+        if (read_sizes(u, wf, k, st) != 0) { rc = -1; break; }
+        for (i = 0; i < k; ++i) {
+            if (wf[i].err) continue;
+            queue_chain(u, i, wf[i].path, O_RDONLY, IORING_OP_READ, wf[i].buf, wf[i].len);
+            ++queued;
+        }
+        w.f = wf;
+        w.st = st;
+        if (ring_run(u, queued * URING_CHAIN, io_cqe, &w) != 0) rc = -1;
+        for (i = 0; i < k; ++i) {
+            if (wf[i].err && wf[i].buf) { free(wf[i].buf); wf[i].buf = NULL; wf[i].len = 0; }
+        }
+    }
+    free(st);
+    return rc;
+}
+
+int mfa_uring_write(mfa_uring *u, mfa_uring_file *f, size_t n) {
+    size_t done;
+
+    for (done = 0; done < n; done += u->window) {
+        mfa_uring_file *wf = f + done;
+        unsigned i, k = (unsigned)(n - done < u->window ? n - done : u->window), queued = 0;
+        window_ctx w;
+
+        for (i = 0; i < k; ++i) {
+            wf[i].err = wf[i].len > MFA_URING_MAX_IO ? EFBIG : 0;
+            if (wf[i].err) continue;
+            queue_chain(u, i, wf[i].path, O_WRONLY | O_CREAT | O_TRUNC, IORING_OP_WRITE,
+                        wf[i].buf, wf[i].len);
+            ++queued;
+        }
+        w.f = wf;
+        w.st = NULL;
+        if (ring_run(u, queued * URING_CHAIN, io_cqe, &w) != 0) return -1;
+    }
+    return 0;
+}
+
+#else /* !MFA_HAVE_IO_URING */
+
+mfa_uring *mfa_uring_open(unsigned files) { (void)files; return NULL; }
+void mfa_uring_close(mfa_uring *u) { (void)u; }
+
+int mfa_uring_read(mfa_uring *u, mfa_uring_file *f, size_t n) {
+    (void)u; (void)f; (void)n;
+    errno = ENOSYS;
+    return -1;
+}
+
+int mfa_uring_write(mfa_uring *u, mfa_uring_file *f, size_t n) {
+    (void)u; (void)f; (void)n;
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif /* MFA_HAVE_IO_URING */
@@ -0,0 +1,55 @@
+#ifndef MFA_URING_H
+#define MFA_URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* ============================================================
+   Batched small-file I/O (io_uring)
+   ------------------------------------------------------------
+   Loading or extracting a small file costs several blocking
+   syscalls (open, stat, read or write, close), so many-file
+   workloads wait on syscall latency rather than bandwidth. A
+   batch here queues, for each file, an open into a slot of a
+   registered file table linked to its read or write and its
+   close, and submits whole windows of files with one
+   io_uring_enter: a couple of syscalls per window instead of
+   several per file.
+
+   Built only where <linux/io_uring.h> is usable (the build
+   defines MFA_HAVE_IO_URING); mfa_uring_open returns NULL when
+   the kernel lacks what is needed (direct-descriptor opens,
+   Linux 5.15) or io_uring is disabled, and callers then keep to
+   plain syscalls.
+   ============================================================ */
+
+typedef struct mfa_uring mfa_uring;
+
+/* One file of a batch. */
+typedef struct {
+    const char *path;
+    uint8_t    *buf;     /* read: allocated and filled; write: the bytes */
+    size_t      len;
+    int         err;     /* 0, or the errno of the step that failed */
+} mfa_uring_file;
+
+/* Largest file a batch reads or writes in one go. */
+#define MFA_URING_MAX_IO  (1u << 30)
+
+/* A ring with room for `files` files in flight, or NULL if io_uring
+   cannot be used here. */
+mfa_uring *mfa_uring_open(unsigned files);
+void       mfa_uring_close(mfa_uring *u);
+
+/* Read each of f[0..n) whole into a malloc'd buf (len bytes; the
+   caller frees it). Files over MFA_URING_MAX_IO get err EFBIG and
+   are left for the caller. Returns -1 only if the ring failed; per
+   file failures are in err. */
+int mfa_uring_read(mfa_uring *u, mfa_uring_file *f, size_t n);
+
+/* Create or truncate each of f[0..n) (mode 0666 less umask) and
+   write its len bytes. Parent directories must exist. Returns as
+   mfa_uring_read. */
+int mfa_uring_write(mfa_uring *u, mfa_uring_file *f, size_t n);
+
+#endif /* MFA_URING_H */
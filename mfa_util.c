@@ -1,5 +1,8 @@
-#include "linked_list.h"
+#define _POSIX_C_SOURCE 200809L
+
 #include "mfa_util.h"
+#include <sys/stat.h>
+#include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
@@ -18,6 +21,28 @@ int mfa_write_exact(FILE *fp, const void *buf, size_t n) {
     return fwrite(buf, 1, n, fp) == n ? 0 : -1;
 }
 
+int mfa_pread_exact(int fd, void *buf, size_t n, uint64_t off) {
+    uint8_t *p = (uint8_t *)buf;
+    while (n) {
+        ssize_t r = pread(fd, p, n, (off_t)off);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        p += r; n -= (size_t)r; off += (uint64_t)r;
+    }
+    return 0;
+}
+
+int mfa_write_fd_exact(int fd, const void *buf, size_t n) {
+    const uint8_t *p = (const uint8_t *)buf;
+    while (n) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+        p += w; n -= (size_t)w;
+    }
+    return 0;
+}
+
 /* ---- LE writers ---- */
 int mfa_w16(FILE *fp, uint16_t v) {
     uint8_t b[2] = { v & 0xFF, (uint8_t)(v >> 8) };
@@ -54,6 +79,31 @@ int mfa_r64(FILE *fp, uint64_t *out) {
     return 0;
 }
 
+/* ---- LE loads ---- */
+uint16_t mfa_ld16(const uint8_t *p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+uint32_t mfa_ld32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1]<<8)
+         | ((uint32_t)p[2]<<16) | ((uint32_t)p[3]<<24);
+}
+uint64_t mfa_ld64(const uint8_t *p) {
+    return (uint64_t)mfa_ld32(p) | ((uint64_t)mfa_ld32(p + 4) << 32);
+}
+
+/* ---- LE stores ---- */
+void mfa_st16(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t)v; p[1] = (uint8_t)(v >> 8);
+}
+void mfa_st32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)v;         p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16); p[3] = (uint8_t)(v >> 24);
+}
+void mfa_st64(uint8_t *p, uint64_t v) {
+    mfa_st32(p, (uint32_t)v);
+    mfa_st32(p + 4, (uint32_t)(v >> 32));
+}
+
 /* ---- Alignment ---- */
 long long mfa_pad_to(FILE *fp, unsigned long long off, unsigned align) {
     unsigned pad = (unsigned)((align - (off % align)) % align);
@@ -73,8 +123,35 @@ const char *mfa_basename(const char *p) {
     for (; *s; ++s) if (*s=='/'||*s=='\\') last = s+1;
     return last;
 }
-void mfa_sanitize(char *s) {
-    for (; *s; ++s) if (*s=='/'||*s=='\\'||*s==':') *s='_';
+int mfa_sanitize(char *s) {
+    char *comp = s;
+
+    if (*s == '\0' || *s == '/') return -1;
+    for (;; ++s) {
+        if (*s == '\\' || *s == ':') *s = '_';
+        if (*s == '/' || *s == '\0') {
+            size_t n = (size_t)(s - comp);
+            if (n == 0 || (n == 1 && comp[0] == '.') ||
+                (n == 2 && comp[0] == '.' && comp[1] == '.')) return -1;
+            if (*s == '\0') return 0;
+            comp = s + 1;
+        }
+    }
+}
+
+int mfa_make_parents(const char *path) {
+    char *p = mfa_strdup(path);
+    char *s;
+
+    if (!p) { errno = ENOMEM; return -1; }
+    for (s = p + 1; *s; ++s) {
+        if (*s != '/') continue;
+        *s = '\0';
+        if (mkdir(p, 0777) != 0 && errno != EEXIST) { free(p); return -1; }
+        *s = '/';
+    }
+    free(p);
+    return 0;
 }
 char *mfa_join_path(const char *dir, const char *name) {
     if (!dir || !*dir) return mfa_strdup(name);
@@ -89,33 +166,127 @@ char *mfa_join_path(const char *dir, const char *name) {
     return p;
 }
 
-/* Sort a list of paths in-place. */
-int mfa_sort_paths(linked_list *paths) {
-    linked_list_node *cur;
-    int swapped;
+/* ---- Misc ---- */
+int mfa_file_size(const char *path, uint64_t *out) {
+    struct stat st;
+    if (stat(path, &st) != 0) return -1;
+    if (!S_ISREG(st.st_mode)) { errno = EINVAL; return -1; }
+    *out = (uint64_t)st.st_size;
+    return 0;
+}
+
+int mfa_is_dir(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
 
-    if (!paths || ll_size(paths) < 2) return 0; /* nothing to do */
+int mfa_parse_size(const char *s, uint64_t *out) {
+    uint64_t v = 0;
+    const char *p = s;
 
-    do {
-        swapped = 0;
-        cur = paths->head;
+    if (!s || !*s) return -1;
+    for (; *p >= '0' && *p <= '9'; ++p) v = v * 10 + (uint64_t)(*p - '0');
+    if (p == s) return -1;
 
-        while (cur && cur->next) {
-            mfa_file *fa = (mfa_file *)cur->data;
-            mfa_file *fb = (mfa_file *)cur->next->data;
+    switch (*p) {
+    case 'k': case 'K': v <<= 10; ++p; break;
+    case 'm': case 'M': v <<= 20; ++p; break;
+    case 'g': case 'G': v <<= 30; ++p; break;
+    default: break;
+    }
+    if (p[0] == 'i' && p[1] == 'B') p += 2;
+    else if (*p == 'B') ++p;
+    if (*p) return -1;
 
-            const char *sa = (fa && fa->path) ? fa->path : "";
-            const char *sb = (fb && fb->path) ? fb->path : "";
+    *out = v;
+    return 0;
+}
 
-            if (strcmp(sa, sb) > 0) {
-                void *tmp = cur->data;                 /* swap entire payloads */
-                cur->data = cur->next->data;
-                cur->next->data = tmp;
-                swapped = 1;
-            }
-            cur = cur->next;
-        }
-    } while (swapped);
+/* ---- File table ---- */
+void mfa_files_init(mfa_file_table *t) {
+    t->files = NULL;
+    t->count = 0;
+    t->cap = 0;
+    t->strings = NULL;
+    t->str_left = 0;
+}
+
+/* Copied strings live in blocks of at least STR_BLOCK bytes, each
+   starting with a pointer to the previous block and filled from the
+   end down, so adding a file costs no allocation of its own and
+   pointers never move. */
+#define STR_BLOCK (64u * 1024u)
+
+static char *table_strdup(mfa_file_table *t, const char *s) {
+    size_t n = strlen(s) + 1;
+    char *dst;
+
+    if (n > t->str_left) {
+        size_t cap = n > STR_BLOCK ? n : STR_BLOCK;
+        char *blk = malloc(sizeof(char *) + cap);
+        if (!blk) return NULL;
+        memcpy(blk, &t->strings, sizeof(char *));
+        t->strings = blk;
+        t->str_left = cap;
+    }
+    t->str_left -= n;
+    dst = t->strings + sizeof(char *) + t->str_left;
+    memcpy(dst, s, n);
+    return dst;
+}
+
+int mfa_files_add(mfa_file_table *t, const char *path) {
+    mfa_file *f;
+    if (t->count == t->cap) {
+        size_t cap = t->cap ? t->cap * 2 : 64;
+        mfa_file *grown = realloc(t->files, cap * sizeof *grown);
+        if (!grown) return -1;
+        t->files = grown;
+        t->cap = cap;
+    }
+    f = &t->files[t->count++];
+    f->path = path;
+    f->name = NULL;
+    f->buf  = NULL;
+    f->len  = 0;
+    f->size = 0;
+    f->parts = NULL;
+    f->nparts = 0;
+    return 0;
+}
+
+int mfa_files_add_named(mfa_file_table *t, const char *path, const char *name) {
+    const char *p = table_strdup(t, path);
+    const char *n = p ? table_strdup(t, name) : NULL;
+
+    if (!n || mfa_files_add(t, p) != 0) return -1;
+    t->files[t->count - 1].name = n;
+    return 0;
+}
+
+void mfa_files_free(mfa_file_table *t) {
+    size_t i;
+    for (i = 0; i < t->count; ++i) free(t->files[i].buf);
+    free(t->files);
+    while (t->strings) {
+        char *prev;
+        memcpy(&prev, t->strings, sizeof(char *));
+        free(t->strings);
+        t->strings = prev;
+    }
+    mfa_files_init(t);
+}
+
+static int path_cmp(const void *a, const void *b) {
+    const mfa_file *fa = (const mfa_file *)a;
+    const mfa_file *fb = (const mfa_file *)b;
+    return strcmp(fa->path ? fa->path : "", fb->path ? fb->path : "");
+}
 
+/* Sort a file table by path in-place. */
+int mfa_sort_paths(mfa_file_table *files) {
+    if (!files) return -1;
+    if (files->count < 2) return 0; /* nothing to do */
+    qsort(files->files, files->count, sizeof *files->files, path_cmp);
     return 0;
 }
@@ -1,19 +1,50 @@
 #ifndef MFA_UTIL_H
 #define MFA_UTIL_H
 
-#include "linked_list.h"
-
 #include <stdio.h>
 #include <stdint.h>
 #include <stddef.h>
 
 /* ---------------- File handle ---------------- */
-typedef struct {
+typedef struct mfa_file {
     const char *path;  /* input path (not owned) */
+    const char *name;  /* stored name; NULL = basename of path */
     uint8_t    *buf;   /* loaded bytes (owned) */
     size_t      len;   /* size of buf */
+    uint64_t    size;  /* on-disk size (filled in by the packer) */
+
+    /* Packer-internal solid group: the entry is the concatenation
+       of parts[0..nparts) (not owned). */
+    struct mfa_file **parts;
+    size_t      nparts;
 } mfa_file;
 
+/* ---------------- File table ----------------
+   Inputs as one contiguous, growable array: sorting and packing
+   walk it linearly and adding a file costs no allocation of its
+   own. */
+typedef struct {
+    mfa_file *files;
+    size_t    count;
+    size_t    cap;
+    char     *strings;   /* chain of blocks for copied paths/names */
+    size_t    str_left;  /* free bytes in the newest block */
+} mfa_file_table;
+
+/* Empty table. */
+void mfa_files_init(mfa_file_table *t);
+
+/* Append an entry for path (not copied: it must outlive the table).
+   Returns 0, or -1 if out of memory. */
+int  mfa_files_add(mfa_file_table *t, const char *path);
+
+/* Append an entry for path stored as name; both are copied into the
+   table, which frees them with everything else. Returns 0 or -1. */
+int  mfa_files_add_named(mfa_file_table *t, const char *path, const char *name);
+
+/* Free loaded buffers and the table itself; t is left empty. */
+void mfa_files_free(mfa_file_table *t);
+
 /* ============================================================
    Utility helpers for MFA archive format
    ------------------------------------------------------------
@@ -29,6 +60,13 @@ int mfa_read_exact(FILE *fp, void *buf, size_t n);
 /* Write exactly n bytes; return 0 on success, -1 on error. */
 int mfa_write_exact(FILE *fp, const void *buf, size_t n);
 
+/* Positional read of exactly n bytes at off (no shared file position);
+   0 on success, -1 on error or EOF. */
+int mfa_pread_exact(int fd, void *buf, size_t n, uint64_t off);
+
+/* Write exactly n bytes to a raw fd; 0 on success, -1 on error. */
+int mfa_write_fd_exact(int fd, const void *buf, size_t n);
+
 /* -------- Little-endian writers -------- */
 
 int mfa_w16(FILE *fp, uint16_t v);
@@ -41,6 +79,18 @@ int mfa_r16(FILE *fp, uint16_t *out);
 int mfa_r32(FILE *fp, uint32_t *out);
 int mfa_r64(FILE *fp, uint64_t *out);
 
+/* -------- Little-endian loads from memory -------- */
+
+uint16_t mfa_ld16(const uint8_t *p);
+uint32_t mfa_ld32(const uint8_t *p);
+uint64_t mfa_ld64(const uint8_t *p);
+
+/* -------- Little-endian stores to memory -------- */
+
+void mfa_st16(uint8_t *p, uint16_t v);
+void mfa_st32(uint8_t *p, uint32_t v);
+void mfa_st64(uint8_t *p, uint64_t v);
+
 /* -------- Alignment / padding -------- */
 
 /* Pad file to next multiple of `align`, writing zeros.
@@ -49,17 +99,39 @@ long long mfa_pad_to(FILE *fp, unsigned long long off, unsigned align);
 
 /* -------- Path helpers -------- */
 
+/* malloc'd copy of s, or NULL. */
+char *mfa_strdup(const char *s);
+
 /* Return pointer to basename within a path. */
 const char *mfa_basename(const char *p);
 
-/* Sanitize path so no separators (replace with '_'). */
-void mfa_sanitize(char *s);
+/* Check a stored entry name before it is used as a path: '\\' and
+   ':' become '_', and names that are empty, absolute, or have an
+   empty, "." or ".." component are rejected (-1). Relative paths
+   such as "dir/sub/file" are kept. */
+int mfa_sanitize(char *s);
+
+/* Create the missing directories leading up to path's last
+   component. Returns 0, or -1 with errno set. */
+int mfa_make_parents(const char *path);
 
 /* Join directory + name into a newly malloc'd string.
    Caller must free. If dir is NULL/empty, just dup name. */
 char *mfa_join_path(const char *dir, const char *name);
 
-/* Sort a list of paths in-place. */
-int mfa_sort_paths(linked_list *paths);
+/* -------- Misc -------- */
+
+/* Size of a regular file in bytes; 0 on success, -1 on error. */
+int mfa_file_size(const char *path, uint64_t *out);
+
+/* Non-zero if path names a directory (following symlinks). */
+int mfa_is_dir(const char *path);
+
+/* Parse a byte count such as "512", "64K", "8M" or "2G".
+   Returns 0 on success, -1 if malformed. */
+int mfa_parse_size(const char *s, uint64_t *out);
+
+/* Sort a file table by path in-place, in O(n log n). */
+int mfa_sort_paths(mfa_file_table *files);
 
 #endif /* MFA_UTIL_H */
@@ -0,0 +1,221 @@
+#define _GNU_SOURCE  /* d_type */
+
+#include "mfa_walk.h"
+#include "mfa_pipeline.h"
+
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Walkers mostly wait on the filesystem, so the default is several
+   per CPU. */
+#define WALK_PER_CPU   4u
+#define WALK_MIN       8u
+#define WALK_MAX       64u
+
+/* A directory waiting to be read: its path on disk and its name in
+   the archive ("" at a nameless root), stored back to back. */
+typedef struct walk_dir {
+    struct walk_dir *next;
+    size_t           path_len;
+    char             text[1];   /* path '\0' name '\0' */
+} walk_dir;
+
+typedef struct {
+    mfa_file_table *t;
+    walk_dir       *todo;       /* LIFO, so the walk stays narrow */
+    unsigned        busy;       /* threads reading a directory */
+    int             failed;
+    pthread_mutex_t mu;
+    pthread_cond_t  cv;
+} walk_state;
+
+enum { WALK_SKIP, WALK_FILE, WALK_DIR, WALK_ERR };
+
+static const char *dir_path(const walk_dir *d) { return d->text; }
+static const char *dir_name(const walk_dir *d) { return d->text + d->path_len + 1; }
+
+/* a + "/" + b, or just b when a is empty, into dst. */
+static size_t join_len(const char *a, const char *b) {
+    return strlen(a) + (*a ? 1 : 0) + strlen(b);
+}
+static char *join_to(char *dst, const char *a, const char *b) {
+    size_t n = strlen(a);
+    memcpy(dst, a, n);
+    if (n) dst[n++] = '/';
+    strcpy(dst + n, b);
+    return dst;
+}
+
+/* Directory node for child `entry` of parent (or the root if parent
+   is NULL, with path and name as given). */
+static walk_dir *dir_new(const walk_dir *parent, const char *entry, const char *root_name) {
+    const char *ppath = parent ? dir_path(parent) : "";
+    const char *pname = parent ? dir_name(parent) : root_name;
+    size_t plen = parent ? join_len(ppath, entry) : strlen(entry);
+    size_t nlen = parent ? join_len(pname, entry) : strlen(pname);
+    walk_dir *d = (walk_dir *)malloc(sizeof *d + plen + nlen + 1);
+
+    if (!d) return NULL;
+    d->next = NULL;
+    d->path_len = plen;
+    if (parent) {
+        join_to(d->text, ppath, entry);
+        join_to(d->text + plen + 1, pname, entry);
+    } else {
+        strcpy(d->text, entry);
+        strcpy(d->text + plen + 1, pname);
+    }
+    return d;
+}
+
+/* What to do with one directory entry; stats only when readdir did
+   not say, or for symbolic links. */
+static int entry_type(DIR *dir, const struct dirent *de) {
+    struct stat st;
+    int fd = dirfd(dir);
+
+    if (de->d_type == DT_REG) return WALK_FILE;
+    if (de->d_type == DT_DIR) return WALK_DIR;
+    if (de->d_type != DT_UNKNOWN && de->d_type != DT_LNK) return WALK_SKIP;
+
+    if (fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) return WALK_ERR;
+    if (S_ISDIR(st.st_mode)) return WALK_DIR;
+    if (S_ISREG(st.st_mode)) return WALK_FILE;
+    if (!S_ISLNK(st.st_mode)) return WALK_SKIP;
+
+    /* Links to files are followed, to directories (and dangling
+       ones) skipped. */
+    if (fstatat(fd, de->d_name, &st, 0) != 0) return WALK_SKIP;
+    return S_ISREG(st.st_mode) ? WALK_FILE : WALK_SKIP;
+}
+
+/* Read one directory. Its files and subdirectories are gathered
+   privately and published under the lock in one go. */
+static int scan_dir(walk_state *w, const walk_dir *d) {
+    DIR *dir = opendir(dir_path(d));
+    struct dirent *de;
+    walk_dir *subdirs = NULL, *files = NULL, *x;
+    int rc = 0;
+
+    if (!dir) { perror(dir_path(d)); return -1; }
+    while (rc == 0 && (de = readdir(dir)) != NULL) {
+        int type;
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+
+        type = entry_type(dir, de);
+        if (type == WALK_ERR) {
+            fprintf(stderr, "%s/%s: ", dir_path(d), de->d_name);
+            perror("stat");
+            rc = -1;
+        } else if (type != WALK_SKIP) {
+            x = dir_new(d, de->d_name, NULL);
+            if (!x) { perror("malloc"); rc = -1; break; }
+            if (type == WALK_DIR) { x->next = subdirs; subdirs = x; }
+            else { x->next = files; files = x; }
+        }
+    }
+    closedir(dir);
+
+    pthread_mutex_lock(&w->mu);
+    for (x = files; x && rc == 0; x = x->next) {
+        if (mfa_files_add_named(w->t, dir_path(x), dir_name(x)) != 0) {
+            perror("malloc");
+            rc = -1;
+        }
+    }
+    if (rc == 0 && subdirs) {
+        for (x = subdirs; x->next; x = x->next) {}
+        x->next = w->todo;
+        w->todo = subdirs;
+        subdirs = NULL;
+        pthread_cond_broadcast(&w->cv);
+    }
+    pthread_mutex_unlock(&w->mu);
+
+    while (files) { x = files->next; free(files); files = x; }
+    while (subdirs) { x = subdirs->next; free(subdirs); subdirs = x; }
+    return rc;
+}
+
+static void *walk_main(void *arg) {
+    walk_state *w = (walk_state *)arg;
+
+    pthread_mutex_lock(&w->mu);
+    for (;;) {
+        walk_dir *d;
+        int rc;
+
+        while (!w->todo && w->busy && !w->failed) pthread_cond_wait(&w->cv, &w->mu);
+        if (!w->todo || w->failed) break;
+        d = w->todo;
+        w->todo = d->next;
+        ++w->busy;
+        pthread_mutex_unlock(&w->mu);
+
+        rc = scan_dir(w, d);
+        free(d);
+
+        pthread_mutex_lock(&w->mu);
+        --w->busy;
+        if (rc) w->failed = 1;
+        if (rc || (!w->todo && !w->busy)) pthread_cond_broadcast(&w->cv);
+    }
+    pthread_mutex_unlock(&w->mu);
+    return NULL;
+}
+
+int mfa_walk(mfa_file_table *t, const char *root, unsigned threads) {
+    walk_state w;
+    pthread_t *tids;
+    unsigned i, started = 0;
+    char *path = mfa_strdup(root);
+    const char *name;
+    size_t n;
+
+    if (!path) { perror("malloc"); return -1; }
+
+    /* "a/b/" is stored as "b/..."; "." and ".." add no prefix */
+    n = strlen(path);
+    while (n > 1 && path[n - 1] == '/') path[--n] = '\0';
+    name = mfa_basename(path);
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) name = "";
+
+    memset(&w, 0, sizeof w);
+    w.t = t;
+    w.todo = dir_new(NULL, path, name);
+    free(path);
+    if (!w.todo) { perror("malloc"); return -1; }
+
+    if (!threads) {
+        threads = mfa_cpu_count() * WALK_PER_CPU;
+        if (threads < WALK_MIN) threads = WALK_MIN;
+        if (threads > WALK_MAX) threads = WALK_MAX;
+    }
+    tids = (pthread_t *)calloc(threads, sizeof *tids);
+    if (!tids) { perror("calloc"); free(w.todo); return -1; }
+
+    pthread_mutex_init(&w.mu, NULL);
+    pthread_cond_init(&w.cv, NULL);
+    for (i = 0; i < threads; ++i) {
+        if (pthread_create(&tids[i], NULL, walk_main, &w) != 0) break;
+        ++started;
+    }
+    if (!started) walk_main(&w);  /* could not spawn: walk inline */
+    for (i = 0; i < started; ++i) pthread_join(tids[i], NULL);
+
+    /* Left over only after a failure */
+    while (w.todo) {
+        walk_dir *d = w.todo;
+        w.todo = d->next;
+        free(d);
+    }
+    pthread_cond_destroy(&w.cv);
+    pthread_mutex_destroy(&w.mu);
+    free(tids);
+    return w.failed ? -1 : 0;
+}
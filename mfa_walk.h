@@ -0,0 +1,26 @@
+#ifndef MFA_WALK_H
+#define MFA_WALK_H
+
+#include "mfa_util.h"
+
+/* ============================================================
+   Directory walk
+   ------------------------------------------------------------
+   Adds every regular file under a directory to a file table.
+   Directories are read by a pool of threads sharing one queue,
+   so the latency of opendir/readdir/stat on slow or network
+   filesystems overlaps instead of adding up. File types come
+   from readdir where the filesystem reports them; only the rest
+   are stat'ed. Symbolic links to files are followed, links to
+   directories are not (so the walk cannot loop).
+   ============================================================ */
+
+/* Add the files under root to t, each stored as its path relative
+   to root's parent ("src/lib/a.c" for root "/home/me/src"); a root
+   of "." or ".." adds paths relative to root itself. Entries are
+   appended in no particular order. `threads` is the walker count
+   (0 = a default sized for I/O latency). Returns 0, or -1 after
+   reporting the first error. */
+int mfa_walk(mfa_file_table *t, const char *root, unsigned threads);
+
+#endif /* MFA_WALK_H */